@@ -0,0 +1,272 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-cache.h"
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+	#include <process.h>
+	#define vtf_getpid _getpid
+#else
+	#include <unistd.h>
+	#define vtf_getpid getpid
+#endif
+
+#if GLIB_CHECK_VERSION(2,26,0)
+	typedef GStatBuf VtfStat_t;
+#else
+	typedef struct stat VtfStat_t;
+#endif
+
+#define CACHE_MAGIC				"VTFT"
+#define CACHE_VERSION			1
+#define CACHE_HEADER_SIZE		32	// magic, version, key, thumbnail size, image size
+#define CACHE_SUFFIX			".thumb"
+#define CACHE_TEMP_SUFFIX		".tmp"
+#define CACHE_TEMP_MAX_AGE		(10 * 60)	// seconds before a temporary file is taken to be left over from a crash
+#define CACHE_EVICT_INTERVAL	64	// writes between size checks, on average
+#define CACHE_MAX_DIMENSION		4096
+
+typedef struct CacheEntry
+{
+	gchar*	path;
+	time_t	mtime;
+	gint64	size;
+} CacheEntry_t;
+
+static guint32 read_u32(const guint8* p)
+{
+	return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static void write_u32(guint8* p, guint32 value)
+{
+	p[0] = value & 0xFF;
+	p[1] = (value >> 8) & 0xFF;
+	p[2] = (value >> 16) & 0xFF;
+	p[3] = value >> 24;
+}
+
+// FNV-1a
+static guint64 cache_hash(const guint8* data, gsize size, guint64 hash)
+{
+	gsize i;
+
+	for (i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= G_GUINT64_CONSTANT(0x100000001b3);
+	}
+	return hash;
+}
+
+static gboolean cache_key(const gchar* path, gint thumb_size, guint64* key)
+{
+	VtfStat_t	st;
+	guint8		values[24];
+
+	if ( g_stat(path,&st) != 0 )
+		return FALSE;
+
+	write_u32(values,		(guint32)((guint64)st.st_size & 0xFFFFFFFF));
+	write_u32(values + 4,	(guint32)((guint64)st.st_size >> 32));
+	write_u32(values + 8,	(guint32)((guint64)st.st_mtime & 0xFFFFFFFF));
+	write_u32(values + 12,	(guint32)((guint64)st.st_mtime >> 32));
+	write_u32(values + 16,	(guint32)thumb_size);
+	write_u32(values + 20,	CACHE_VERSION);
+
+	*key = cache_hash((const guint8*)path,strlen(path),G_GUINT64_CONSTANT(0xcbf29ce484222325));
+	*key = cache_hash(values,sizeof(values),*key);
+	return TRUE;
+}
+
+static gchar* cache_entry_path(const gchar* cache_dir, guint64 key)
+{
+	gchar name[32];
+
+	g_snprintf(name,sizeof(name),"%08x%08x" CACHE_SUFFIX,(guint32)(key >> 32),(guint32)key);
+	return g_build_filename(cache_dir,name,NULL);
+}
+
+gboolean vtf_cache_read(const gchar* cache_dir, const gchar* path, gint thumb_size, VtfThumbnail_t* thumb)
+{
+	guint64		key;
+	gchar*		entry;
+	FILE*		file;
+	guint8		header[CACHE_HEADER_SIZE];
+	gsize		size;
+	gboolean	result = FALSE;
+
+	if ( !cache_key(path,thumb_size,&key) )
+		return FALSE;
+
+	entry = cache_entry_path(cache_dir,key);
+	file = g_fopen(entry,"rb");
+
+	if ( file && fread(header,1,CACHE_HEADER_SIZE,file) == CACHE_HEADER_SIZE
+		&& memcmp(header,CACHE_MAGIC,4) == 0 && read_u32(header + 4) == CACHE_VERSION
+		&& read_u32(header + 8) == (guint32)(key >> 32) && read_u32(header + 12) == (guint32)key )
+	{
+		thumb->width = read_u32(header + 16);
+		thumb->height = read_u32(header + 20);
+		thumb->image_width = read_u32(header + 24);
+		thumb->image_height = read_u32(header + 28);
+
+		if ( thumb->width && thumb->height && thumb->width <= CACHE_MAX_DIMENSION && thumb->height <= CACHE_MAX_DIMENSION )
+		{
+			size = thumb->width * thumb->height * 3;
+			thumb->rgb = g_try_new(guint8,size);
+			result = thumb->rgb && fread(thumb->rgb,1,size,file) == size;
+		}
+	}
+
+	if (file)
+		fclose(file);
+
+	if (result)
+		g_utime(entry,NULL); // now the most recently used
+	else
+	{
+		g_free(thumb->rgb);
+		thumb->rgb = NULL;
+	}
+
+	g_free(entry);
+	return result;
+}
+
+static gint cache_entry_compare(gconstpointer a, gconstpointer b)
+{
+	time_t ta = ((const CacheEntry_t*)a)->mtime;
+	time_t tb = ((const CacheEntry_t*)b)->mtime;
+	return ta < tb ? -1 : ta > tb;
+}
+
+// Removes the least recently used entries until the cache is well under its size limit, and temporary files
+// which a crashed process left behind. Other processes may be doing the same, so files which have already gone
+// are fine.
+static void cache_evict(const gchar* cache_dir)
+{
+	GDir*			dir;
+	GArray*			entries;
+	const gchar*	name;
+	gint64			total = 0;
+	time_t			now = time(NULL);
+	guint			i;
+
+	dir = g_dir_open(cache_dir,0,NULL);
+	if (!dir)
+		return;
+
+	entries = g_array_new(FALSE,FALSE,sizeof(CacheEntry_t));
+
+	while ( (name = g_dir_read_name(dir)) != NULL )
+	{
+		CacheEntry_t	entry;
+		VtfStat_t		st;
+		gboolean		temp = g_str_has_suffix(name,CACHE_TEMP_SUFFIX);
+
+		if ( !temp && !g_str_has_suffix(name,CACHE_SUFFIX) )
+			continue;
+
+		entry.path = g_build_filename(cache_dir,name,NULL);
+		if ( g_stat(entry.path,&st) != 0 )
+		{
+			g_free(entry.path);
+			continue;
+		}
+
+		// Temporary files still being written count towards the total, but only the writer may remove them
+		if (temp)
+		{
+			if (now - st.st_mtime > CACHE_TEMP_MAX_AGE)
+				g_remove(entry.path);
+			else
+				total += st.st_size;
+			g_free(entry.path);
+			continue;
+		}
+
+		entry.mtime = st.st_mtime;
+		entry.size = st.st_size;
+		total += entry.size;
+		g_array_append_val(entries,entry);
+	}
+	g_dir_close(dir);
+
+	if (total > VTF_CACHE_MAX_SIZE)
+	{
+		g_array_sort(entries,cache_entry_compare);
+		for (i = 0; i < entries->len && total > VTF_CACHE_MAX_SIZE / 4 * 3; i++)
+		{
+			CacheEntry_t* entry = &g_array_index(entries,CacheEntry_t,i);
+			g_remove(entry->path);
+			total -= entry->size;
+		}
+	}
+
+	for (i = 0; i < entries->len; i++)
+		g_free(g_array_index(entries,CacheEntry_t,i).path);
+	g_array_free(entries,TRUE);
+}
+
+void vtf_cache_write(const gchar* cache_dir, const gchar* path, gint thumb_size, const VtfThumbnail_t* thumb)
+{
+	guint64		key;
+	gchar*		entry;
+	gchar*		temp;
+	FILE*		file;
+	guint8		header[CACHE_HEADER_SIZE];
+	gsize		size = thumb->width * thumb->height * 3;
+	gboolean	result;
+
+	if ( !cache_key(path,thumb_size,&key) || thumb->width > CACHE_MAX_DIMENSION || thumb->height > CACHE_MAX_DIMENSION )
+		return;
+
+	g_mkdir_with_parents(cache_dir,0700);
+
+	memcpy(header,CACHE_MAGIC,4);
+	write_u32(header + 4,	CACHE_VERSION);
+	write_u32(header + 8,	(guint32)(key >> 32));
+	write_u32(header + 12,	(guint32)key);
+	write_u32(header + 16,	thumb->width);
+	write_u32(header + 20,	thumb->height);
+	write_u32(header + 24,	thumb->image_width);
+	write_u32(header + 28,	thumb->image_height);
+
+	// Written in full under a name of its own, then renamed into place, so that readers never see half of it
+	entry = cache_entry_path(cache_dir,key);
+	temp = g_strdup_printf("%s.%u" CACHE_TEMP_SUFFIX,entry,(guint)vtf_getpid());
+
+	file = g_fopen(temp,"wb");
+	result = file && fwrite(header,1,CACHE_HEADER_SIZE,file) == CACHE_HEADER_SIZE && fwrite(thumb->rgb,1,size,file) == size;
+	if (file)
+		result = fclose(file) == 0 && result;
+
+#ifdef _WIN32
+	// rename() won't replace an existing file on Windows. A reader in between just misses.
+	if (result)
+		g_remove(entry);
+#endif
+	if ( !result || g_rename(temp,entry) != 0 )
+		g_remove(temp);
+
+	g_free(temp);
+	g_free(entry);
+
+	if ( g_random_int_range(0,CACHE_EVICT_INTERVAL) == 0 )
+		cache_evict(cache_dir);
+}
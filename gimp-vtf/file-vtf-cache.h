@@ -0,0 +1,36 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_CACHE_H
+#define FILE_VTF_CACHE_H
+
+#include <glib.h>
+
+// Decoded thumbnails, kept on disk and shared by every plug-in process. Entries are keyed by the VTF's path,
+// size and modification time and by the requested thumbnail size, so they never go stale. Entries are replaced
+// by renaming, so reading needs no locks: a damaged or missing entry is just a miss.
+
+#define VTF_CACHE_MAX_SIZE (64 << 20) // bytes; the least recently used entries are removed beyond this
+
+typedef struct VtfThumbnail
+{
+	guint	width, height;				// of the thumbnail
+	guint	image_width, image_height;	// of the VTF
+	guint8*	rgb;
+} VtfThumbnail_t;
+
+// FALSE on a miss. Free thumb->rgb with g_free().
+gboolean	vtf_cache_read(const gchar* cache_dir, const gchar* path, gint thumb_size, VtfThumbnail_t* thumb);
+
+// The cache is only an optimisation, so failures are ignored
+void		vtf_cache_write(const gchar* cache_dir, const gchar* path, gint thumb_size, const VtfThumbnail_t* thumb);
+
+#endif
@@ -0,0 +1,574 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-composite.h"
+#include "file-vtf-pool.h"
+#include "file-vtf-simd.h"
+
+#include <string.h>
+
+#define COMPOSITE_BAND_ROWS	64
+
+// Reads any type of drawable as RGBA8888, so that the image never has to be converted to RGB
+typedef struct DrawableReader
+{
+	GimpDrawable*	drawable;
+	GimpPixelRgn	pixel_rgn;
+	GimpImageType	type;
+	gint			offset_x, offset_y;
+	gint			x0, y0, x1, y1;	// the part of the image it covers
+	guint32			palette[256];	// greyscale or indexed colour to RGBA
+	guint8*			raw;			// one band in the drawable's own format
+} DrawableReader_t;
+
+typedef struct ExpandBand
+{
+	const DrawableReader_t*	reader;
+	guint8*					dest;
+	gint					dest_stride;
+} ExpandBand_t;
+
+// GIMP 2.8's legacy compositing, done in floats. Results can differ from GIMP's own by a rounding step.
+
+typedef struct CompositeLayer
+{
+	guint8*					dest;		// first row of the band, at the layer's left edge
+	gint					dest_stride;
+	const guint8*			src;		// RGBA
+	gint					src_stride;
+	const guint8*			mask;		// NULL if there isn't one
+	gint					mask_stride;
+	gint					width;
+	float					opacity;
+	GimpLayerModeEffects	mode;
+	gboolean				initial;	// bottom of the stack, which GIMP copies whatever its mode
+} CompositeLayer_t;
+
+static float	unorm_to_float[256];
+static gboolean	tables_ready = FALSE;
+
+static void composite_init_tables()
+{
+	gint i;
+
+	if (tables_ready)
+		return;
+
+	for (i = 0; i < 256; i++)
+		unorm_to_float[i] = i / 255.0f;
+	tables_ready = TRUE;
+}
+
+/*
+ * Reading
+ */
+
+static void reader_palette_entry(guint32* entry, guint8 r, guint8 g, guint8 b)
+{
+	guint8 rgba[4];
+	rgba[0] = r;
+	rgba[1] = g;
+	rgba[2] = b;
+	rgba[3] = 255;
+	memcpy(entry,rgba,4);
+}
+
+// Returns FALSE if out of memory
+static gboolean reader_open(DrawableReader_t* reader, gint32 drawable_ID, gint width, gint height)
+{
+	gint i;
+
+	memset(reader,0,sizeof(DrawableReader_t));
+
+	reader->drawable = gimp_drawable_get(drawable_ID);
+	reader->type = gimp_drawable_type(drawable_ID);
+	gimp_drawable_offsets(drawable_ID,&reader->offset_x,&reader->offset_y);
+
+	reader->x0 = MAX(reader->offset_x,0);
+	reader->y0 = MAX(reader->offset_y,0);
+	reader->x1 = MAX(reader->x0,MIN(reader->offset_x + (gint)reader->drawable->width,width));
+	reader->y1 = MAX(reader->y0,MIN(reader->offset_y + (gint)reader->drawable->height,height));
+
+	switch (reader->type)
+	{
+	case GIMP_GRAY_IMAGE:
+	case GIMP_GRAYA_IMAGE:
+		for (i = 0; i < 256; i++)
+			reader_palette_entry(&reader->palette[i],i,i,i);
+		break;
+	case GIMP_INDEXED_IMAGE:
+	case GIMP_INDEXEDA_IMAGE:
+		{
+			gint	num_colours = 0;
+			guchar*	colourmap = gimp_image_get_colormap(gimp_item_get_image(drawable_ID),&num_colours);
+
+			for (i = 0; i < 256; i++)
+				if (i < num_colours)
+					reader_palette_entry(&reader->palette[i],colourmap[i*3],colourmap[i*3+1],colourmap[i*3+2]);
+				else
+					reader_palette_entry(&reader->palette[i],0,0,0);
+			g_free(colourmap);
+		}
+		break;
+	}
+
+	reader->raw = g_try_new(guint8,MAX(reader->x1 - reader->x0,1) * reader->drawable->bpp * COMPOSITE_BAND_ROWS);
+	if (!reader->raw)
+	{
+		gimp_drawable_detach(reader->drawable);
+		return FALSE;
+	}
+
+	gimp_pixel_rgn_init(&reader->pixel_rgn, reader->drawable, 0, 0, reader->drawable->width, reader->drawable->height, FALSE, FALSE);
+
+	// Bands usually straddle two rows of tiles
+	gimp_tile_cache_ntiles(2 * (reader->drawable->width / gimp_tile_width() + 2));
+	return TRUE;
+}
+
+static void reader_close(DrawableReader_t* reader)
+{
+	g_free(reader->raw);
+	gimp_drawable_detach(reader->drawable);
+}
+
+static void reader_expand_row(guint row, gpointer user_data)
+{
+	const ExpandBand_t*		band = (const ExpandBand_t*)user_data;
+	const DrawableReader_t*	reader = band->reader;
+	gint					width = reader->x1 - reader->x0;
+	gint					bpp = reader->drawable->bpp;
+	const guint8*			src = reader->raw + row * width * bpp;
+	guint8*					dest = band->dest + row * band->dest_stride;
+	guint32*				dest32 = (guint32*)dest;
+	gint					x;
+
+	switch (reader->type)
+	{
+	case GIMP_RGBA_IMAGE:
+		memcpy(dest,src,width * 4);
+		break;
+	case GIMP_RGB_IMAGE:
+		for (x = 0; x < width; x++, src += 3, dest += 4)
+		{
+			dest[0] = src[0];
+			dest[1] = src[1];
+			dest[2] = src[2];
+			dest[3] = 255;
+		}
+		break;
+	case GIMP_GRAY_IMAGE:
+	case GIMP_INDEXED_IMAGE:
+		for (x = 0; x < width; x++)
+			dest32[x] = reader->palette[src[x]];
+		break;
+	case GIMP_GRAYA_IMAGE:
+	case GIMP_INDEXEDA_IMAGE:
+		for (x = 0; x < width; x++, src += 2)
+		{
+			dest32[x] = reader->palette[src[0]];
+			dest[x * 4 + 3] = src[1];
+		}
+		break;
+	}
+}
+
+// Expands rows [y,y+rows) of the image, as far as the drawable covers them, to dest (which is at x0)
+static void reader_read(DrawableReader_t* reader, gint y, gint rows, guint8* dest, gint dest_stride)
+{
+	ExpandBand_t band;
+
+	gimp_pixel_rgn_get_rect(&reader->pixel_rgn, reader->raw, reader->x0 - reader->offset_x, y - reader->offset_y, reader->x1 - reader->x0, rows);
+
+	band.reader = reader;
+	band.dest = dest;
+	band.dest_stride = dest_stride;
+	vtf_parallel_for(rows,reader_expand_row,&band);
+}
+
+gboolean vtf_read_drawable(gint32 drawable_ID, gint width, gint height, guint8* rgba)
+{
+	DrawableReader_t	reader;
+	gint				y;
+
+	if (!reader_open(&reader,drawable_ID,width,height))
+		return FALSE;
+
+	// Anything the drawable doesn't cover is transparent
+	if (reader.x0 > 0 || reader.y0 > 0 || reader.x1 < width || reader.y1 < height)
+		memset(rgba,0,width * height * 4);
+
+	for (y = reader.y0; y < reader.y1; y += COMPOSITE_BAND_ROWS)
+		reader_read(&reader, y, MIN(COMPOSITE_BAND_ROWS,reader.y1 - y), rgba + (y * width + reader.x0) * 4, width * 4);
+
+	reader_close(&reader);
+	return TRUE;
+}
+
+/*
+ * Compositing
+ */
+
+static gboolean composite_mode_supported(GimpLayerModeEffects mode)
+{
+	switch (mode)
+	{
+	case GIMP_NORMAL_MODE:
+	case GIMP_MULTIPLY_MODE:
+	case GIMP_SCREEN_MODE:
+	case GIMP_OVERLAY_MODE:
+	case GIMP_DIFFERENCE_MODE:
+	case GIMP_ADDITION_MODE:
+	case GIMP_SUBTRACT_MODE:
+	case GIMP_DARKEN_ONLY_MODE:
+	case GIMP_LIGHTEN_ONLY_MODE:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+gboolean vtf_can_composite_group(gint32 group_ID)
+{
+	gint*		children;
+	gint		num_children, i;
+	gboolean	result = TRUE;
+
+	children = gimp_item_get_children(group_ID,&num_children);
+
+	for (i = 0; i < num_children && result; i++)
+	{
+		gint32 mask_ID;
+
+		if (!gimp_item_get_visible(children[i]))
+			continue;
+
+		if ( !composite_mode_supported(gimp_layer_get_mode(children[i])) )
+			result = FALSE;
+		else if (gimp_item_is_group(children[i]))
+			result = vtf_can_composite_group(children[i]);
+		else if ( (mask_ID = gimp_layer_get_mask(children[i])) != -1 && gimp_layer_get_show_mask(children[i]) )
+			result = FALSE;
+	}
+
+	g_free(children);
+	return result;
+}
+
+static vtf_v4 composite_blend(GimpLayerModeEffects mode, vtf_v4 b, vtf_v4 s)
+{
+	const vtf_v4 one = v4_splat(1);
+
+	switch (mode)
+	{
+	case GIMP_MULTIPLY_MODE:
+		return v4_mul(b,s);
+	case GIMP_SCREEN_MODE:
+		return v4_sub(one, v4_mul(v4_sub(one,b), v4_sub(one,s)));
+	case GIMP_OVERLAY_MODE:
+		// GIMP 2.8's "overlay" is really soft light
+		return v4_mul(b, v4_add(b, v4_mul(v4_add(s,s), v4_sub(one,b))));
+	case GIMP_DIFFERENCE_MODE:
+		return v4_max(v4_sub(b,s), v4_sub(s,b));
+	case GIMP_ADDITION_MODE:
+		return v4_min(v4_add(b,s), one);
+	case GIMP_SUBTRACT_MODE:
+		return v4_max(v4_sub(b,s), v4_zero());
+	case GIMP_DARKEN_ONLY_MODE:
+		return v4_min(b,s);
+	case GIMP_LIGHTEN_ONLY_MODE:
+		return v4_max(b,s);
+	}
+	return s;
+}
+
+static void composite_row(guint row, gpointer user_data)
+{
+	const CompositeLayer_t*	layer = (const CompositeLayer_t*)user_data;
+	guint8*					dest = layer->dest + row * layer->dest_stride;
+	const guint8*			src = layer->src + row * layer->src_stride;
+	const guint8*			mask = layer->mask ? layer->mask + row * layer->mask_stride : NULL;
+	const vtf_v4			scale = v4_splat(255);
+	const vtf_v4			half = v4_splat(0.5f);
+	float					v[4];
+	gint					x;
+
+	for (x = 0; x < layer->width; x++, dest += 4, src += 4)
+	{
+		vtf_v4	s = v4_set(unorm_to_float[src[0]], unorm_to_float[src[1]], unorm_to_float[src[2]], 0);
+		vtf_v4	b = v4_set(unorm_to_float[dest[0]], unorm_to_float[dest[1]], unorm_to_float[dest[2]], 0);
+		float	src_alpha = unorm_to_float[src[3]];
+		float	dest_alpha = unorm_to_float[dest[3]];
+		float	alpha, new_alpha;
+		vtf_v4	out;
+
+		if (layer->initial)
+		{
+			alpha = src_alpha * layer->opacity;
+			if (mask)
+				alpha *= unorm_to_float[mask[x]];
+			out = v4_add(s, v4_set(0,0,0,alpha));
+		}
+		else
+		{
+			vtf_v4 colour = s;
+
+			// Modes other than Normal can't make the image more opaque than it already is
+			if (layer->mode != GIMP_NORMAL_MODE)
+			{
+				colour = composite_blend(layer->mode,b,s);
+				src_alpha = MIN(src_alpha,dest_alpha);
+			}
+
+			alpha = src_alpha * layer->opacity;
+			if (mask)
+				alpha *= unorm_to_float[mask[x]];
+
+			new_alpha = dest_alpha + (1 - dest_alpha) * alpha;
+			if (new_alpha <= 0)
+				continue;
+
+			out = v4_madd(v4_sub(colour,b), v4_splat(alpha / new_alpha), b);
+			out = v4_add(out, v4_set(0,0,0,new_alpha));
+		}
+
+		out = v4_min(v4_max(out,v4_zero()),v4_splat(1));
+		v4_store(v, v4_floor_pos(v4_madd(out,scale,half)));
+
+		dest[0] = (guint8)v[0];
+		dest[1] = (guint8)v[1];
+		dest[2] = (guint8)v[2];
+		dest[3] = (guint8)v[3];
+	}
+}
+
+static gboolean composite_layer(gint32 layer_ID, gint width, gint height, guint8* rgba, gboolean initial)
+{
+	DrawableReader_t	reader;
+	GimpDrawable*		mask_drawable = NULL;
+	GimpPixelRgn		mask_rgn;
+	CompositeLayer_t	layer;
+	gint32				mask_ID;
+	gint				y;
+	guint8*				src;
+	guint8*				mask = NULL;
+
+	if (!reader_open(&reader,layer_ID,width,height))
+		return FALSE;
+
+	if (reader.x0 >= reader.x1 || reader.y0 >= reader.y1)
+	{
+		reader_close(&reader);
+		return TRUE;
+	}
+
+	layer.width = reader.x1 - reader.x0;
+	layer.src_stride = layer.width * 4;
+	layer.mask_stride = layer.width;
+	layer.dest_stride = width * 4;
+	layer.opacity = (float)(gimp_layer_get_opacity(layer_ID) / 100.0);
+	layer.mode = gimp_layer_get_mode(layer_ID);
+	layer.initial = initial;
+
+	src = g_try_new(guint8,layer.src_stride * COMPOSITE_BAND_ROWS);
+
+	mask_ID = gimp_layer_get_mask(layer_ID);
+	if (mask_ID != -1 && gimp_layer_get_apply_mask(layer_ID))
+	{
+		mask_drawable = gimp_drawable_get(mask_ID);
+		mask = g_try_new(guint8,layer.mask_stride * COMPOSITE_BAND_ROWS);
+	}
+
+	if (!src || (mask_drawable && !mask))
+	{
+		g_free(src);
+		g_free(mask);
+		if (mask_drawable)
+			gimp_drawable_detach(mask_drawable);
+		reader_close(&reader);
+		return FALSE;
+	}
+
+	if (mask_drawable)
+		gimp_pixel_rgn_init(&mask_rgn, mask_drawable, 0, 0, mask_drawable->width, mask_drawable->height, FALSE, FALSE);
+
+	layer.src = src;
+	layer.mask = mask;
+
+	for (y = reader.y0; y < reader.y1; y += COMPOSITE_BAND_ROWS)
+	{
+		gint rows = MIN(COMPOSITE_BAND_ROWS,reader.y1 - y);
+
+		reader_read(&reader, y, rows, src, layer.src_stride);
+		if (mask_drawable)
+			gimp_pixel_rgn_get_rect(&mask_rgn, mask, reader.x0 - reader.offset_x, y - reader.offset_y, layer.width, rows);
+
+		layer.dest = rgba + (y * width + reader.x0) * 4;
+		vtf_parallel_for(rows,composite_row,&layer);
+	}
+
+	g_free(src);
+	g_free(mask);
+	if (mask_drawable)
+		gimp_drawable_detach(mask_drawable);
+	reader_close(&reader);
+	return TRUE;
+}
+
+static gboolean composite_children(gint32 group_ID, gint width, gint height, guint8* rgba)
+{
+	gint*		children;
+	gint		num_children, i;
+	gboolean	initial = TRUE;
+	gboolean	result = TRUE;
+
+	// Children are listed from the top down
+	children = gimp_item_get_children(group_ID,&num_children);
+
+	for (i = num_children - 1; i >= 0 && result; i--)
+	{
+		if (!gimp_item_get_visible(children[i]))
+			continue;
+
+		if (gimp_item_is_group(children[i]))
+		{
+			CompositeLayer_t	layer;
+			guint8*				group_rgba = g_try_new0(guint8,width * height * 4);
+
+			result = group_rgba && composite_children(children[i],width,height,group_rgba);
+			if (result)
+			{
+				layer.dest = rgba;
+				layer.dest_stride = layer.src_stride = width * 4;
+				layer.src = group_rgba;
+				layer.mask = NULL;
+				layer.mask_stride = 0;
+				layer.width = width;
+				layer.opacity = (float)(gimp_layer_get_opacity(children[i]) / 100.0);
+				layer.mode = gimp_layer_get_mode(children[i]);
+				layer.initial = initial;
+
+				vtf_parallel_for(height,composite_row,&layer);
+			}
+			g_free(group_rgba);
+		}
+		else
+			result = composite_layer(children[i],width,height,rgba,initial);
+
+		initial = FALSE;
+	}
+
+	g_free(children);
+	return result;
+}
+
+gboolean vtf_composite_group(gint32 group_ID, gint width, gint height, guint8* rgba)
+{
+	gdouble	opacity;
+	gint	i;
+
+	composite_init_tables();
+
+	memset(rgba,0,width * height * 4);
+	if (!composite_children(group_ID,width,height,rgba))
+		return FALSE;
+
+	// The group is the bottom layer of its own projection
+	opacity = gimp_layer_get_opacity(group_ID) / 100.0;
+	if (opacity < 1)
+		for (i = 0; i < width * height; i++)
+			rgba[i * 4 + 3] = (guint8)(rgba[i * 4 + 3] * opacity + 0.5);
+
+	return TRUE;
+}
+
+gboolean vtf_read_alpha_layer(gint32 layer_ID, gint width, gint height, guint8* plane)
+{
+	DrawableReader_t	reader;
+	gint				x, y, band_y, stride;
+	guint8*				band;
+
+	memset(plane,0,width * height);
+
+	if (!reader_open(&reader,layer_ID,width,height))
+		return FALSE;
+
+	stride = MAX(reader.x1 - reader.x0,1) * 4;
+	band = g_try_new(guint8,stride * COMPOSITE_BAND_ROWS);
+	if (!band)
+	{
+		reader_close(&reader);
+		return FALSE;
+	}
+
+	for (band_y = reader.y0; band_y < reader.y1; band_y += COMPOSITE_BAND_ROWS)
+	{
+		gint rows = MIN(COMPOSITE_BAND_ROWS,reader.y1 - band_y);
+
+		reader_read(&reader, band_y, rows, band, stride);
+
+		for (y = 0; y < rows; y++)
+		{
+			guint8*			out = plane + (band_y + y) * width + reader.x0;
+			const guint8*	in = band + y * stride;
+
+			// Same as adding a "grayscale copy of layer" mask: intensity, with transparent areas black
+			for (x = reader.x0; x < reader.x1; x++, in += 4, out++)
+				*out = (guint8)((((in[0] * 77 + in[1] * 151 + in[2] * 28 + 128) >> 8) * in[3] + 127) / 255);
+		}
+	}
+
+	g_free(band);
+	reader_close(&reader);
+	return TRUE;
+}
+
+typedef struct AlphaPlane
+{
+	guint8*			rgba;
+	const guint8*	plane;
+	gint			width;
+} AlphaPlane_t;
+
+static void apply_alpha_row(guint row, gpointer user_data)
+{
+	const AlphaPlane_t*	job = (const AlphaPlane_t*)user_data;
+	guint8*				rgba = job->rgba + row * job->width * 4;
+	const guint8*		plane = job->plane + row * job->width;
+	const vtf_v4		scale = v4_splat(1 / 255.0f);
+	const vtf_v4		half = v4_splat(0.5f);
+	float				v[4];
+	gint				x = 0;
+
+	for (; x + 4 <= job->width; x += 4, rgba += 16, plane += 4)
+	{
+		vtf_v4 a = v4_set(rgba[3], rgba[7], rgba[11], rgba[15]);
+		vtf_v4 m = v4_set(plane[0], plane[1], plane[2], plane[3]);
+
+		v4_store(v, v4_floor_pos(v4_madd(v4_mul(a,m),scale,half)));
+		rgba[3] = (guint8)v[0];
+		rgba[7] = (guint8)v[1];
+		rgba[11] = (guint8)v[2];
+		rgba[15] = (guint8)v[3];
+	}
+	for (; x < job->width; x++, rgba += 4, plane++)
+		rgba[3] = (guint8)((rgba[3] * *plane + 127) / 255);
+}
+
+void vtf_apply_alpha_plane(guint8* rgba, const guint8* plane, gint width, gint height)
+{
+	AlphaPlane_t job;
+
+	job.rgba = rgba;
+	job.plane = plane;
+	job.width = width;
+
+	vtf_parallel_for(height,apply_alpha_row,&job);
+}
@@ -0,0 +1,38 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_COMPOSITE_H
+#define FILE_VTF_COMPOSITE_H
+
+#include <libgimp/gimp.h>
+
+// Reads a drawable of any type as an image-sized RGBA8888 buffer. Areas outside it are transparent.
+// Returns FALSE if out of memory.
+gboolean vtf_read_drawable(gint32 drawable_ID, gint width, gint height, guint8* rgba);
+
+// Flattens the visible children of a layer group into an image-sized RGBA8888 buffer, as if the group were
+// the only visible thing in the image. Nothing about the image is changed, so GIMP doesn't have to re-project it.
+
+// FALSE if the group contains something that can't be reproduced here (e.g. an unusual layer mode or a
+// layer mask being displayed), in which case GIMP will have to merge it instead.
+gboolean vtf_can_composite_group(gint32 group_ID);
+
+// Call vtf_can_composite_group() first. Returns FALSE if out of memory.
+gboolean vtf_composite_group(gint32 group_ID, gint width, gint height, guint8* rgba);
+
+// Reads a layer's greyscale intensity into an image-sized plane, for use as another layer's alpha. Areas
+// outside the layer are 0. Returns FALSE if out of memory.
+gboolean vtf_read_alpha_layer(gint32 layer_ID, gint width, gint height, guint8* plane);
+
+// Multiplies the alpha of each RGBA8888 pixel by the plane
+void vtf_apply_alpha_plane(guint8* rgba, const guint8* plane, gint width, gint height);
+
+#endif
@@ -0,0 +1,1068 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-dxt.h"
+#include "file-vtf-pool.h"
+#include "file-vtf-simd.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+typedef struct DxtBlock
+{
+	float	r[16], g[16], b[16];	// all 16 pixels, laid out for the index fitting kernel
+	guint8	a[16];
+	guint16	transparent;			// DXT1 with alpha: one bit per pixel which will be index 3
+
+	guint	num_points;				// the pixels that endpoints must be chosen for
+	float	points[16][3];
+} DxtBlock_t;
+
+typedef struct DxtColourResult
+{
+	float		error;
+	guint16		c0, c1;
+	guint32		indices;
+	gboolean	four_colour;
+} DxtColourResult_t;
+
+typedef struct DxtAlphaResult
+{
+	guint		error;
+	guint8		a0, a1;
+	guint8		indices[16];
+} DxtAlphaResult_t;
+
+guint dxt_block_size(VtfDxtFormat_t format)
+{
+	return format == DXT_FORMAT_DXT1 || format == DXT_FORMAT_DXT1_ONEBITALPHA || format == DXT_FORMAT_ATI1N ? 8 : 16;
+}
+
+guint dxt_surface_size(guint width, guint height, VtfDxtFormat_t format)
+{
+	return MAX(1,(width + 3) / 4) * MAX(1,(height + 3) / 4) * dxt_block_size(format);
+}
+
+/*
+ * Block setup
+ */
+
+// Blocks which overhang the edge of a small mip repeat the last row/column
+static void dxt_load_block(DxtBlock_t* block, const guint8* rgba, guint width, guint height, guint bx, guint by, gboolean one_bit_alpha)
+{
+	guint i;
+
+	block->transparent = 0;
+	block->num_points = 0;
+
+	for (i = 0; i < 16; i++)
+	{
+		guint x = MIN(bx * 4 + (i & 3), width - 1);
+		guint y = MIN(by * 4 + (i >> 2), height - 1);
+		const guint8* px = rgba + (y * width + x) * 4;
+
+		block->r[i] = px[0];
+		block->g[i] = px[1];
+		block->b[i] = px[2];
+		block->a[i] = px[3];
+
+		if (one_bit_alpha && px[3] < 128)
+			block->transparent |= 1 << i;
+		else
+		{
+			block->points[block->num_points][0] = px[0];
+			block->points[block->num_points][1] = px[1];
+			block->points[block->num_points][2] = px[2];
+			block->num_points++;
+		}
+	}
+}
+
+/*
+ * Colour
+ */
+
+static guint16 dxt_pack565(const float* rgb)
+{
+	gint r = (gint)(CLAMP(rgb[0],0.0f,255.0f) * (31.0f / 255.0f) + 0.5f);
+	gint g = (gint)(CLAMP(rgb[1],0.0f,255.0f) * (63.0f / 255.0f) + 0.5f);
+	gint b = (gint)(CLAMP(rgb[2],0.0f,255.0f) * (31.0f / 255.0f) + 0.5f);
+	return (guint16)((r << 11) | (g << 5) | b);
+}
+
+static void dxt_unpack565(guint16 c, gint* rgb)
+{
+	gint r = (c >> 11) & 31;
+	gint g = (c >> 5) & 63;
+	gint b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// The palette as the decoder sees it. Shared with decompression so that the encoder minimises error against
+// exactly what will be displayed.
+static void dxt_decode_palette(guint16 c0, guint16 c1, gboolean allow_three_colour, guint8 palette[4][4])
+{
+	gint	rgb0[3], rgb1[3];
+	guint	i;
+
+	dxt_unpack565(c0,rgb0);
+	dxt_unpack565(c1,rgb1);
+
+	for (i = 0; i < 3; i++)
+	{
+		palette[0][i] = (guint8)rgb0[i];
+		palette[1][i] = (guint8)rgb1[i];
+
+		if (c0 > c1 || !allow_three_colour)
+		{
+			palette[2][i] = (guint8)((2 * rgb0[i] + rgb1[i] + 1) / 3);
+			palette[3][i] = (guint8)((rgb0[i] + 2 * rgb1[i] + 1) / 3);
+		}
+		else
+		{
+			palette[2][i] = (guint8)((rgb0[i] + rgb1[i]) / 2);
+			palette[3][i] = 0;
+		}
+	}
+	palette[0][3] = palette[1][3] = palette[2][3] = 255;
+	palette[3][3] = c0 > c1 || !allow_three_colour ? 255 : 0;
+}
+
+// Returns the number of entries usable by opaque pixels
+static guint dxt_colour_palette(guint16 c0, guint16 c1, float palette[4][3])
+{
+	guint8	decoded[4][4];
+	guint	c, i;
+
+	dxt_decode_palette(c0,c1,TRUE,decoded);
+
+	for (c = 0; c < 4; c++)
+		for (i = 0; i < 3; i++)
+			palette[c][i] = (float)decoded[c][i];
+
+	if (c0 == c1)
+		return 1;
+	return c0 > c1 ? 4 : 3;
+}
+
+// Picks the nearest palette entry for every pixel of the block and returns the squared error.
+// Transparent pixels always get index 3 at no cost.
+static float dxt_fit_colour(const DxtBlock_t* block, float palette[4][3], guint count, guint32* indices)
+{
+	guint		p, c;
+	guint32		result = 0;
+	float		lanes[4];
+
+#ifdef VTF_SSE2
+	__m128	pr[4], pg[4], pb[4];
+	__m128	total = _mm_setzero_ps();
+
+	for (c = 0; c < count; c++)
+	{
+		pr[c] = _mm_set1_ps(palette[c][0]);
+		pg[c] = _mm_set1_ps(palette[c][1]);
+		pb[c] = _mm_set1_ps(palette[c][2]);
+	}
+
+	for (p = 0; p < 16; p += 4)
+	{
+		__m128	r = _mm_loadu_ps(block->r + p);
+		__m128	g = _mm_loadu_ps(block->g + p);
+		__m128	b = _mm_loadu_ps(block->b + p);
+		__m128	best = _mm_set1_ps(FLT_MAX);
+		__m128i	best_index = _mm_setzero_si128();
+		__m128i	transparent;
+		gint32	index[4];
+
+		for (c = 0; c < count; c++)
+		{
+			__m128 dr = _mm_sub_ps(r,pr[c]);
+			__m128 dg = _mm_sub_ps(g,pg[c]);
+			__m128 db = _mm_sub_ps(b,pb[c]);
+			__m128 d = _mm_add_ps( _mm_add_ps(_mm_mul_ps(dr,dr), _mm_mul_ps(dg,dg)), _mm_mul_ps(db,db) );
+			__m128i closer = _mm_castps_si128( _mm_cmplt_ps(d,best) );
+
+			best = _mm_min_ps(d,best);
+			best_index = _mm_or_si128( _mm_andnot_si128(closer,best_index), _mm_and_si128(closer,_mm_set1_epi32(c)) );
+		}
+
+		transparent = _mm_setr_epi32( -((block->transparent >> p) & 1), -((block->transparent >> (p+1)) & 1),
+									  -((block->transparent >> (p+2)) & 1), -((block->transparent >> (p+3)) & 1) );
+		best = _mm_andnot_ps(_mm_castsi128_ps(transparent),best);
+		best_index = _mm_or_si128( _mm_andnot_si128(transparent,best_index), _mm_and_si128(transparent,_mm_set1_epi32(3)) );
+
+		total = _mm_add_ps(total,best);
+
+		_mm_storeu_si128((__m128i*)index,best_index);
+		for (c = 0; c < 4; c++)
+			result |= (guint32)index[c] << (2 * (p + c));
+	}
+
+	_mm_storeu_ps(lanes,total);
+#else
+	lanes[0] = lanes[1] = lanes[2] = lanes[3] = 0;
+
+	for (p = 0; p < 16; p++)
+	{
+		float	best = FLT_MAX;
+		guint32	best_index = 0;
+
+		if (block->transparent & (1 << p))
+		{
+			result |= 3 << (2 * p);
+			continue;
+		}
+
+		for (c = 0; c < count; c++)
+		{
+			float dr = block->r[p] - palette[c][0];
+			float dg = block->g[p] - palette[c][1];
+			float db = block->b[p] - palette[c][2];
+			float d = (dr*dr + dg*dg) + db*db;
+			if (d < best)
+			{
+				best = d;
+				best_index = c;
+			}
+		}
+
+		lanes[p & 3] += best;
+		result |= best_index << (2 * p);
+	}
+#endif
+
+	*indices = result;
+	return (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+}
+
+static void dxt_try_endpoints(DxtColourResult_t* best, const DxtBlock_t* block, const float* start, const float* end, gboolean four_colour)
+{
+	guint16	c0 = dxt_pack565(start);
+	guint16	c1 = dxt_pack565(end);
+	float	palette[4][3];
+	guint32	indices;
+	guint	count;
+	float	error;
+
+	// The order of the endpoints selects the block mode
+	if (c0 != c1 && four_colour == (c0 < c1))
+	{
+		guint16 swap = c0;
+		c0 = c1;
+		c1 = swap;
+	}
+
+	count = dxt_colour_palette(c0,c1,palette);
+	error = dxt_fit_colour(block,palette,count,&indices);
+
+	if (error < best->error)
+	{
+		best->error = error;
+		best->c0 = c0;
+		best->c1 = c1;
+		best->indices = indices;
+		best->four_colour = c0 > c1;
+	}
+}
+
+static void dxt_bbox_endpoints(const DxtBlock_t* block, float* start, float* end)
+{
+	float	lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+	float	mean[3] = { 0, 0, 0 };
+	float	cov_rg = 0, cov_bg = 0;
+	guint	i, c;
+
+	for (i = 0; i < block->num_points; i++)
+		for (c = 0; c < 3; c++)
+		{
+			lo[c] = MIN(lo[c],block->points[i][c]);
+			hi[c] = MAX(hi[c],block->points[i][c]);
+			mean[c] += block->points[i][c];
+		}
+
+	for (c = 0; c < 3; c++)
+		mean[c] /= block->num_points;
+
+	// Use the diagonal of the box which follows the colours, with green as the reference
+	for (i = 0; i < block->num_points; i++)
+	{
+		float dg = block->points[i][1] - mean[1];
+		cov_rg += (block->points[i][0] - mean[0]) * dg;
+		cov_bg += (block->points[i][2] - mean[2]) * dg;
+	}
+
+	for (c = 0; c < 3; c++)
+	{
+		float inset = (hi[c] - lo[c]) / 16.0f;
+		start[c] = hi[c] - inset;
+		end[c] = lo[c] + inset;
+	}
+
+	if (cov_rg < 0)
+	{
+		float swap = start[0];
+		start[0] = end[0];
+		end[0] = swap;
+	}
+	if (cov_bg < 0)
+	{
+		float swap = start[2];
+		start[2] = end[2];
+		end[2] = swap;
+	}
+}
+
+static void dxt_principal_axis(const DxtBlock_t* block, float* centroid, float* axis)
+{
+	float	cov[6] = { 0, 0, 0, 0, 0, 0 }; // xx xy xz yy yz zz
+	float	v[3];
+	guint	i, c;
+
+	centroid[0] = centroid[1] = centroid[2] = 0;
+	for (i = 0; i < block->num_points; i++)
+		for (c = 0; c < 3; c++)
+			centroid[c] += block->points[i][c];
+	for (c = 0; c < 3; c++)
+		centroid[c] /= block->num_points;
+
+	for (i = 0; i < block->num_points; i++)
+	{
+		float x = block->points[i][0] - centroid[0];
+		float y = block->points[i][1] - centroid[1];
+		float z = block->points[i][2] - centroid[2];
+		cov[0] += x*x;
+		cov[1] += x*y;
+		cov[2] += x*z;
+		cov[3] += y*y;
+		cov[4] += y*z;
+		cov[5] += z*z;
+	}
+
+	// Power iteration, seeded with the row of the largest diagonal
+	if (cov[0] >= cov[3] && cov[0] >= cov[5])
+		v[0] = cov[0], v[1] = cov[1], v[2] = cov[2];
+	else if (cov[3] >= cov[5])
+		v[0] = cov[1], v[1] = cov[3], v[2] = cov[4];
+	else
+		v[0] = cov[2], v[1] = cov[4], v[2] = cov[5];
+
+	for (i = 0; i < 8; i++)
+	{
+		float x = v[0]*cov[0] + v[1]*cov[1] + v[2]*cov[2];
+		float y = v[0]*cov[1] + v[1]*cov[3] + v[2]*cov[4];
+		float z = v[0]*cov[2] + v[1]*cov[4] + v[2]*cov[5];
+		float m = MAX(fabsf(x),MAX(fabsf(y),fabsf(z)));
+
+		if (m < FLT_EPSILON)
+			break;
+
+		v[0] = x / m;
+		v[1] = y / m;
+		v[2] = z / m;
+	}
+
+	axis[0] = v[0];
+	axis[1] = v[1];
+	axis[2] = v[2];
+}
+
+static void dxt_range_endpoints(const DxtBlock_t* block, const float* centroid, const float* axis, float* start, float* end)
+{
+	float	len2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+	float	t_min = 0, t_max = 0;
+	guint	i, c;
+
+	if (len2 > FLT_EPSILON)
+	{
+		for (i = 0; i < block->num_points; i++)
+		{
+			float t = ( (block->points[i][0] - centroid[0]) * axis[0]
+					  + (block->points[i][1] - centroid[1]) * axis[1]
+					  + (block->points[i][2] - centroid[2]) * axis[2] ) / len2;
+			if (i == 0 || t < t_min) t_min = t;
+			if (i == 0 || t > t_max) t_max = t;
+		}
+	}
+
+	for (c = 0; c < 3; c++)
+	{
+		start[c] = centroid[c] + axis[c] * t_max;
+		end[c] = centroid[c] + axis[c] * t_min;
+	}
+}
+
+// Least squares endpoints for a fixed set of indices
+static gboolean dxt_refine_endpoints(const DxtBlock_t* block, guint32 indices, gboolean four_colour, float* start, float* end)
+{
+	static const float weights4[4] = { 1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f };
+	static const float weights3[4] = { 1.0f, 0.0f, 0.5f, 0.0f };
+
+	const float*	weights = four_colour ? weights4 : weights3;
+	float			alpha2 = 0, beta2 = 0, alphabeta = 0;
+	float			alphax[3] = { 0, 0, 0 }, betax[3] = { 0, 0, 0 };
+	float			det;
+	guint			i;
+
+	for (i = 0; i < 16; i++)
+	{
+		guint index = (indices >> (2 * i)) & 3;
+		float alpha, beta;
+
+		if ( (block->transparent & (1 << i)) || (!four_colour && index == 3) )
+			continue;
+
+		alpha = weights[index];
+		beta = 1.0f - alpha;
+
+		alpha2 += alpha * alpha;
+		beta2 += beta * beta;
+		alphabeta += alpha * beta;
+
+		alphax[0] += alpha * block->r[i];
+		alphax[1] += alpha * block->g[i];
+		alphax[2] += alpha * block->b[i];
+		betax[0] += beta * block->r[i];
+		betax[1] += beta * block->g[i];
+		betax[2] += beta * block->b[i];
+	}
+
+	det = alpha2 * beta2 - alphabeta * alphabeta;
+	if (fabsf(det) < FLT_EPSILON)
+		return FALSE;
+
+	for (i = 0; i < 3; i++)
+	{
+		start[i] = (alphax[i] * beta2 - betax[i] * alphabeta) / det;
+		end[i] = (betax[i] * alpha2 - alphax[i] * alphabeta) / det;
+	}
+	return TRUE;
+}
+
+// Tries every ordered partition of the points (sorted along an axis) into palette clusters.
+// Endpoints are snapped to the 565 grid inside the search so that the error estimate is honest.
+static void dxt_cluster_fit(DxtColourResult_t* best, const DxtBlock_t* block, const float* initial_axis, gboolean four_colour)
+{
+	const vtf_v4	grid = v4_set(31.0f/255.0f, 63.0f/255.0f, 31.0f/255.0f, 0);
+	const vtf_v4	expand = v4_set(8.25f, 4.0625f, 8.25f, 0); // (q << 3) | (q >> 2) == floor(q * 8.25)
+	const vtf_v4	half = v4_splat(0.5f);
+	const vtf_v4	zero = v4_zero();
+	const vtf_v4	ceiling = v4_splat(255.0f);
+	const vtf_v4	two = v4_splat(2.0f);
+
+	float		axis[3];
+	guint		order[16], last_order[16];
+	vtf_v4		sums[17];
+	guint		n = block->num_points;
+	guint		iteration, i, j, k;
+
+	axis[0] = initial_axis[0];
+	axis[1] = initial_axis[1];
+	axis[2] = initial_axis[2];
+
+	for (iteration = 0; iteration < 4; iteration++)
+	{
+		float	dots[16];
+		float	best_error = FLT_MAX;
+		float	start[4], end[4];
+		vtf_v4	best_a = zero, best_b = zero;
+
+		// Sort along the axis (insertion sort is stable and cheap for 16 points)
+		for (i = 0; i < n; i++)
+		{
+			float d = block->points[i][0]*axis[0] + block->points[i][1]*axis[1] + block->points[i][2]*axis[2];
+			for (j = i; j > 0 && dots[j-1] > d; j--)
+			{
+				dots[j] = dots[j-1];
+				order[j] = order[j-1];
+			}
+			dots[j] = d;
+			order[j] = i;
+		}
+
+		if (iteration > 0 && memcmp(order,last_order,n * sizeof(guint)) == 0)
+			break;
+		memcpy(last_order,order,n * sizeof(guint));
+
+		sums[0] = zero;
+		for (i = 0; i < n; i++)
+		{
+			const float* pt = block->points[order[i]];
+			sums[i+1] = v4_add(sums[i],v4_set(pt[0],pt[1],pt[2],0));
+		}
+
+		for (i = 0; i <= n; i++)
+		{
+			for (j = i; j <= n; j++)
+			{
+				for (k = (four_colour ? j : n); k <= n; k++)
+				{
+					vtf_v4	alphax, betax, a, b, e;
+					float	alpha2, beta2, alphabeta, det, error;
+
+					if (four_colour)
+					{
+						// [0,i) index 0, [i,j) index 2, [j,k) index 3, [k,n) index 1
+						vtf_v4 p0 = sums[i];
+						vtf_v4 p1 = v4_sub(sums[j],sums[i]);
+						vtf_v4 p2 = v4_sub(sums[k],sums[j]);
+						vtf_v4 p3 = v4_sub(sums[n],sums[k]);
+						float n1 = (float)(j - i), n2 = (float)(k - j);
+
+						alphax = v4_add(p0, v4_madd(p1,v4_splat(2.0f/3.0f), v4_mul(p2,v4_splat(1.0f/3.0f))));
+						betax = v4_add(p3, v4_madd(p1,v4_splat(1.0f/3.0f), v4_mul(p2,v4_splat(2.0f/3.0f))));
+						alpha2 = (float)i + n1 * (4.0f/9.0f) + n2 * (1.0f/9.0f);
+						beta2 = (float)(n - k) + n1 * (1.0f/9.0f) + n2 * (4.0f/9.0f);
+						alphabeta = (n1 + n2) * (2.0f/9.0f);
+					}
+					else
+					{
+						// [0,i) index 0, [i,j) index 2, [j,n) index 1
+						vtf_v4 p0 = sums[i];
+						vtf_v4 p1 = v4_sub(sums[j],sums[i]);
+						vtf_v4 p2 = v4_sub(sums[n],sums[j]);
+						float n1 = (float)(j - i);
+
+						alphax = v4_madd(p1,half,p0);
+						betax = v4_madd(p1,half,p2);
+						alpha2 = (float)i + n1 * 0.25f;
+						beta2 = (float)(n - j) + n1 * 0.25f;
+						alphabeta = n1 * 0.25f;
+					}
+
+					det = alpha2 * beta2 - alphabeta * alphabeta;
+					if (det < FLT_EPSILON)
+						continue;
+
+					a = v4_mul( v4_sub(v4_mul(alphax,v4_splat(beta2)), v4_mul(betax,v4_splat(alphabeta))), v4_splat(1.0f / det) );
+					b = v4_mul( v4_sub(v4_mul(betax,v4_splat(alpha2)), v4_mul(alphax,v4_splat(alphabeta))), v4_splat(1.0f / det) );
+
+					a = v4_min(ceiling,v4_max(zero,a));
+					b = v4_min(ceiling,v4_max(zero,b));
+					a = v4_floor_pos( v4_mul(v4_floor_pos(v4_madd(a,grid,half)),expand) );
+					b = v4_floor_pos( v4_mul(v4_floor_pos(v4_madd(b,grid,half)),expand) );
+
+					// |a*alpha + b*beta - x|^2 summed, less the constant x.x term
+					e = v4_madd(v4_mul(a,a),v4_splat(alpha2), v4_mul(v4_mul(b,b),v4_splat(beta2)));
+					e = v4_add(e, v4_mul(two, v4_sub( v4_mul(v4_mul(a,b),v4_splat(alphabeta)), v4_madd(a,alphax,v4_mul(b,betax)) )));
+					error = v4_hsum(e);
+
+					if (error < best_error)
+					{
+						best_error = error;
+						best_a = a;
+						best_b = b;
+					}
+				}
+			}
+		}
+
+		if (best_error == FLT_MAX)
+			break;
+
+		v4_store(start,best_a);
+		v4_store(end,best_b);
+		dxt_try_endpoints(best,block,start,end,four_colour);
+
+		axis[0] = end[0] - start[0];
+		axis[1] = end[1] - start[1];
+		axis[2] = end[2] - start[2];
+		if (axis[0] == 0 && axis[1] == 0 && axis[2] == 0)
+			break;
+	}
+}
+
+static void dxt_compress_colour(const DxtBlock_t* block, VtfDxtQuality_t quality, gboolean allow_three_colour, guint8* dest)
+{
+	DxtColourResult_t	best;
+	gboolean			four_colour = block->transparent == 0;
+	float				start[3], end[3];
+
+	best.error = FLT_MAX;
+	best.c0 = best.c1 = 0;
+	best.indices = 0xFFFFFFFF; // all transparent
+	best.four_colour = FALSE;
+
+	if (block->num_points)
+	{
+		if (quality == DXT_QUALITY_FAST)
+		{
+			dxt_bbox_endpoints(block,start,end);
+			dxt_try_endpoints(&best,block,start,end,four_colour);
+		}
+		else
+		{
+			float	centroid[3], axis[3];
+			guint	i;
+
+			dxt_principal_axis(block,centroid,axis);
+			dxt_range_endpoints(block,centroid,axis,start,end);
+
+			dxt_try_endpoints(&best,block,start,end,four_colour);
+			if (four_colour && allow_three_colour)
+				dxt_try_endpoints(&best,block,start,end,FALSE);
+
+			for (i = 0; i < 2; i++)
+			{
+				gboolean mode = best.four_colour;
+				if (best.c0 == best.c1 || !dxt_refine_endpoints(block,best.indices,mode,start,end))
+					break;
+				dxt_try_endpoints(&best,block,start,end,mode);
+			}
+
+			if (quality == DXT_QUALITY_HIGH && block->num_points > 2)
+			{
+				dxt_cluster_fit(&best,block,axis,four_colour);
+				if (four_colour && allow_three_colour)
+					dxt_cluster_fit(&best,block,axis,FALSE);
+			}
+		}
+	}
+
+	dest[0] = best.c0 & 0xFF;
+	dest[1] = best.c0 >> 8;
+	dest[2] = best.c1 & 0xFF;
+	dest[3] = best.c1 >> 8;
+	dest[4] = best.indices & 0xFF;
+	dest[5] = (best.indices >> 8) & 0xFF;
+	dest[6] = (best.indices >> 16) & 0xFF;
+	dest[7] = best.indices >> 24;
+}
+
+/*
+ * Alpha
+ */
+
+static void dxt_compress_alpha_explicit(const DxtBlock_t* block, guint8* dest)
+{
+	guint i;
+	for (i = 0; i < 16; i += 2)
+		dest[i/2] = (guint8)( ((block->a[i] + 8) / 17) | (((block->a[i+1] + 8) / 17) << 4) );
+}
+
+static void dxt_alpha_palette(guint8 a0, guint8 a1, guint8* palette)
+{
+	guint i;
+
+	palette[0] = a0;
+	palette[1] = a1;
+
+	if (a0 > a1)
+	{
+		for (i = 2; i < 8; i++)
+			palette[i] = (guint8)( ((8 - i) * a0 + (i - 1) * a1 + 3) / 7 );
+	}
+	else
+	{
+		for (i = 2; i < 6; i++)
+			palette[i] = (guint8)( ((6 - i) * a0 + (i - 1) * a1 + 2) / 5 );
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+}
+
+static guint dxt_fit_alpha(const guint8* alpha, const guint8* palette, guint8* indices)
+{
+	guint	i;
+
+#ifdef VTF_SSE2
+	__m128i	lo = _mm_setr_epi16(alpha[0],alpha[1],alpha[2],alpha[3],alpha[4],alpha[5],alpha[6],alpha[7]);
+	__m128i	hi = _mm_setr_epi16(alpha[8],alpha[9],alpha[10],alpha[11],alpha[12],alpha[13],alpha[14],alpha[15]);
+	__m128i	best_lo = _mm_set1_epi16(0x7FFF), best_hi = best_lo;
+	__m128i	index_lo = _mm_setzero_si128(), index_hi = index_lo;
+	__m128i	error;
+	gint16	out[16];
+	gint32	sums[4];
+
+	for (i = 0; i < 8; i++)
+	{
+		__m128i p = _mm_set1_epi16(palette[i]);
+		__m128i k = _mm_set1_epi16((gint16)i);
+		__m128i d_lo = _mm_max_epi16(_mm_sub_epi16(lo,p), _mm_sub_epi16(p,lo));
+		__m128i d_hi = _mm_max_epi16(_mm_sub_epi16(hi,p), _mm_sub_epi16(p,hi));
+		__m128i closer_lo = _mm_cmplt_epi16(d_lo,best_lo);
+		__m128i closer_hi = _mm_cmplt_epi16(d_hi,best_hi);
+
+		best_lo = _mm_min_epi16(d_lo,best_lo);
+		best_hi = _mm_min_epi16(d_hi,best_hi);
+		index_lo = _mm_or_si128( _mm_andnot_si128(closer_lo,index_lo), _mm_and_si128(closer_lo,k) );
+		index_hi = _mm_or_si128( _mm_andnot_si128(closer_hi,index_hi), _mm_and_si128(closer_hi,k) );
+	}
+
+	_mm_storeu_si128((__m128i*)out,index_lo);
+	_mm_storeu_si128((__m128i*)(out + 8),index_hi);
+	for (i = 0; i < 16; i++)
+		indices[i] = (guint8)out[i];
+
+	error = _mm_add_epi32( _mm_madd_epi16(best_lo,best_lo), _mm_madd_epi16(best_hi,best_hi) );
+	_mm_storeu_si128((__m128i*)sums,error);
+	return sums[0] + sums[1] + sums[2] + sums[3];
+#else
+	guint total = 0;
+
+	for (i = 0; i < 16; i++)
+	{
+		guint best = 0x7FFF, k;
+		for (k = 0; k < 8; k++)
+		{
+			guint d = (guint)ABS((gint)alpha[i] - (gint)palette[k]);
+			if (d < best)
+			{
+				best = d;
+				indices[i] = (guint8)k;
+			}
+		}
+		total += best * best;
+	}
+	return total;
+#endif
+}
+
+static void dxt_try_alpha(DxtAlphaResult_t* best, const guint8* alpha, gint a0, gint a1, gboolean eight_alpha)
+{
+	guint8	palette[8];
+	guint8	indices[16];
+	guint	error;
+
+	a0 = CLAMP(a0,0,255);
+	a1 = CLAMP(a1,0,255);
+
+	if (a0 != a1 && eight_alpha == (a0 < a1))
+	{
+		gint swap = a0;
+		a0 = a1;
+		a1 = swap;
+	}
+
+	dxt_alpha_palette((guint8)a0,(guint8)a1,palette);
+	error = dxt_fit_alpha(alpha,palette,indices);
+
+	if (error < best->error)
+	{
+		best->error = error;
+		best->a0 = (guint8)a0;
+		best->a1 = (guint8)a1;
+		memcpy(best->indices,indices,16);
+	}
+}
+
+static void dxt_compress_alpha_interpolated(const DxtBlock_t* block, VtfDxtQuality_t quality, guint8* dest)
+{
+	DxtAlphaResult_t	best;
+	gint				lo = 255, hi = 0, lo_inner = 255, hi_inner = 0;
+	gboolean			extremes = FALSE;
+	guint64				bits = 0;
+	guint				i;
+
+	best.error = G_MAXUINT;
+
+	for (i = 0; i < 16; i++)
+	{
+		gint a = block->a[i];
+		lo = MIN(lo,a);
+		hi = MAX(hi,a);
+		if (a == 0 || a == 255)
+			extremes = TRUE;
+		else
+		{
+			lo_inner = MIN(lo_inner,a);
+			hi_inner = MAX(hi_inner,a);
+		}
+	}
+
+	dxt_try_alpha(&best,block->a,hi,lo,TRUE);
+
+	if (quality != DXT_QUALITY_FAST && best.error)
+	{
+		// Six interpolated values plus explicit 0 and 255
+		if (extremes)
+		{
+			if (lo_inner > hi_inner)
+				lo_inner = hi_inner = lo; // nothing but 0 and 255
+			dxt_try_alpha(&best,block->a,lo_inner,hi_inner,FALSE);
+		}
+
+		if (quality == DXT_QUALITY_HIGH)
+		{
+			// Greedy endpoint search around the best result so far
+			gboolean improved = TRUE;
+			for (i = 0; i < 8 && improved && best.error; i++)
+			{
+				gint a0 = best.a0, a1 = best.a1, d0, d1;
+				gboolean eight_alpha = a0 > a1;
+				guint before = best.error;
+
+				for (d0 = -2; d0 <= 2; d0++)
+					for (d1 = -2; d1 <= 2; d1++)
+						if (d0 || d1)
+							dxt_try_alpha(&best,block->a,a0 + d0,a1 + d1,eight_alpha);
+
+				improved = best.error < before;
+			}
+		}
+	}
+
+	dest[0] = best.a0;
+	dest[1] = best.a1;
+	for (i = 0; i < 16; i++)
+		bits |= (guint64)best.indices[i] << (3 * i);
+	for (i = 0; i < 6; i++)
+		dest[2 + i] = (guint8)(bits >> (8 * i));
+}
+
+/*
+ * Surfaces
+ */
+
+void dxt_compress_rows(const guint8* rgba, guint width, guint height, guint first_block_row, guint num_block_rows, guint8* dest, VtfDxtFormat_t format, VtfDxtQuality_t quality)
+{
+	DxtBlock_t	block;
+	guint		blocks_x = (width + 3) / 4;
+	guint		block_size = dxt_block_size(format);
+	guint		bx, by;
+
+	for (by = first_block_row; by < first_block_row + num_block_rows; by++)
+	{
+		for (bx = 0; bx < blocks_x; bx++)
+		{
+			guint8* out = dest + (by * blocks_x + bx) * block_size;
+
+			dxt_load_block(&block,rgba,width,height,bx,by,format == DXT_FORMAT_DXT1_ONEBITALPHA);
+
+			switch(format)
+			{
+			case DXT_FORMAT_DXT1:
+			case DXT_FORMAT_DXT1_ONEBITALPHA:
+				dxt_compress_colour(&block,quality,TRUE,out);
+				break;
+			case DXT_FORMAT_DXT3:
+				dxt_compress_alpha_explicit(&block,out);
+				dxt_compress_colour(&block,quality,FALSE,out + 8);
+				break;
+			case DXT_FORMAT_DXT5:
+				dxt_compress_alpha_interpolated(&block,quality,out);
+				dxt_compress_colour(&block,quality,FALSE,out + 8);
+				break;
+			}
+		}
+	}
+}
+
+void dxt_compress(const guint8* rgba, guint width, guint height, guint8* dest, VtfDxtFormat_t format, VtfDxtQuality_t quality)
+{
+	dxt_compress_rows(rgba,width,height,0,(height + 3) / 4,dest,format,quality);
+}
+
+typedef struct DxtJob
+{
+	const VtfDxtSurface_t*	surface;
+	guint					first_row, num_rows;
+} DxtJob_t;
+
+typedef struct DxtJobList
+{
+	DxtJob_t*		jobs;
+	VtfDxtFormat_t	format;
+	VtfDxtQuality_t	quality;
+} DxtJobList_t;
+
+#define DXT_BLOCKS_PER_JOB 4096
+
+static void dxt_run_job(guint index, gpointer user_data)
+{
+	const DxtJobList_t*	list = (const DxtJobList_t*)user_data;
+	const DxtJob_t*		job = &list->jobs[index];
+
+	dxt_compress_rows(job->surface->rgba,job->surface->width,job->surface->height,job->first_row,job->num_rows,job->surface->dest,list->format,list->quality);
+}
+
+static guint dxt_rows_per_job(const VtfDxtSurface_t* surface)
+{
+	return MAX(1,DXT_BLOCKS_PER_JOB / ((surface->width + 3) / 4));
+}
+
+gboolean dxt_compress_surfaces(const VtfDxtSurface_t* surfaces, guint count, VtfDxtFormat_t format, VtfDxtQuality_t quality)
+{
+	DxtJobList_t	list;
+	guint			num_jobs = 0, i, row;
+
+	// Whole surfaces are too coarse for a single large mip, so split them into runs of block rows
+	for (i = 0; i < count; i++)
+	{
+		guint rows = (surfaces[i].height + 3) / 4;
+		guint per_job = dxt_rows_per_job(&surfaces[i]);
+		num_jobs += (rows + per_job - 1) / per_job;
+	}
+
+	list.jobs = g_try_new(DxtJob_t,num_jobs);
+	if (!list.jobs)
+		return FALSE;
+	list.format = format;
+	list.quality = quality;
+
+	num_jobs = 0;
+	for (i = 0; i < count; i++)
+	{
+		guint rows = (surfaces[i].height + 3) / 4;
+		guint per_job = dxt_rows_per_job(&surfaces[i]);
+
+		for (row = 0; row < rows; row += per_job)
+		{
+			list.jobs[num_jobs].surface = &surfaces[i];
+			list.jobs[num_jobs].first_row = row;
+			list.jobs[num_jobs].num_rows = MIN(per_job,rows - row);
+			num_jobs++;
+		}
+	}
+
+	vtf_parallel_for(num_jobs,dxt_run_job,&list);
+
+	g_free(list.jobs);
+	return TRUE;
+}
+
+/*
+ * Decompression
+ */
+
+static void dxt_decompress_colour(const guint8* src, gboolean allow_three_colour, guint8 pixels[16][4])
+{
+	guint16	c0 = src[0] | (src[1] << 8);
+	guint16	c1 = src[2] | (src[3] << 8);
+	guint32	indices = src[4] | (src[5] << 8) | (src[6] << 16) | ((guint32)src[7] << 24);
+	guint8	palette[4][4];
+	guint	i;
+
+	dxt_decode_palette(c0,c1,allow_three_colour,palette);
+
+#ifdef VTF_SSE2
+	{
+		// Each lane picks out its own 2-bit index and matches it against all four entries
+		__m128i	entries = _mm_loadu_si128((const __m128i*)palette);
+		__m128i	p0 = _mm_shuffle_epi32(entries,0x00), p1 = _mm_shuffle_epi32(entries,0x55);
+		__m128i	p2 = _mm_shuffle_epi32(entries,0xAA), p3 = _mm_shuffle_epi32(entries,0xFF);
+		__m128i	mask = _mm_setr_epi32(0x03,0x0C,0x30,0xC0);
+		__m128i	is1 = _mm_and_si128(mask,_mm_set1_epi32(0x55));
+		__m128i	is2 = _mm_and_si128(mask,_mm_set1_epi32(0xAA));
+
+		for (i = 0; i < 4; i++)
+		{
+			__m128i	sel = _mm_and_si128(_mm_set1_epi32(indices >> (8 * i)),mask);
+			__m128i	row = _mm_and_si128(_mm_cmpeq_epi32(sel,_mm_setzero_si128()),p0);
+
+			row = _mm_or_si128(row,_mm_and_si128(_mm_cmpeq_epi32(sel,is1),p1));
+			row = _mm_or_si128(row,_mm_and_si128(_mm_cmpeq_epi32(sel,is2),p2));
+			row = _mm_or_si128(row,_mm_and_si128(_mm_cmpeq_epi32(sel,mask),p3));
+			_mm_storeu_si128((__m128i*)pixels[i * 4],row);
+		}
+	}
+#else
+	for (i = 0; i < 16; i++)
+		memcpy(pixels[i],palette[(indices >> (2 * i)) & 3],4);
+#endif
+}
+
+static void dxt_decompress_alpha_explicit(const guint8* src, guint8 pixels[16][4])
+{
+	guint i;
+
+	for (i = 0; i < 16; i++)
+		pixels[i][3] = (guint8)(((src[i / 2] >> (4 * (i % 2))) & 0xF) * 17);
+}
+
+// DXT5 alpha, or one channel of ATI1N/ATI2N
+static void dxt_decompress_alpha_interpolated(const guint8* src, guint8 pixels[16][4], guint channel)
+{
+	guint8	palette[8];
+	guint64	bits = 0;
+	guint	i;
+
+	dxt_alpha_palette(src[0],src[1],palette);
+
+	for (i = 0; i < 6; i++)
+		bits |= (guint64)src[2 + i] << (8 * i);
+	for (i = 0; i < 16; i++)
+		pixels[i][channel] = palette[(bits >> (3 * i)) & 7];
+}
+
+// Z = sqrt(1 - X^2 - Y^2), four pixels at a time
+static void dxt_rebuild_normal_z(guint8 pixels[16][4])
+{
+	const vtf_v4	scale = v4_splat(2.0f / 255.0f), one = v4_splat(1.0f);
+	float			z[4];
+	guint			i, j;
+
+	for (i = 0; i < 16; i += 4)
+	{
+		vtf_v4 x = v4_sub(v4_mul(v4_set(pixels[i][0],pixels[i+1][0],pixels[i+2][0],pixels[i+3][0]),scale),one);
+		vtf_v4 y = v4_sub(v4_mul(v4_set(pixels[i][1],pixels[i+1][1],pixels[i+2][1],pixels[i+3][1]),scale),one);
+		vtf_v4 zz = v4_max(v4_sub(one,v4_madd(x,x,v4_mul(y,y))),v4_zero());
+
+		v4_store(z,v4_madd(v4_add(v4_sqrt(zz),one),v4_splat(127.5f),v4_splat(0.5f)));
+		for (j = 0; j < 4; j++)
+		{
+			pixels[i + j][2] = (guint8)MIN(z[j],255.0f);
+			pixels[i + j][3] = 255;
+		}
+	}
+}
+
+void dxt_decompress(const guint8* blocks, guint width, guint height, guint8* rgba, VtfDxtFormat_t format)
+{
+	guint8	pixels[16][4];
+	guint	blocks_x = (width + 3) / 4;
+	guint	blocks_y = (height + 3) / 4;
+	guint	block_size = dxt_block_size(format);
+	guint	bx, by, i, row;
+
+	for (by = 0; by < blocks_y; by++)
+	{
+		for (bx = 0; bx < blocks_x; bx++)
+		{
+			const guint8* src = blocks + (by * blocks_x + bx) * block_size;
+
+			switch(format)
+			{
+			case DXT_FORMAT_DXT1:
+			case DXT_FORMAT_DXT1_ONEBITALPHA:
+				dxt_decompress_colour(src,TRUE,pixels);
+				break;
+			case DXT_FORMAT_DXT3:
+				dxt_decompress_colour(src + 8,FALSE,pixels);
+				dxt_decompress_alpha_explicit(src,pixels);
+				break;
+			case DXT_FORMAT_DXT5:
+				dxt_decompress_colour(src + 8,FALSE,pixels);
+				dxt_decompress_alpha_interpolated(src,pixels,3);
+				break;
+			case DXT_FORMAT_ATI1N:
+				dxt_decompress_alpha_interpolated(src,pixels,0);
+				for (i = 0; i < 16; i++)
+				{
+					pixels[i][1] = pixels[i][2] = pixels[i][0];
+					pixels[i][3] = 255;
+				}
+				break;
+			case DXT_FORMAT_ATI2N:
+				dxt_decompress_alpha_interpolated(src,pixels,0);
+				dxt_decompress_alpha_interpolated(src + 8,pixels,1);
+				dxt_rebuild_normal_z(pixels);
+				break;
+			}
+
+			// Whole rows of four pixels are copied at once
+			for (row = 0; row < 4 && by * 4 + row < height; row++)
+				memcpy(rgba + ((by * 4 + row) * width + bx * 4) * 4,pixels[row * 4],MIN(4,width - bx * 4) * 4);
+		}
+	}
+}
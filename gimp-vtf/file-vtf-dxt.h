@@ -0,0 +1,61 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_DXT_H
+#define FILE_VTF_DXT_H
+
+#include <glib.h>
+
+// Block compression and decompression. Kept free of GIMP and VTFLib so that it can be run from worker threads.
+
+typedef enum VtfDxtFormat
+{
+	DXT_FORMAT_DXT1 = 0,
+	DXT_FORMAT_DXT1_ONEBITALPHA,
+	DXT_FORMAT_DXT3,
+	DXT_FORMAT_DXT5,
+	DXT_FORMAT_ATI1N,	// decompression only
+	DXT_FORMAT_ATI2N	// decompression only
+} VtfDxtFormat_t;
+
+typedef enum VtfDxtQuality
+{
+	DXT_QUALITY_FAST = 0,	// bounding box range fit
+	DXT_QUALITY_NORMAL,		// principal axis range fit, least squares refinement
+	DXT_QUALITY_HIGH		// cluster fit
+} VtfDxtQuality_t;
+
+#define DXT_QUALITY_COUNT 3
+
+guint dxt_block_size(VtfDxtFormat_t format);
+guint dxt_surface_size(guint width, guint height, VtfDxtFormat_t format);
+
+// Compresses RGBA8888 pixels. 'dest' is always the start of the surface; dxt_compress_rows()
+// writes only the blocks of the requested rows, so that different rows can be compressed at once.
+void dxt_compress(const guint8* rgba, guint width, guint height, guint8* dest, VtfDxtFormat_t format, VtfDxtQuality_t quality);
+void dxt_compress_rows(const guint8* rgba, guint width, guint height, guint first_block_row, guint num_block_rows, guint8* dest, VtfDxtFormat_t format, VtfDxtQuality_t quality);
+
+typedef struct VtfDxtSurface
+{
+	const guint8*	rgba;
+	guint			width, height;
+	guint8*			dest;
+} VtfDxtSurface_t;
+
+// Compresses a batch of surfaces on the worker pool. The output doesn't depend on the number of threads.
+// Returns FALSE if out of memory.
+gboolean dxt_compress_surfaces(const VtfDxtSurface_t* surfaces, guint count, VtfDxtFormat_t format, VtfDxtQuality_t quality);
+
+// Decompresses to RGBA8888, clipping blocks which overhang the edge of a small mip. ATI1N is decoded as grey,
+// and ATI2N as a normal map with blue rebuilt from red and green.
+void dxt_decompress(const guint8* blocks, guint width, guint height, guint8* rgba, VtfDxtFormat_t format);
+
+#endif
@@ -0,0 +1,775 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-encode.h"
+#include "file-vtf-hash.h"
+#include "file-vtf-pool.h"
+
+#include <math.h>
+#include <string.h>
+
+static gboolean vtf_dxt_format(VTFImageFormat format, VtfDxtFormat_t* dxt_format)
+{
+	switch (format)
+	{
+	case IMAGE_FORMAT_DXT1:
+		*dxt_format = DXT_FORMAT_DXT1;
+		return TRUE;
+	case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+		*dxt_format = DXT_FORMAT_DXT1_ONEBITALPHA;
+		return TRUE;
+	case IMAGE_FORMAT_DXT3:
+		*dxt_format = DXT_FORMAT_DXT3;
+		return TRUE;
+	case IMAGE_FORMAT_DXT5:
+		*dxt_format = DXT_FORMAT_DXT5;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Only the first failure is kept, as later ones are usually a consequence of it
+static void vtf_stream_error(VtfStream_t* stream, const gchar* message)
+{
+	if (!stream->error[0])
+		g_strlcpy(stream->error,message && message[0] ? message : "#unknown_error",sizeof(stream->error));
+}
+
+static gsize vtf_stream_surface_size(const VtfStream_t* stream, vlUInt width, vlUInt height)
+{
+	return stream->compressed ? dxt_surface_size(width,height,stream->dxt_format) : vlImageComputeImageSize(width,height,1,1,stream->format);
+}
+
+// VTF image data is stored smallest mip first, then by frame, face and slice
+static void vtf_stream_layout(VtfStream_t* stream)
+{
+	vlUInt mip;
+
+	stream->image_size = 0;
+	for (mip = stream->mips; mip-- > 0; )
+	{
+		vlUInt w,h,d;
+		vlImageComputeMipmapDimensions(stream->width,stream->height,stream->depth,mip,&w,&h,&d);
+		stream->mip_offsets[mip] = stream->image_size;
+		stream->image_size += vtf_stream_surface_size(stream,w,h) * d * stream->frames * stream->faces;
+	}
+}
+
+static gsize vtf_stream_offset(const VtfStream_t* stream, vlUInt mip, vlUInt frame, vlUInt face, vlUInt slice)
+{
+	vlUInt w,h,d;
+	vlImageComputeMipmapDimensions(stream->width,stream->height,stream->depth,mip,&w,&h,&d);
+	return stream->mip_offsets[mip] + ((frame * stream->faces + face) * d + slice) * vtf_stream_surface_size(stream,w,h);
+}
+
+// Only one of frames, faces and slices is ever more than 1
+static gsize vtf_stream_image_offset(const VtfStream_t* stream, vlUInt mip, guint image)
+{
+	return vtf_stream_offset(stream,mip,stream->frames > 1 ? image : 0, stream->faces > 1 ? image : 0, stream->depth > 1 ? image : 0);
+}
+
+// Adds an image's average linear colour to 'sum'. VTFLib's reflectivity is the average of this over every
+// frame, face and slice.
+static void vtf_reflectivity_add(const guint8* rgba, guint width, guint height, gdouble* sum)
+{
+	gfloat	linear[256];
+	gdouble	image_sum[3] = { 0, 0, 0 };
+	gsize	i, count = (gsize)width * height;
+	guint	c;
+
+	for (i = 0; i < 256; i++)
+		linear[i] = (gfloat)pow(i / 255.0,2.2);
+
+	for (i = 0; i < count; i++)
+		for (c = 0; c < 3; c++)
+			image_sum[c] += linear[rgba[i * 4 + c]];
+
+	for (c = 0; c < 3; c++)
+		sum[c] += image_sum[c] / count;
+}
+
+// The low-res image is the largest mip which fits in 16x16, compressed to DXT1. Each of its pixels is the
+// average of a block of the full-size image, since both sides are powers of two.
+static guint8* vtf_lowres_image(const guint8* rgba, guint width, guint height, guint lowres_width, guint lowres_height)
+{
+	guint8	pixels[16 * 16 * 4];
+	guint8*	blocks;
+	guint	block_w = width / lowres_width, block_h = height / lowres_height;
+	guint	x, y, bx, by, c;
+	guint32	sum[4];
+
+	blocks = g_try_new(guint8,dxt_surface_size(lowres_width,lowres_height,DXT_FORMAT_DXT1));
+	if (!blocks)
+		return NULL;
+
+	for (y = 0; y < lowres_height; y++)
+		for (x = 0; x < lowres_width; x++)
+		{
+			memset(sum,0,sizeof(sum));
+			for (by = 0; by < block_h; by++)
+			{
+				const guint8* src = rgba + ((gsize)(y * block_h + by) * width + x * block_w) * 4;
+				for (bx = 0; bx < block_w * 4; bx++)
+					sum[bx & 3] += src[bx];
+			}
+			for (c = 0; c < 4; c++)
+				pixels[(y * lowres_width + x) * 4 + c] = (guint8)((sum[c] + block_w * block_h / 2) / (block_w * block_h));
+		}
+
+	dxt_compress(pixels,lowres_width,lowres_height,blocks,DXT_FORMAT_DXT1,DXT_QUALITY_NORMAL);
+	return blocks;
+}
+
+static gboolean vtf_stream_open(VtfStream_t* stream, const vlByte* first_image, const VtfSaveOptions_t* opt)
+{
+	VtfFileHeader_t				header;
+	const SVTFImageFormatInfo*	format_info;
+	VtfResourceValue_t			lod;
+	guint						num_values = 0;
+	guint						lowres_width, lowres_height;
+	guint8*						lowres;
+	gboolean					result;
+
+	memset(&header,0,sizeof(VtfFileHeader_t));
+	header.version[0] = 7;
+	header.version[1] = opt->Version;
+	header.width = stream->width;
+	header.height = stream->height;
+	header.flags = stream->flags;
+	header.frames = stream->frames;
+	header.depth = stream->depth;
+	header.format = stream->format;
+	header.mip_count = stream->mips;
+	header.bumpmap_scale = 1.0f; // reflectivity is filled in on closing, once every image has been seen
+
+	// Six faces and no spheremap, which older versions only know about from the start frame
+	header.flags &= ~TEXTUREFLAGS_ENVMAP;
+	if (stream->faces == 6)
+	{
+		header.flags |= TEXTUREFLAGS_ENVMAP;
+		header.start_frame = 0xffff;
+	}
+
+	// Images without mips have no lower levels of detail either
+	header.flags &= ~(TEXTUREFLAGS_NOMIP | TEXTUREFLAGS_NOLOD);
+	if (stream->mips == 1)
+		header.flags |= TEXTUREFLAGS_NOMIP | TEXTUREFLAGS_NOLOD;
+	else if (opt->NoLOD)
+		header.flags |= TEXTUREFLAGS_NOLOD;
+
+	format_info = vlImageGetImageFormatInfo(stream->format);
+	header.flags &= ~(TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA);
+	if (format_info->uiAlphaBitsPerPixel == 1)
+		header.flags |= TEXTUREFLAGS_ONEBITALPHA;
+	else if (format_info->uiAlphaBitsPerPixel > 1)
+		header.flags |= TEXTUREFLAGS_EIGHTBITALPHA;
+
+	header.lowres_format = IMAGE_FORMAT_DXT1;
+	for (lowres_width = stream->width, lowres_height = stream->height; lowres_width > 16 || lowres_height > 16; )
+	{
+		lowres_width = MAX(1,lowres_width >> 1);
+		lowres_height = MAX(1,lowres_height >> 1);
+	}
+	header.lowres_width = (guint8)lowres_width;
+	header.lowres_height = (guint8)lowres_height;
+
+	if (opt->WithMips && opt->LodControlU != 0 && opt->LodControlV != 0)
+	{
+		lod.type = VTF_RESOURCE_TYPE_LOD;
+		lod.value = (guint8)opt->LodControlU | ((guint8)opt->LodControlV << 8);
+		num_values++;
+	}
+
+	lowres = vtf_lowres_image(first_image,stream->width,stream->height,header.lowres_width,header.lowres_height);
+	if (!lowres)
+	{
+		vtf_stream_error(stream,"#no_memory_error");
+		return FALSE;
+	}
+
+	result = vtf_writer_open(&stream->writer,stream->path,&header,lowres,&lod,num_values,stream->image_size);
+	g_free(lowres);
+
+	if (!result)
+		vtf_stream_error(stream,"#file_write_error");
+	return result;
+}
+
+// Encodes the surfaces into stream->blocks, then writes each one to its offset in the image data
+static gboolean vtf_stream_write(VtfStream_t* stream, VtfDxtSurface_t* surfaces, const gsize* offsets, guint count)
+{
+	gsize		size = 0;
+	guint		i;
+	gboolean	result = TRUE;
+
+	for (i = 0; i < count; i++)
+	{
+		surfaces[i].dest = stream->blocks + size;
+		size += vtf_stream_surface_size(stream,surfaces[i].width,surfaces[i].height);
+	}
+
+	if (stream->compressed)
+		result = dxt_compress_surfaces(surfaces,count,stream->dxt_format,stream->dxt_quality);
+	else
+		for (i = 0; i < count && result; i++)
+			result = vlImageConvert((vlByte*)surfaces[i].rgba,surfaces[i].dest,surfaces[i].width,surfaces[i].height,IMAGE_FORMAT_RGBA8888,stream->format);
+
+	if (!result)
+	{
+		if (stream->compressed)
+			vtf_stream_error(stream,"#no_memory_error");
+		else
+			vtf_stream_error(stream,vlGetLastError());
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if ( !vtf_writer_write(&stream->writer,offsets[i],surfaces[i].dest,vtf_stream_surface_size(stream,surfaces[i].width,surfaces[i].height)) )
+		{
+			vtf_stream_error(stream,"#file_write_error");
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Volume mips are made from pairs of slices, so each level holds on to the first of a pair until the second arrives.
+// 'pending' has room for two slices of each level.
+static gboolean vtf_stream_volume_slice(VtfStream_t* stream, guint8** pending, vlUInt mip, vlUInt slice, const guint8* rgba)
+{
+	VtfDxtSurface_t	surface;
+	VtfMipChain_t	chain;
+	gsize			offset, slice_size;
+	vlUInt			w,h,d;
+	gboolean		result;
+
+	vlImageComputeMipmapDimensions(stream->width,stream->height,stream->depth,mip,&w,&h,&d);
+	slice_size = w * h * 4;
+
+	surface.rgba = rgba;
+	surface.width = w;
+	surface.height = h;
+	offset = vtf_stream_offset(stream,mip,0,0,slice);
+	if ( !vtf_stream_write(stream,&surface,&offset,1) )
+		return FALSE;
+
+	if (mip + 1 >= stream->mips)
+		return TRUE;
+
+	memset(&chain,0,sizeof(VtfMipChain_t));
+	chain.width = w;
+	chain.height = h;
+	chain.num_levels = 2;
+
+	if (d > 1)
+	{
+		// An odd slice out at the end is dropped, as it is when all slices are filtered at once
+		memcpy(pending[mip] + (slice % 2) * slice_size,rgba,slice_size);
+		if (slice % 2 == 0)
+			return TRUE;
+
+		chain.depth = 2;
+		chain.levels[0] = pending[mip];
+	}
+	else
+	{
+		chain.depth = 1;
+		chain.levels[0] = (guint8*)rgba;
+	}
+
+	if ( !mip_build_chains(&chain,1,&stream->mip_options) )
+	{
+		mip_free_chains(&chain,1);
+		vtf_stream_error(stream,"#no_memory_error");
+		return FALSE;
+	}
+
+	result = vtf_stream_volume_slice(stream,pending,mip + 1,slice / 2,chain.levels[1]);
+	mip_free_chains(&chain,1);
+	return result;
+}
+
+// Blocks can only be copied if they are what we would have made: the same format and size, and no more mips
+// than the original had. Volume mips mix slices together, so they are always made afresh.
+static void vtf_original_open(VtfStream_t* stream)
+{
+	const guint8*	data = stream->original_data;
+	gsize			size = stream->original_size, surfaces_size = 0, blocks_size = 0, lowres_offset;
+	VtfOriginal_t	original;
+	const gchar*	path;
+	gint64			file_size, file_mtime;
+	guint8*			header_data = NULL;
+	vlUInt			mip;
+
+	if ( !stream->compressed || (stream->depth > 1 && stream->mips > 1) )
+		return;
+
+	if (!data)
+		return;
+
+	memset(&original,0,sizeof(VtfOriginal_t));
+	if (size > sizeof(VtfOriginal_t))
+	{
+		memcpy(&original,data,sizeof(VtfOriginal_t));
+		surfaces_size = original.num_surfaces * sizeof(VtfOriginalSurface_t);
+	}
+
+	if ( original.version == VTF_ORIGINAL_VERSION && size > sizeof(VtfOriginal_t) + surfaces_size && data[size - 1] == 0 )
+	{
+		path = (const gchar*)data + sizeof(VtfOriginal_t) + surfaces_size;
+		if ( vtf_file_stat(path,&file_size,&file_mtime) && file_size == original.file_size && file_mtime == original.file_mtime )
+		{
+#ifdef _WIN32
+			if ( fopen_s(&stream->original,path,"rb") != 0 )
+				stream->original = NULL;
+#else
+			stream->original = fopen(path,"rb");
+#endif
+			if (stream->original)
+				header_data = vtf_read_file_header(stream->original,&stream->original_header);
+		}
+	}
+
+	for (mip = 0; mip < stream->mips; mip++)
+		blocks_size += vtf_stream_surface_size(stream,MAX(1,stream->width >> mip),MAX(1,stream->height >> mip));
+
+	if ( header_data && vtf_find_images(header_data,&stream->original_header,&lowres_offset,&stream->original_offset)
+		&& stream->original_header.format == stream->format
+		&& stream->original_header.width == stream->width && stream->original_header.height == stream->height
+		&& stream->original_header.mip_count >= stream->mips && (stream->mips == 1 || stream->original_header.depth <= 1)
+		&& (stream->originals = g_try_new(VtfOriginalSurface_t,original.num_surfaces)) != NULL
+		&& (stream->original_blocks = g_try_new(guint8,blocks_size)) != NULL )
+	{
+		memcpy(stream->originals,data + sizeof(VtfOriginal_t),surfaces_size);
+		stream->num_originals = original.num_surfaces;
+	}
+	else if (stream->original)
+	{
+		fclose(stream->original);
+		stream->original = NULL;
+	}
+
+	g_free(header_data);
+}
+
+static void vtf_original_close(VtfStream_t* stream)
+{
+	if (stream->original)
+		fclose(stream->original);
+	g_free(stream->originals);
+	g_free(stream->original_blocks);
+	stream->original = NULL;
+	stream->originals = NULL;
+	stream->original_blocks = NULL;
+}
+
+// Copies every mip of an image from the original VTF, if the image hasn't changed since it was loaded.
+// Otherwise, or if the original couldn't be read, *copied is FALSE and the image should be encoded as normal.
+// Returns FALSE if writing failed.
+static gboolean vtf_stream_copy(VtfStream_t* stream, guint image, gboolean* copied)
+{
+	const VtfFileHeader_t*			header = &stream->original_header;
+	const VtfOriginalSurface_t*		original = NULL;
+	gsize							size, pos;
+	vlUInt							mip;
+	guint							i;
+
+	*copied = FALSE;
+
+	for (i = 0; i < stream->num_originals && !original; i++)
+		if (stream->originals[i].hash == stream->hashes[image])
+			original = &stream->originals[i];
+
+	if ( !original || original->frame >= MAX(1,header->frames) || original->face >= vtf_face_count(header) || original->slice >= MAX(1,header->depth) )
+		return TRUE;
+
+	for (mip = 0, pos = 0; mip < stream->mips; mip++, pos += size)
+	{
+		size = vtf_stream_surface_size(stream,MAX(1,stream->width >> mip),MAX(1,stream->height >> mip));
+		if ( !vtf_fseek(stream->original,(guint64)stream->original_offset + vtf_surface_offset(header,mip,original->frame,original->face,original->slice))
+			|| fread(stream->original_blocks + pos,1,size,stream->original) != size )
+			return TRUE;
+	}
+
+	for (mip = 0, pos = 0; mip < stream->mips; mip++, pos += size)
+	{
+		size = vtf_stream_surface_size(stream,MAX(1,stream->width >> mip),MAX(1,stream->height >> mip));
+		if ( !vtf_writer_write(&stream->writer,vtf_stream_image_offset(stream,mip,image),stream->original_blocks + pos,size) )
+		{
+			vtf_stream_error(stream,"#file_write_error");
+			return FALSE;
+		}
+	}
+
+	*copied = TRUE;
+	return TRUE;
+}
+
+// The first image with the same pixels as this one, which is the image itself unless it is a duplicate.
+// Hashes are compared rather than pixels, as earlier images are long gone by now.
+static guint vtf_stream_first_copy(const VtfStream_t* stream, guint image)
+{
+	guint i;
+
+	for (i = 0; i < image; i++)
+		if (stream->hashes[i] == stream->hashes[image])
+			return i;
+	return image;
+}
+
+// Copies the blocks of every mip of the images that this batch's duplicates repeat, all of which have been
+// written by now
+static gboolean vtf_stream_write_duplicates(VtfStream_t* stream, guint num_duplicates)
+{
+	guint	i, source;
+	vlUInt	mip;
+	gsize	size;
+
+	for (i = 0; i < num_duplicates; i++)
+	{
+		source = vtf_stream_first_copy(stream,stream->duplicates[i]);
+
+		for (mip = 0; mip < stream->mips; mip++)
+		{
+			size = vtf_stream_surface_size(stream,MAX(1,stream->width >> mip),MAX(1,stream->height >> mip));
+			if ( !vtf_writer_read(&stream->writer,vtf_stream_image_offset(stream,mip,source),stream->copy_blocks,size)
+				|| !vtf_writer_write(&stream->writer,vtf_stream_image_offset(stream,mip,stream->duplicates[i]),stream->copy_blocks,size) )
+			{
+				vtf_stream_error(stream,"#file_write_error");
+				return FALSE;
+			}
+		}
+	}
+
+	stream->num_duplicates += num_duplicates;
+	return TRUE;
+}
+
+// Mips, encodes and writes the current batch
+static gboolean vtf_stream_encode(VtfStream_t* stream)
+{
+	guint		i, count = 0, num_duplicates = 0;
+	vlUInt		mip;
+	gboolean	copied = FALSE;
+	gboolean	result;
+
+	if (stream->first == 0 && !vtf_stream_open(stream,stream->batch[0],stream->opt))
+		return FALSE;
+
+	if (stream->depth > 1 && stream->mips > 1)
+		return vtf_stream_volume_slice(stream,stream->pending,0,stream->first,stream->batch[0]);
+
+	for (i = 0; i < stream->count; i++)
+	{
+		// Hold frames, ping-pong loops and the like are only encoded once
+		if ( vtf_stream_first_copy(stream,stream->first + i) != stream->first + i )
+		{
+			stream->duplicates[num_duplicates++] = stream->first + i;
+			continue;
+		}
+
+		if ( stream->original && !vtf_stream_copy(stream,stream->first + i,&copied) )
+			return FALSE;
+		if (copied)
+			continue;
+
+		stream->images[count] = stream->first + i;
+		stream->chains[count].width = stream->width;
+		stream->chains[count].height = stream->height;
+		stream->chains[count].depth = 1;
+		stream->chains[count].num_levels = stream->mips;
+		stream->chains[count].levels[0] = stream->batch[i];
+		count++;
+	}
+
+	if (!count)
+		return vtf_stream_write_duplicates(stream,num_duplicates);
+
+	if (stream->mips > 1 && !mip_build_chains(stream->chains,count,&stream->mip_options))
+	{
+		mip_free_chains(stream->chains,count);
+		vtf_stream_error(stream,"#no_memory_error");
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i++)
+		for (mip = 0; mip < stream->mips; mip++)
+		{
+			VtfDxtSurface_t*	surface = &stream->surfaces[i * stream->mips + mip];
+
+			surface->rgba = stream->chains[i].levels[mip];
+			surface->width = MAX(1,stream->width >> mip);
+			surface->height = MAX(1,stream->height >> mip);
+			stream->offsets[i * stream->mips + mip] = vtf_stream_image_offset(stream,mip,stream->images[i]);
+		}
+
+	result = vtf_stream_write(stream,stream->surfaces,stream->offsets,count * stream->mips);
+	mip_free_chains(stream->chains,count);
+	return result && vtf_stream_write_duplicates(stream,num_duplicates);
+}
+
+// Takes the next image in VTF order, and encodes a batch once it is complete. Buffers go back to the
+// empty queue afterwards, even after a failure, so that the reader never waits forever.
+static void vtf_stream_add(VtfStream_t* stream, vlByte* image)
+{
+	stream->batch[stream->count++] = image;
+	vtf_reflectivity_add(image,stream->width,stream->height,stream->reflectivity);
+
+	if (stream->count < stream->batch_size && stream->first + stream->count < stream->num_images)
+		return;
+
+	if ( !g_atomic_int_get(&stream->failed) && !vtf_stream_encode(stream) )
+		g_atomic_int_set(&stream->failed,TRUE);
+
+	stream->first += stream->count;
+	g_atomic_int_set(&stream->written,stream->first);
+	if (stream->progress)
+		g_async_queue_push(stream->progress,GUINT_TO_POINTER(stream->first));
+
+	while (stream->count)
+		g_async_queue_push(stream->empty,stream->batch[--stream->count]);
+}
+
+// Images are read on the calling thread (GIMP can only be talked to from the main one), so encoding gets one of its own
+static gpointer vtf_stream_encoder(gpointer data)
+{
+	VtfStream_t*	stream = (VtfStream_t*)data;
+	gpointer		image;
+
+	while ( (image = g_async_queue_pop(stream->full)) != stream )
+		vtf_stream_add(stream,(vlByte*)image);
+
+	g_async_queue_push(stream->progress,stream);
+	return NULL;
+}
+
+guint vtf_select_format(const VtfSaveOptions_t* opt, gboolean grey)
+{
+	if (opt->AdvancedSetup)
+		return opt->PixelFormat;
+
+	if (opt->Compress)
+	{
+		if (opt->WithAlpha)
+			return 3;
+		else
+			return 0;
+	}
+	else
+	{
+		if (opt->WithAlpha)
+		{
+			if (grey) return 10;
+			else return 5;
+		}
+		else
+		{
+			if (grey) return 8;
+			else return 4;
+		}
+	}
+}
+
+void vtf_stream_init(VtfStream_t* stream, const VtfSaveOptions_t* opt, guint format_index, guint width, guint height, guint num_images)
+{
+	guint32 flags = opt->GeneralFlags; // Import unhandled flags from a loaded VTF
+
+	if (opt->Clamp)
+		flags |= TEXTUREFLAGS_CLAMPS | TEXTUREFLAGS_CLAMPT;
+	if (opt->NoLOD)
+		flags |= TEXTUREFLAGS_NOLOD;
+	switch (opt->BumpType)
+	{
+	case BUMP:
+		flags |= TEXTUREFLAGS_NORMAL;
+		flags &= ~TEXTUREFLAGS_SSBUMP;
+		break;
+	case SSBUMP:
+		flags |= TEXTUREFLAGS_SSBUMP;
+		flags &= ~TEXTUREFLAGS_NORMAL;
+		break;
+	case NOT_BUMP:
+		flags &= ~TEXTUREFLAGS_SSBUMP;
+		flags &= ~TEXTUREFLAGS_NORMAL;
+		break;
+	}
+
+	memset(stream,0,sizeof(VtfStream_t));
+	stream->opt = opt;
+	stream->num_images = num_images;
+	stream->format = vtf_formats[format_index].vlFormat;
+	stream->flags = flags;
+	stream->compressed = vtf_dxt_format(stream->format,&stream->dxt_format);
+	stream->dxt_quality = (VtfDxtQuality_t)opt->DxtQuality;
+	stream->width = width;
+	stream->height = height;
+	stream->frames = stream->faces = stream->depth = 1;
+
+	switch (opt->LayerUse)
+	{
+	case VTF_MERGE_VISIBLE:
+		break;
+	case VTF_ANIMATION:
+		stream->frames = num_images;
+		break;
+	case VTF_ENVMAP:
+		g_assert(num_images == 6); // callers check this
+		stream->faces = num_images;
+		break;
+	case VTF_VOLUME:
+		stream->depth = num_images;
+		break;
+	}
+
+	stream->mips = opt->WithMips ? mip_level_count(stream->width,stream->height,stream->depth) : 1;
+	stream->mip_options.filter = (VtfMipFilter_t)opt->MipFilter;
+	stream->mip_options.gamma_correct = opt->MipGamma && opt->BumpType == NOT_BUMP; // bump maps hold vectors, not colours
+	stream->mip_options.clamp = opt->Clamp;
+	stream->mip_options.normal_map = opt->BumpType == BUMP; // SSBump holds three intensities rather than a vector
+	stream->mip_options.toksvig = opt->MipToksvig;
+	vtf_stream_layout(stream);
+}
+
+// Reads images on this thread while another mips, encodes and writes them, a few at a time, so that
+// fetching pixels overlaps with compression and memory use doesn't grow with the number of frames.
+gboolean vtf_stream_images(VtfStream_t* stream, const gchar* path, VtfReadImageFunc read_image, VtfProgressFunc progress, gpointer user_data)
+{
+	guint		num_images = stream->num_images;
+	vlByte**	buffers;
+	GThread*	encoder = NULL;
+	gboolean	volume_mips = stream->depth > 1 && stream->mips > 1;
+	gboolean	read = TRUE;
+	guint		in_flight, num_buffers, i;
+	gpointer	message;
+	vlUInt		mip;
+	gboolean	result;
+
+	in_flight = stream->in_flight ? stream->in_flight : vtf_get_num_threads() * 2;
+
+	// With two or more buffers, one batch can be read while the one before it is encoded
+	stream->path = path;
+	stream->batch_size = volume_mips ? 1 : CLAMP(in_flight >= 2 ? in_flight / 2 : 1,1,num_images);
+	num_buffers = MAX(stream->batch_size,MIN(in_flight,num_images));
+
+	stream->hashes = g_try_new(guint64,num_images);
+	buffers = g_try_new0(vlByte*,num_buffers);
+	stream->batch = g_try_new0(vlByte*,stream->batch_size);
+	stream->images = g_try_new(guint,stream->batch_size);
+	stream->duplicates = g_try_new(guint,stream->batch_size);
+	stream->copy_blocks = g_try_new(guint8,vtf_stream_surface_size(stream,stream->width,stream->height));
+	stream->chains = g_try_new0(VtfMipChain_t,stream->batch_size);
+	stream->surfaces = g_try_new(VtfDxtSurface_t,stream->batch_size * stream->mips);
+	stream->offsets = g_try_new(gsize,stream->batch_size * stream->mips);
+
+	// Each batch has the same encoded size, except for volume mips which are written one slice at a time
+	stream->blocks = g_try_new(guint8,volume_mips ? vtf_stream_surface_size(stream,stream->width,stream->height) : stream->image_size / num_images * stream->batch_size);
+
+	vtf_original_open(stream);
+
+	result = stream->hashes && buffers && stream->batch && stream->images && stream->duplicates && stream->copy_blocks && stream->chains && stream->surfaces && stream->offsets && stream->blocks;
+	for (i = 0; i < num_buffers && result; i++)
+		result = (buffers[i] = g_try_new(vlByte,(gsize)stream->width * stream->height * 4)) != NULL;
+	for (mip = 0; volume_mips && mip < stream->mips && result; mip++)
+	{
+		vlUInt w,h,d;
+		vlImageComputeMipmapDimensions(stream->width,stream->height,stream->depth,mip,&w,&h,&d);
+		result = (stream->pending[mip] = g_try_new(guint8,w * h * 4 * 2)) != NULL;
+	}
+
+	if (result)
+	{
+		stream->full = g_async_queue_new();
+		stream->empty = g_async_queue_new();
+		for (i = 0; i < num_buffers; i++)
+			g_async_queue_push(stream->empty,buffers[i]);
+
+		if (num_buffers > stream->batch_size)
+		{
+			stream->progress = g_async_queue_new();
+			encoder = vtf_thread_new(vtf_stream_encoder,stream);
+			if (!encoder)
+			{
+				g_async_queue_unref(stream->progress);
+				stream->progress = NULL;
+			}
+		}
+
+		for (i = 0; i < num_images && read && !g_atomic_int_get(&stream->failed); i++)
+		{
+			vlByte* image = (vlByte*)g_async_queue_pop(stream->empty);
+
+			read = read_image(i,num_images,image,user_data);
+			if (!read)
+				break;
+			stream->hashes[i] = vtf_hash_image(image,stream->width,stream->height);
+
+			if (encoder)
+				g_async_queue_push(stream->full,image);
+			else
+				vtf_stream_add(stream,image);
+
+			if (progress)
+				progress(i + 1,g_atomic_int_get(&stream->written),num_images,user_data);
+		}
+
+		if (encoder)
+		{
+			g_async_queue_push(stream->full,stream);
+			while ( (message = g_async_queue_pop(stream->progress)) != stream )
+				if (progress)
+					progress(i,g_atomic_int_get(&stream->written),num_images,user_data);
+			g_thread_join(encoder);
+			g_async_queue_unref(stream->progress);
+		}
+
+		g_async_queue_unref(stream->full);
+		g_async_queue_unref(stream->empty);
+
+		// The encoder records its own errors, but mustn't race with this thread to do so
+		if (!read)
+			vtf_stream_error(stream,"#no_memory_error");
+		result = read && !stream->failed;
+	}
+	else
+		vtf_stream_error(stream,"#no_memory_error");
+
+	// Before the writer replaces what may be the same file
+	vtf_original_close(stream);
+
+	for (i = 0; i < 3; i++)
+		stream->writer.reflectivity[i] = (gfloat)(stream->reflectivity[i] / num_images);
+
+	if (!result)
+		vtf_writer_abort(&stream->writer);
+	else if ( !vtf_writer_close(&stream->writer) )
+	{
+		vtf_stream_error(stream,"#file_write_error");
+		result = FALSE;
+	}
+
+	for (i = 0; buffers && i < num_buffers; i++)
+		g_free(buffers[i]);
+	for (mip = 0; mip < MIP_MAX_LEVELS; mip++)
+		g_free(stream->pending[mip]);
+	g_free(buffers);
+	g_free(stream->batch);
+	g_free(stream->images);
+	g_free(stream->duplicates);
+	g_free(stream->copy_blocks);
+	g_free(stream->chains);
+	g_free(stream->surfaces);
+	g_free(stream->offsets);
+	g_free(stream->blocks);
+	stream->blocks = NULL;
+
+	return result;
+}
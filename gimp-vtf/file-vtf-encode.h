@@ -0,0 +1,123 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_ENCODE_H
+#define FILE_VTF_ENCODE_H
+
+#include "VTFLib.h"
+#include "file-vtf-dxt.h"
+#include "file-vtf-io.h"
+#include "file-vtf-mip.h"
+#include "file-vtf-options.h"
+
+#include <glib.h>
+#include <stdio.h>
+
+// Writes VTFs from RGBA8888 images. Free of GIMP, so that vtf-batch can share it with the plug-in.
+
+// Attached to images loaded from block-compressed VTFs, so that images which haven't changed can be exported
+// again by copying their blocks instead of compressing them, which is slow and loses a little more quality
+// each time. Followed by num_surfaces VtfOriginalSurface_t, then the VTF's path. Only trusted while the VTF
+// still has the same size and modification time.
+#define VTF_ORIGINAL_PARASITE	"vtf-original"
+#define VTF_ORIGINAL_VERSION	1
+
+typedef struct VtfOriginal
+{
+	guint32	version;
+	guint32	num_surfaces;
+	gint64	file_size;
+	gint64	file_mtime;
+} VtfOriginal_t;
+
+typedef struct VtfOriginalSurface
+{
+	guint64	hash;	// of the full-size surface decoded to RGBA8888; see vtf_hash_image()
+	guint32	frame, face, slice;
+} VtfOriginalSurface_t;
+
+// Fills 'rgba' (width * height * 4 bytes) with image 'index' of 'num_images', in VTF order. Called from the
+// thread which called vtf_stream_images(). Returns FALSE if out of memory.
+typedef gboolean (*VtfReadImageFunc)(guint index, guint num_images, vlByte* rgba, gpointer user_data);
+
+// After each image is read, and while waiting for the last ones to be written
+typedef void (*VtfProgressFunc)(guint read, guint written, guint num_images, gpointer user_data);
+
+// VTFLib's DXT compressor is slow and offers no quality settings, its mipmaps are made with a single
+// fixed filter, and it needs every frame in memory at once. So we lay the file out ourselves, making the
+// header and low-res image from the first frame, and stream the image data into it as it is encoded.
+typedef struct VtfStream
+{
+	VtfWriter_t		writer;
+	const gchar*	path;
+	VTFImageFormat	format;
+	guint32			flags;
+	gboolean		compressed;
+	VtfDxtFormat_t	dxt_format;
+	VtfDxtQuality_t	dxt_quality;
+	VtfMipOptions_t	mip_options;
+	vlUInt			width, height, frames, faces, depth, mips;
+	gsize			mip_offsets[MIP_MAX_LEVELS];
+	gsize			image_size;
+	guint8*			blocks; // room for one batch of encoded surfaces
+
+	// Set by the caller between vtf_stream_init() and vtf_stream_images(), if wanted
+	guint			in_flight;		// images held in memory at once; 0 = two per thread
+	const guint8*	original_data;	// a VTF_ORIGINAL_PARASITE, whose blocks are copied where images match
+	gsize			original_size;
+
+	// The first thing which went wrong: an ID from file-vtf_en.po, or VTFLib's own message. Empty until then.
+	gchar			error[256];
+
+	// The encoding stage, which collects images into batches
+	const VtfSaveOptions_t*	opt;
+	guint				num_images, batch_size;
+	guint64*			hashes;		// of each image, taken as it is read. Left for the caller to g_free() (or keep).
+	gdouble				reflectivity[3];	// sum of each image's average linear colour
+	guint				first, count; // of the current batch
+	vlByte**			batch;
+	guint*				images;		// of the batch which need encoding
+	guint*				duplicates;	// of the batch which repeat an earlier image, copied once the batch is written
+	guint8*				copy_blocks;	// one full-size surface
+	guint				num_duplicates;
+	VtfMipChain_t*		chains;
+	VtfDxtSurface_t*	surfaces;
+	gsize*				offsets;
+	guint8*				pending[MIP_MAX_LEVELS];
+
+	// Images which haven't changed since they were loaded from a block compressed VTF keep its blocks
+	FILE*					original;		// NULL if there is nothing to reuse
+	VtfFileHeader_t			original_header;
+	gsize					original_offset;
+	guint					num_originals;
+	VtfOriginalSurface_t*	originals;
+	guint8*					original_blocks;	// every mip of one image
+
+	// Between the reading and encoding stages, which are bounded by the number of image buffers
+	GAsyncQueue*		full;		// read images, then the stream itself to stop
+	GAsyncQueue*		empty;		// buffers for the reader to fill
+	GAsyncQueue*		progress;	// after each batch, then the stream itself once stopped
+	volatile gint		written;
+	volatile gint		failed;
+} VtfStream_t;
+
+// The index into vtf_formats[] which the options ask for. Simple setups pick I8 and IA88 for greyscale images.
+guint vtf_select_format(const VtfSaveOptions_t* opt, gboolean grey);
+
+// Lays out a VTF of num_images width x height images (frames, faces or slices, according to opt->LayerUse).
+// 'opt' must outlive the stream.
+void vtf_stream_init(VtfStream_t* stream, const VtfSaveOptions_t* opt, guint format_index, guint width, guint height, guint num_images);
+
+// Reads every image, a few at a time, and writes the VTF to 'path'. If anything fails, stream->error says
+// why and whatever was at 'path' is left alone.
+gboolean vtf_stream_images(VtfStream_t* stream, const gchar* path, VtfReadImageFunc read_image, VtfProgressFunc progress, gpointer user_data);
+
+#endif
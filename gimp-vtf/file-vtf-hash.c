@@ -0,0 +1,118 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-hash.h"
+#include "file-vtf-pool.h"
+
+#include <string.h>
+
+#define HASH_K1 G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)
+#define HASH_K2 G_GUINT64_CONSTANT(0xBF58476D1CE4E5B9)
+#define HASH_K3 G_GUINT64_CONSTANT(0x94D049BB133111EB)
+
+static guint64 hash_mix(guint64 h)
+{
+	h ^= h >> 30;
+	h *= HASH_K2;
+	h ^= h >> 27;
+	h *= HASH_K3;
+	return h ^ (h >> 31);
+}
+
+// Eight bytes at a time, with a full mix at the end
+guint64 vtf_hash(const void* data, gsize size, guint64 seed)
+{
+	const guint8*	p = (const guint8*)data;
+	guint64			h = seed ^ ((guint64)size * HASH_K1);
+	guint64			w;
+
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		memcpy(&w,p,8);
+		h = (h ^ (w * HASH_K2)) * HASH_K1;
+		h = (h << 29) | (h >> 35);
+	}
+
+	w = 0;
+	memcpy(&w,p,size);
+	h = (h ^ (w * HASH_K2)) * HASH_K1;
+
+	return hash_mix(h);
+}
+
+// Chained rather than hashed as one array, so that bands can be added one at a time when there is no memory
+// for an array of them
+static guint64 hash_chain(guint64 hash, guint64 band_hash)
+{
+	return vtf_hash(&band_hash,sizeof(band_hash),hash);
+}
+
+guint64 vtf_hash_bands(const guint64* band_hashes, guint num_bands)
+{
+	guint64	hash = 0;
+	guint	i;
+
+	for (i = 0; i < num_bands; i++)
+		hash = hash_chain(hash,band_hashes[i]);
+	return hash;
+}
+
+typedef struct HashJob
+{
+	const guint8*	rgba;
+	guint			width, height;
+	guint64*		band_hashes;
+} HashJob_t;
+
+static void hash_band(guint index, gpointer user_data)
+{
+	HashJob_t*	job = (HashJob_t*)user_data;
+	guint		row = index * VTF_HASH_BAND_ROWS;
+	guint		rows = MIN(VTF_HASH_BAND_ROWS,job->height - row);
+
+	job->band_hashes[index] = vtf_hash(job->rgba + row * job->width * 4,rows * job->width * 4,0);
+}
+
+guint64 vtf_hash_image(const guint8* rgba, guint width, guint height)
+{
+	HashJob_t	job;
+	guint		num_bands = (height + VTF_HASH_BAND_ROWS - 1) / VTF_HASH_BAND_ROWS;
+	guint64		band_hashes[64];
+	guint64		hash;
+	guint		i;
+
+	job.rgba = rgba;
+	job.width = width;
+	job.height = height;
+	job.band_hashes = num_bands <= G_N_ELEMENTS(band_hashes) ? band_hashes : g_try_new(guint64,num_bands);
+
+	// Without the memory to do it in parallel, do it here one band at a time
+	if (!job.band_hashes)
+	{
+		job.band_hashes = band_hashes;
+		hash = 0;
+		for (i = 0; i < num_bands; i++)
+		{
+			hash_band(0,&job);
+			hash = hash_chain(hash,band_hashes[0]);
+			job.rgba += VTF_HASH_BAND_ROWS * width * 4;
+			job.height -= MIN(VTF_HASH_BAND_ROWS,job.height);
+		}
+		return hash;
+	}
+
+	vtf_parallel_for(num_bands,hash_band,&job);
+	hash = vtf_hash_bands(job.band_hashes,num_bands);
+
+	if (job.band_hashes != band_hashes)
+		g_free(job.band_hashes);
+	return hash;
+}
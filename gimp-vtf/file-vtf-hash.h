@@ -0,0 +1,30 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_HASH_H
+#define FILE_VTF_HASH_H
+
+#include <glib.h>
+
+// Fast 64-bit content hashes, for spotting images which haven't changed. Not cryptographic, and in native
+// byte order.
+
+#define VTF_HASH_BAND_ROWS 64
+
+guint64 vtf_hash(const void* data, gsize size, guint64 seed);
+
+// RGBA8888 images are hashed in bands of VTF_HASH_BAND_ROWS rows on the worker pool, and the band hashes
+// are then hashed in order. Anything which already visits an image in bands can hash each one with
+// vtf_hash(band,size,0) and pass the results to vtf_hash_bands() to get the same answer.
+guint64 vtf_hash_bands(const guint64* band_hashes, guint num_bands);
+guint64 vtf_hash_image(const guint8* rgba, guint width, guint height);
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-io.h"
+
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+	#include <io.h>
+	#define vtf_fdopen _fdopen
+	#define vtf_close _close
+#else
+	#include <unistd.h>
+	#define vtf_fdopen fdopen
+	#define vtf_close close
+#endif
+
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
+#define VTF_WRITER_BUFFER_SIZE (1 << 20)
+
+static guint16 read_u16(const guint8* p)
+{
+	return (guint16)(p[0] | (p[1] << 8));
+}
+
+static guint32 read_u32(const guint8* p)
+{
+	return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static gfloat read_f32(const guint8* p)
+{
+	union { guint32 u; gfloat f; } v;
+	v.u = read_u32(p);
+	return v.f;
+}
+
+static void write_u16(guint8* p, guint16 value)
+{
+	p[0] = value & 0xFF;
+	p[1] = value >> 8;
+}
+
+static void write_u32(guint8* p, guint32 value)
+{
+	p[0] = value & 0xFF;
+	p[1] = (value >> 8) & 0xFF;
+	p[2] = (value >> 16) & 0xFF;
+	p[3] = value >> 24;
+}
+
+static void write_f32(guint8* p, gfloat value)
+{
+	union { guint32 u; gfloat f; } v;
+	v.f = value;
+	write_u32(p,v.u);
+}
+
+gboolean vtf_read_header(const guint8* data, gsize size, VtfFileHeader_t* header)
+{
+	if (size < 64 || memcmp(data,"VTF\0",4) != 0)
+		return FALSE;
+
+	memset(header,0,sizeof(VtfFileHeader_t));
+
+	header->version[0]		= read_u32(data + 4);
+	header->version[1]		= read_u32(data + 8);
+	header->header_size		= read_u32(data + 12);
+	header->width			= read_u16(data + 16);
+	header->height			= read_u16(data + 18);
+	header->flags			= read_u32(data + 20);
+	header->frames			= read_u16(data + 24);
+	header->start_frame		= read_u16(data + 26);
+	header->reflectivity[0]	= read_f32(data + 32);
+	header->reflectivity[1]	= read_f32(data + 36);
+	header->reflectivity[2]	= read_f32(data + 40);
+	header->bumpmap_scale	= read_f32(data + 48);
+	header->format			= (gint32)read_u32(data + 52);
+	header->mip_count		= data[56];
+	header->lowres_format	= (gint32)read_u32(data + 57);
+	header->lowres_width	= data[61];
+	header->lowres_height	= data[62];
+	header->depth			= 1;
+
+	if (header->version[0] != 7 || header->header_size > size)
+		return FALSE;
+
+	// Formats index VTFLib's tables, so a damaged file mustn't get any further
+	if (!header->width || !header->height || header->format < 0 || header->format >= IMAGE_FORMAT_COUNT)
+		return FALSE;
+	if (header->lowres_format != IMAGE_FORMAT_NONE && (header->lowres_format < 0 || header->lowres_format >= IMAGE_FORMAT_COUNT))
+		return FALSE;
+
+	if (header->version[1] >= 2)
+	{
+		if (size < VTF_HEADER_SIZE)
+			return FALSE;
+		header->depth = read_u16(data + 63);
+	}
+	if (header->version[1] >= 3)
+	{
+		// The resource directory must fit in the header (and the sum could overflow)
+		header->num_resources = read_u32(data + 68);
+		if (header->header_size < VTF_HEADER_SIZE || header->num_resources > (header->header_size - VTF_HEADER_SIZE) / VTF_RESOURCE_ENTRY_SIZE)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Only for 7.2+ headers, which is all that the plug-in writes
+void vtf_write_header(guint8* data, const VtfFileHeader_t* header)
+{
+	memcpy(data,"VTF\0",4);
+	write_u32(data + 4,		header->version[0]);
+	write_u32(data + 8,		header->version[1]);
+	write_u32(data + 12,	header->header_size);
+	write_u16(data + 16,	header->width);
+	write_u16(data + 18,	header->height);
+	write_u32(data + 20,	header->flags);
+	write_u16(data + 24,	header->frames);
+	write_u16(data + 26,	header->start_frame);
+	write_f32(data + 32,	header->reflectivity[0]);
+	write_f32(data + 36,	header->reflectivity[1]);
+	write_f32(data + 40,	header->reflectivity[2]);
+	write_f32(data + 48,	header->bumpmap_scale);
+	write_u32(data + 52,	(guint32)header->format);
+	data[56] =				header->mip_count;
+	write_u32(data + 57,	(guint32)header->lowres_format);
+	data[61] =				header->lowres_width;
+	data[62] =				header->lowres_height;
+	write_u16(data + 63,	header->depth);
+
+	if (header->version[1] >= 3)
+		write_u32(data + 68, header->num_resources);
+}
+
+guint8* vtf_read_file_header(FILE* file, VtfFileHeader_t* header)
+{
+	guint8	start[16];
+	guint8*	data;
+	guint32	size;
+
+	if ( fread(start,1,16,file) != 16 )
+		return NULL;
+
+	// Includes the resource directory, which VTFLib limits to 32 entries
+	size = read_u32(start + 12);
+	if (size < 64 || size > 0x10000)
+		return NULL;
+
+	data = g_try_new(guint8,size);
+	if (!data)
+		return NULL;
+
+	memcpy(data,start,16);
+	if ( fread(data + 16,1,size - 16,file) != size - 16 || !vtf_read_header(data,size,header) )
+	{
+		g_free(data);
+		return NULL;
+	}
+	return data;
+}
+
+gboolean vtf_find_images(const guint8* data, const VtfFileHeader_t* header, gsize* lowres_offset, gsize* image_offset)
+{
+	guint32 i;
+
+	*lowres_offset = *image_offset = 0;
+
+	if (header->version[1] < 3)
+	{
+		// Low-res image, then high-res image
+		*image_offset = header->header_size;
+		if (header->lowres_format != IMAGE_FORMAT_NONE)
+		{
+			*lowres_offset = header->header_size;
+			*image_offset += vlImageComputeImageSize(header->lowres_width,header->lowres_height,1,1,(VTFImageFormat)header->lowres_format);
+		}
+		return TRUE;
+	}
+
+	for (i = 0; i < header->num_resources; i++)
+	{
+		const guint8* entry = data + VTF_HEADER_SIZE + i * VTF_RESOURCE_ENTRY_SIZE;
+
+		switch (read_u32(entry) & 0xFFFFFF)
+		{
+		case VTF_RESOURCE_TYPE_LOWRES:
+			if (header->lowres_format != IMAGE_FORMAT_NONE)
+				*lowres_offset = read_u32(entry + 4);
+			break;
+		case VTF_RESOURCE_TYPE_IMAGE:
+			*image_offset = read_u32(entry + 4);
+			break;
+		}
+	}
+	return *image_offset != 0;
+}
+
+gboolean vtf_find_resource_value(const guint8* data, const VtfFileHeader_t* header, guint32 type, guint32* value)
+{
+	guint32 i;
+
+	if (header->version[1] < 3)
+		return FALSE;
+
+	for (i = 0; i < header->num_resources; i++)
+	{
+		const guint8* entry = data + VTF_HEADER_SIZE + i * VTF_RESOURCE_ENTRY_SIZE;
+
+		if ( (read_u32(entry) & 0xFFFFFF) == type && entry[3] & VTF_RESOURCE_FLAG_NO_DATA )
+		{
+			*value = read_u32(entry + 4);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+guint vtf_face_count(const VtfFileHeader_t* header)
+{
+	if ( !(header->flags & TEXTUREFLAGS_ENVMAP) )
+		return 1;
+
+	// Before 7.5, envmaps have a spheremap too unless the start frame says otherwise
+	return header->version[1] < 5 && header->start_frame != 0xffff ? 7 : 6;
+}
+
+// As vlImageComputeImageSize(), which is only 32-bit
+static guint64 vtf_image_size64(vlUInt width, vlUInt height, vlUInt depth, VTFImageFormat format)
+{
+	const SVTFImageFormatInfo* info = vlImageGetImageFormatInfo(format);
+
+	if (info->bIsCompressed)
+		return (guint64)((width + 3) / 4) * ((height + 3) / 4) * depth * info->uiBitsPerPixel * 2; // 4x4 blocks
+	return (guint64)width * height * depth * info->uiBitsPerPixel / 8;
+}
+
+guint64 vtf_image_data_size(const VtfFileHeader_t* header)
+{
+	guint	depth = MAX(1,header->depth);
+	guint	level;
+	vlUInt	w,h,d;
+	guint64	size = 0;
+
+	for (level = 0; level < MAX(header->mip_count,1); level++)
+	{
+		vlImageComputeMipmapDimensions(header->width,header->height,depth,level,&w,&h,&d);
+		size += vtf_image_size64(w,h,d,(VTFImageFormat)header->format) * MAX(1,header->frames) * vtf_face_count(header);
+	}
+	return size;
+}
+
+// Sizes are multiplied as gsize, since a whole flipbook or volume can pass 4GB
+gsize vtf_surface_offset(const VtfFileHeader_t* header, guint mip, guint frame, guint face, guint slice)
+{
+	guint	frames = MAX(1,header->frames);
+	guint	faces = vtf_face_count(header);
+	guint	depth = MAX(1,header->depth);
+	guint	level;
+	vlUInt	w,h,d;
+	gsize	offset = 0;
+
+	// Smallest mip first, then frames, faces and slices
+	for (level = MAX(header->mip_count,1) - 1; level > mip; level--)
+	{
+		vlImageComputeMipmapDimensions(header->width,header->height,depth,level,&w,&h,&d);
+		offset += (gsize)vlImageComputeImageSize(w,h,d,1,(VTFImageFormat)header->format) * frames * faces;
+	}
+
+	vlImageComputeMipmapDimensions(header->width,header->height,depth,mip,&w,&h,&d);
+	return offset + (((gsize)frame * faces + face) * d + slice) * vlImageComputeImageSize(w,h,1,1,(VTFImageFormat)header->format);
+}
+
+gboolean vtf_file_stat(const gchar* path, gint64* size, gint64* mtime)
+{
+#if GLIB_CHECK_VERSION(2,26,0)
+	GStatBuf	st;
+#else
+	struct stat	st;
+#endif
+
+	if ( g_stat(path,&st) != 0 )
+		return FALSE;
+
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return TRUE;
+}
+
+gboolean vtf_fseek(FILE* file, guint64 offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file,(__int64)offset,SEEK_SET) == 0;
+#else
+	return fseeko(file,(off_t)offset,SEEK_SET) == 0;
+#endif
+}
+
+gboolean vtf_writer_open(VtfWriter_t* writer, const gchar* path, VtfFileHeader_t* header, const guint8* lowres,
+	const VtfResourceValue_t* values, guint num_values, gsize image_size)
+{
+	gsize		lowres_size = 0, offset;
+	guint8*		prefix;
+	guint8*		entry;
+	guint		i;
+	gint		fd;
+	gboolean	result;
+
+	memset(writer,0,sizeof(VtfWriter_t));
+
+	if (header->lowres_format != IMAGE_FORMAT_NONE)
+		lowres_size = vlImageComputeImageSize(header->lowres_width,header->lowres_height,1,1,(VTFImageFormat)header->lowres_format);
+
+	// The header, the resource directory, the low-res image, then the high-res image
+	header->num_resources = header->version[1] >= 3 ? (lowres_size ? 1 : 0) + 1 + num_values : 0;
+	header->header_size = VTF_HEADER_SIZE + header->num_resources * VTF_RESOURCE_ENTRY_SIZE;
+	offset = header->header_size + lowres_size;
+
+	prefix = g_try_new0(guint8,offset);
+	if (!prefix)
+		return FALSE;
+
+	vtf_write_header(prefix,header);
+
+	// In order of type, as VTFLib writes them
+	entry = prefix + VTF_HEADER_SIZE;
+	if (header->num_resources)
+	{
+		if (lowres_size)
+		{
+			write_u32(entry,VTF_RESOURCE_TYPE_LOWRES);
+			write_u32(entry + 4,header->header_size);
+			entry += VTF_RESOURCE_ENTRY_SIZE;
+		}
+
+		write_u32(entry,VTF_RESOURCE_TYPE_IMAGE);
+		write_u32(entry + 4,(guint32)offset);
+		entry += VTF_RESOURCE_ENTRY_SIZE;
+
+		for (i = 0; i < num_values; i++, entry += VTF_RESOURCE_ENTRY_SIZE)
+		{
+			write_u32(entry,values[i].type | (VTF_RESOURCE_FLAG_NO_DATA << 24));
+			write_u32(entry + 4,values[i].value);
+		}
+	}
+
+	if (lowres_size)
+		memcpy(prefix + header->header_size,lowres,lowres_size);
+
+	// In the same directory, so that it can be renamed over the destination, and with a name no other writer has
+	writer->path = g_strdup(path);
+	writer->temp_path = g_strconcat(path,".XXXXXX",NULL);
+	fd = g_mkstemp_full(writer->temp_path,O_RDWR | O_BINARY,0666);
+	if (fd == -1)
+	{
+		g_free(writer->temp_path);
+		writer->temp_path = NULL;
+	}
+	else if ( (writer->file = vtf_fdopen(fd,"w+b")) == NULL )
+		vtf_close(fd);
+	writer->image_offset = offset;
+	writer->image_size = image_size;
+	memcpy(writer->reflectivity,header->reflectivity,sizeof(writer->reflectivity));
+
+	// Surfaces are mostly written in order, and small mips would otherwise each be a separate write
+	if (writer->file)
+		setvbuf(writer->file,NULL,_IOFBF,VTF_WRITER_BUFFER_SIZE);
+
+	result = writer->file != NULL && fwrite(prefix,1,offset,writer->file) == offset;
+	g_free(prefix);
+
+	if (!result)
+		vtf_writer_abort(writer);
+	return result;
+}
+
+gboolean vtf_writer_write(VtfWriter_t* writer, gsize offset, const guint8* image, gsize size)
+{
+	if (!writer->file)
+		return FALSE;
+
+	g_assert(offset + size <= writer->image_size);
+
+	if ( !vtf_fseek(writer->file,(guint64)writer->image_offset + offset) || fwrite(image,1,size,writer->file) != size )
+	{
+		fclose(writer->file);
+		writer->file = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Puts the temporary file in place of the destination in one step, so that there is always one or the other
+static gboolean vtf_replace_file(const gchar* temp_path, const gchar* path)
+{
+#ifdef _WIN32
+	// rename() won't replace an existing file on Windows, and removing it first leaves a moment with neither
+	gunichar2*	temp_path_w = g_utf8_to_utf16(temp_path,-1,NULL,NULL,NULL);
+	gunichar2*	path_w = g_utf8_to_utf16(path,-1,NULL,NULL,NULL);
+	gboolean	result = temp_path_w && path_w
+		&& MoveFileExW((LPCWSTR)temp_path_w,(LPCWSTR)path_w,MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+	g_free(temp_path_w);
+	g_free(path_w);
+	return result;
+#else
+	return g_rename(temp_path,path) == 0;
+#endif
+}
+
+static gboolean vtf_fsync(FILE* file)
+{
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+gboolean vtf_writer_read(VtfWriter_t* writer, gsize offset, guint8* image, gsize size)
+{
+	if (!writer->file)
+		return FALSE;
+
+	g_assert(offset + size <= writer->image_size);
+
+	// Switching between writing and reading needs a seek in between, which there always is
+	return vtf_fseek(writer->file,(guint64)writer->image_offset + offset) && fread(image,1,size,writer->file) == size;
+}
+
+gboolean vtf_writer_close(VtfWriter_t* writer)
+{
+	guint8		reflectivity[12];
+	gboolean	result;
+
+	if (!writer->file)
+	{
+		vtf_writer_abort(writer);
+		return FALSE;
+	}
+
+	write_f32(reflectivity,writer->reflectivity[0]);
+	write_f32(reflectivity + 4,writer->reflectivity[1]);
+	write_f32(reflectivity + 8,writer->reflectivity[2]);
+
+	// Everything must be on the disk before it replaces the old file
+	result = vtf_fseek(writer->file,32) && fwrite(reflectivity,1,12,writer->file) == 12;
+	result = result && fflush(writer->file) == 0 && vtf_fsync(writer->file);
+	result = fclose(writer->file) == 0 && result;
+	writer->file = NULL;
+
+	// If this fails the destination is untouched, so the temporary file can go
+	if ( result && !vtf_replace_file(writer->temp_path,writer->path) )
+		result = FALSE;
+
+	if (!result)
+		vtf_writer_abort(writer);
+	else
+	{
+		g_free(writer->path);
+		g_free(writer->temp_path);
+		writer->path = writer->temp_path = NULL;
+	}
+	return result;
+}
+
+void vtf_writer_abort(VtfWriter_t* writer)
+{
+	if (writer->file)
+		fclose(writer->file);
+	if (writer->temp_path)
+		g_remove(writer->temp_path);
+
+	g_free(writer->path);
+	g_free(writer->temp_path);
+	writer->file = NULL;
+	writer->path = writer->temp_path = NULL;
+}
@@ -0,0 +1,106 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_IO_H
+#define FILE_VTF_IO_H
+
+#include "VTFLib.h"
+
+#include <glib.h>
+#include <stdio.h>
+
+// Direct access to the VTF file layout (little-endian, as written by VTFLib).
+// VTFLib offers no way to hand it pre-compressed image data, so the plug-in writes VTFs itself.
+
+#define VTF_HEADER_SIZE				80	// 7.2 and later, padded to 16 bytes; the 7.3+ resource directory follows
+#define VTF_RESOURCE_ENTRY_SIZE		8
+
+#define VTF_RESOURCE_TYPE_LOWRES	0x000001
+#define VTF_RESOURCE_TYPE_IMAGE		0x000030
+#define VTF_RESOURCE_TYPE_LOD		0x444F4C	// "LOD"
+#define VTF_RESOURCE_FLAG_NO_DATA	0x02	// the entry holds its value instead of an offset
+
+typedef struct VtfFileHeader
+{
+	guint32	version[2];
+	guint32	header_size;
+	guint16	width, height;
+	guint32	flags;
+	guint16	frames, start_frame;
+	gfloat	reflectivity[3];
+	gfloat	bumpmap_scale;
+	gint32	format;
+	guint8	mip_count;
+	gint32	lowres_format;
+	guint8	lowres_width, lowres_height;
+	guint16	depth;
+	guint32	num_resources; // 7.3+
+} VtfFileHeader_t;
+
+// FALSE unless the header is one we can read, with a size and known formats
+gboolean vtf_read_header(const guint8* data, gsize size, VtfFileHeader_t* header);
+void vtf_write_header(guint8* data, const VtfFileHeader_t* header);
+
+// Reads just the header (and resource directory) of a VTF from the start of a file. Free the result with g_free().
+guint8* vtf_read_file_header(FILE* file, VtfFileHeader_t* header);
+
+// File offsets of the low-res and high-res images, from the header alone. lowres_offset is 0 if there isn't one.
+gboolean vtf_find_images(const guint8* data, const VtfFileHeader_t* header, gsize* lowres_offset, gsize* image_offset);
+
+// The value of a resource which has no data chunk. FALSE if the VTF doesn't have it.
+gboolean vtf_find_resource_value(const guint8* data, const VtfFileHeader_t* header, guint32 type, guint32* value);
+
+guint vtf_face_count(const VtfFileHeader_t* header);
+
+// Size of the high-res image data. Check that the file has room for it before trusting vtf_surface_offset().
+guint64 vtf_image_data_size(const VtfFileHeader_t* header);
+
+// Offset of one surface within the high-res image data
+gsize vtf_surface_offset(const VtfFileHeader_t* header, guint mip, guint frame, guint face, guint slice);
+
+// FALSE if the file can't be found
+gboolean vtf_file_stat(const gchar* path, gint64* size, gint64* mtime);
+
+// fseek() from the start of the file, past 2GB too (long is 32 bits on Windows)
+gboolean vtf_fseek(FILE* file, guint64 offset);
+
+// A resource which holds a value instead of data, such as VTF_RESOURCE_TYPE_LOD
+typedef struct VtfResourceValue
+{
+	guint32	type;
+	guint32	value;
+} VtfResourceValue_t;
+
+// Writes a VTF to disk without holding its image data in memory. The header, resource directory and low-res
+// image are laid out and written when it is opened, then the high-res image data can be written in any order,
+// and read back. The file is written under a unique temporary name, and only replaces the destination when it is
+// closed after everything went well, so a failed export leaves the old file alone (and it can be read while
+// writing).
+typedef struct VtfWriter
+{
+	FILE*	file;
+	gchar*	path;
+	gchar*	temp_path;	// NULL unless open
+	gsize	image_offset;
+	gsize	image_size;
+	gfloat	reflectivity[3];	// from the header; written again on closing, so it can be changed until then
+} VtfWriter_t;
+
+// The header's size and resource count are filled in here. 'lowres' is in the header's low-res format, unless
+// that is IMAGE_FORMAT_NONE. 7.2 files have no resources, so 'values' are only written to 7.3 and later.
+gboolean vtf_writer_open(VtfWriter_t* writer, const gchar* path, VtfFileHeader_t* header, const guint8* lowres,
+	const VtfResourceValue_t* values, guint num_values, gsize image_size);
+gboolean vtf_writer_write(VtfWriter_t* writer, gsize offset, const guint8* image, gsize size); // offset is within the image data
+gboolean vtf_writer_read(VtfWriter_t* writer, gsize offset, guint8* image, gsize size); // of image data already written
+gboolean vtf_writer_close(VtfWriter_t* writer); // FALSE if anything failed to reach the disk, in which case nothing is replaced
+void vtf_writer_abort(VtfWriter_t* writer);
+
+#endif
@@ -9,7 +9,569 @@
  * version.
  */
 
+#include <libgimp/gimpui.h>
+
 #include "file-vtf.h"
+#include "file-vtf-cache.h"
+#include "file-vtf-encode.h"
+#include "file-vtf-hash.h"
+#include "file-vtf-io.h"
+#include "file-vtf-pool.h"
+
+// Frames, faces and slices are decoded a batch at a time on a thread of their own, each one split into bands
+// of rows across the worker pool. This thread hands the results to GIMP in order, then recycles the buffers.
+#define LOAD_BAND_ROWS VTF_HASH_BAND_ROWS // a multiple of the DXT block size
+
+typedef struct VtfDecodeBuffer
+{
+	vlByte*		pixels;		// in the layer's own layout, with opaque alpha
+	vlByte*		alpha;		// for the layer mask, if the layer has alpha
+	guint64*	band_hashes;	// of the decoded RGBA, if the decoder is hashing
+	guint		index;		// frame, face or slice
+	gboolean	decoded;
+} VtfDecodeBuffer_t;
+
+typedef struct VtfDecoder
+{
+	vlByte**			sources;
+	VTFImageFormat		format;
+	guint				bpp;		// of the layer
+	gboolean			native;		// the format is already laid out like the layer
+	gboolean			hash;		// the blocks could be reused when exporting; see VtfOriginal_t
+	guint				width, height, bands;
+	guint				num_images, batch_size;
+	VtfDecodeBuffer_t**	batch;
+	GAsyncQueue*		full;	// decoded, in order
+	GAsyncQueue*		empty;
+} VtfDecoder_t;
+
+// Block compression is decoded natively, which is much faster than VTFLib. Everything else goes to VTFLib.
+static gboolean decode_rgba(vlByte* src, vlByte* rgba, guint width, guint height, VTFImageFormat format)
+{
+	VtfDxtFormat_t dxt_format;
+
+	switch(format)
+	{
+	case IMAGE_FORMAT_DXT1:
+		dxt_format = DXT_FORMAT_DXT1;
+		break;
+	case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+		dxt_format = DXT_FORMAT_DXT1_ONEBITALPHA;
+		break;
+	case IMAGE_FORMAT_DXT3:
+		dxt_format = DXT_FORMAT_DXT3;
+		break;
+	case IMAGE_FORMAT_DXT5:
+		dxt_format = DXT_FORMAT_DXT5;
+		break;
+	case IMAGE_FORMAT_ATI1N:
+		dxt_format = DXT_FORMAT_ATI1N;
+		break;
+	case IMAGE_FORMAT_ATI2N:
+		dxt_format = DXT_FORMAT_ATI2N;
+		break;
+	default:
+		return vlImageConvertToRGBA8888(src,rgba,width,height,format);
+	}
+
+	dxt_decompress(src,width,height,rgba,dxt_format);
+	return TRUE;
+}
+
+// Layers are only given channels that the format has: I8 is grey, IA88 grey with alpha, and formats without
+// alpha are RGB. Less to transfer to GIMP, and nothing to flatten or convert afterwards.
+static GimpImageType load_layer_type(VTFImageFormat format, guint* bpp, gboolean* native)
+{
+	*native = format == IMAGE_FORMAT_I8 || format == IMAGE_FORMAT_IA88 || format == IMAGE_FORMAT_RGB888 || format == IMAGE_FORMAT_RGBA8888;
+
+	switch(format)
+	{
+	case IMAGE_FORMAT_I8:
+		*bpp = 1;
+		return GIMP_GRAY_IMAGE;
+	case IMAGE_FORMAT_IA88:
+		*bpp = 2;
+		return GIMP_GRAYA_IMAGE;
+	}
+
+	if ( vtflib_format_has_alpha(format) )
+	{
+		*bpp = 4;
+		return GIMP_RGBA_IMAGE;
+	}
+	*bpp = 3;
+	return GIMP_RGB_IMAGE;
+}
+
+// Can be done in place
+static void pack_rgb(const vlByte* rgba, vlByte* rgb, guint num_pixels)
+{
+	guint i;
+
+	for (i = 0; i < num_pixels; i++, rgba += 4, rgb += 3)
+	{
+		rgb[0] = rgba[0];
+		rgb[1] = rgba[1];
+		rgb[2] = rgba[2];
+	}
+}
+
+// Alpha goes to its own plane for the layer mask, leaving the layer opaque
+static void split_alpha(vlByte* pixels, vlByte* alpha, guint num_pixels, guint bpp)
+{
+	guint i;
+
+	pixels += bpp - 1;
+	for (i = 0; i < num_pixels; i++, pixels += bpp)
+	{
+		alpha[i] = *pixels;
+		*pixels = 255;
+	}
+}
+
+static void decode_band(guint index, gpointer user_data)
+{
+	VtfDecoder_t*		decoder = (VtfDecoder_t*)user_data;
+	VtfDecodeBuffer_t*	buffer = decoder->batch[index / decoder->bands];
+	guint				row = (index % decoder->bands) * LOAD_BAND_ROWS;
+	guint				rows = MIN(LOAD_BAND_ROWS,decoder->height - row);
+	vlByte*				src;
+	vlByte*				dest;
+	vlByte*				rgba;
+
+	// Rows are stored one after another (or four at a time, for block compression)
+	src = decoder->sources[buffer->index] + vlImageComputeImageSize(decoder->width,row,1,1,decoder->format);
+	dest = buffer->pixels + row * decoder->width * decoder->bpp;
+
+	if (decoder->native)
+		memcpy(dest,src,rows * decoder->width * decoder->bpp);
+	else if (decoder->bpp == 4)
+	{
+		if ( !decode_rgba(src,dest,decoder->width,rows,decoder->format) )
+			buffer->decoded = FALSE;
+		else if (decoder->hash)
+			buffer->band_hashes[index % decoder->bands] = vtf_hash(dest,rows * decoder->width * 4,0);
+	}
+	else
+	{
+		rgba = g_try_new(vlByte,rows * decoder->width * 4);
+		if ( rgba && decode_rgba(src,rgba,decoder->width,rows,decoder->format) )
+		{
+			if (decoder->hash)
+				buffer->band_hashes[index % decoder->bands] = vtf_hash(rgba,rows * decoder->width * 4,0);
+			pack_rgb(rgba,dest,rows * decoder->width);
+		}
+		else
+			buffer->decoded = FALSE;
+		g_free(rgba);
+	}
+
+	if (buffer->alpha)
+		split_alpha(dest,buffer->alpha + row * decoder->width,rows * decoder->width,decoder->bpp);
+}
+
+static void decode_batch(VtfDecoder_t* decoder, guint first)
+{
+	guint i, count = MIN(decoder->batch_size,decoder->num_images - first);
+
+	for (i = 0; i < count; i++)
+	{
+		decoder->batch[i] = (VtfDecodeBuffer_t*)g_async_queue_pop(decoder->empty);
+		decoder->batch[i]->index = first + i;
+		decoder->batch[i]->decoded = TRUE;
+	}
+
+	vtf_parallel_for(count * decoder->bands,decode_band,decoder);
+
+	for (i = 0; i < count; i++)
+		g_async_queue_push(decoder->full,decoder->batch[i]);
+}
+
+static gpointer decoder_thread(gpointer data)
+{
+	VtfDecoder_t*	decoder = (VtfDecoder_t*)data;
+	guint			first;
+
+	for (first = 0; first < decoder->num_images; first += decoder->batch_size)
+		decode_batch(decoder,first);
+	return NULL;
+}
+
+static FILE* load_open(const gchar* filename)
+{
+	FILE* file;
+
+#ifdef _WIN32
+	if ( fopen_s(&file,filename,"rb") != 0 )
+		file = NULL;
+#else
+	file = fopen(filename,"rb");
+#endif
+	return file;
+}
+
+// Reads only the header and the one surface that is needed, which for a big animated texture is a tiny
+// fraction of the file
+static gboolean read_thumbnail(const gchar* filename, gint thumb_size, VtfThumbnail_t* thumb)
+{
+	FILE*				file;
+	VtfFileHeader_t		header;
+	guint8*				header_data = NULL;
+	gsize				lowres_offset, image_offset, offset, size;
+	VTFImageFormat		format;
+	vlUInt				mip_width, mip_height, mip_depth;
+	guint				mip = 0;
+	vlByte*				data = NULL;
+	vlByte*				rgbaBuf = NULL;
+	gboolean			out_of_memory = FALSE;
+	gboolean			result = FALSE;
+
+	file = load_open(filename);
+	if (file)
+		header_data = vtf_read_file_header(file,&header);
+
+	if ( header_data && vtf_find_images(header_data,&header,&lowres_offset,&image_offset) )
+	{
+		vlImageComputeMipmapDimensions(header.width,header.height,header.depth,mip,&mip_width,&mip_height,&mip_depth);
+		while ( mip_width > (vlUInt)thumb_size && mip + 1 < header.mip_count )
+			vlImageComputeMipmapDimensions(header.width,header.height,header.depth,++mip,&mip_width,&mip_height,&mip_depth);
+
+		// The low-res image is usually DXT1, and is right next to the header
+		if ( lowres_offset && header.lowres_width >= mip_width && header.lowres_height >= mip_height )
+		{
+			format = (VTFImageFormat)header.lowres_format;
+			mip_width = header.lowres_width;
+			mip_height = header.lowres_height;
+			offset = lowres_offset;
+		}
+		else
+		{
+			format = (VTFImageFormat)header.format;
+			offset = image_offset + vtf_surface_offset(&header,mip,header.frames / 2,vtf_face_count(&header) / 2,mip_depth / 2);
+		}
+
+		size = vlImageComputeImageSize(mip_width,mip_height,1,1,format);
+		data = g_try_new(vlByte,size);
+		rgbaBuf = g_try_new(vlByte,mip_width * mip_height * 4);
+		out_of_memory = !data || !rgbaBuf;
+
+		result = !out_of_memory
+			&& vtf_fseek(file,offset) && fread(data,1,size,file) == size
+			&& decode_rgba(data,rgbaBuf,mip_width,mip_height,format);
+	}
+
+	if (file)
+		fclose(file);
+
+	if (result)
+	{
+		// Alpha doesn't always represent transparency in game engine textures, so eliminate it from thumbs.
+		// This causes problems if the image is solid-colour RGB and only makes sense when viewed with alpha,
+		// but that's comparatively rare.
+		pack_rgb(rgbaBuf,rgbaBuf,mip_width*mip_height);
+
+		thumb->width = mip_width;
+		thumb->height = mip_height;
+		thumb->image_width = header.width;
+		thumb->image_height = header.height;
+		thumb->rgb = rgbaBuf;
+		rgbaBuf = NULL;
+	}
+	else if (out_of_memory)
+		record_error_mem();
+	else
+		record_error(_("#thumb_read_error"),GIMP_PDB_EXECUTION_ERROR);
+
+	g_free(header_data);
+	g_free(data);
+	g_free(rgbaBuf);
+	return result;
+}
+
+// Thumbnails are cached in the user's GIMP directory, so that browsing a folder of textures a second time
+// doesn't mean decoding them all again
+static void load_thumbnail(const gchar* filename, gint thumb_size, gint* nreturn_vals)
+{
+	VtfThumbnail_t		thumb;
+	gchar*				cache_dir;
+	gboolean			result;
+
+	gint32				layer_ID;
+	GimpDrawable*		drawable;
+	GimpPixelRgn		pixel_rgn;
+
+	memset(&thumb,0,sizeof(thumb));
+	cache_dir = g_build_filename(gimp_directory(),"file-vtf-thumbnails",NULL);
+
+	result = vtf_cache_read(cache_dir,filename,thumb_size,&thumb);
+	if ( !result && (result = read_thumbnail(filename,thumb_size,&thumb)) )
+		vtf_cache_write(cache_dir,filename,thumb_size,&thumb);
+
+	if (result)
+	{
+		image_ID = gimp_image_new(thumb.width,thumb.height,GIMP_RGB);
+
+		layer_ID = gimp_layer_new(image_ID,"VTF Thumb",thumb.width,thumb.height,GIMP_RGB_IMAGE,100,GIMP_NORMAL_MODE);
+		drawable = gimp_drawable_get(layer_ID);
+
+		gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, thumb.width, thumb.height, TRUE, FALSE);
+		gimp_pixel_rgn_set_rect(&pixel_rgn, thumb.rgb, 0,0, thumb.width,thumb.height);
+			
+		gimp_drawable_update(layer_ID, 0, 0, thumb.width, thumb.height);
+		gimp_image_insert_layer(image_ID,layer_ID,0,0);
+		gimp_drawable_detach(drawable);
+
+		*nreturn_vals = 2;
+		vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+			
+		vtf_ret_values[1].type			= GIMP_PDB_IMAGE;
+		vtf_ret_values[1].data.d_image	= image_ID;
+			
+		vtf_ret_values[2].type = GIMP_PDB_INT32;
+		vtf_ret_values[2].data.d_int32 = thumb.image_width;
+
+		vtf_ret_values[3].type = GIMP_PDB_INT32;
+		vtf_ret_values[3].data.d_int32 = thumb.image_height;
+	}
+
+	g_free(thumb.rgb);
+	g_free(cache_dir);
+}
+
+// Just the header and resource directory, for scripts which want to know about a VTF without loading it
+void get_info(gint nparams, const GimpParam* param, gint* nreturn_vals)
+{
+	FILE*				file;
+	VtfFileHeader_t		header;
+	guint8*				header_data = NULL;
+	guint32				lod = 0;
+	gint				i;
+
+	file = load_open(param[0].data.d_string);
+	if (file)
+	{
+		header_data = vtf_read_file_header(file,&header);
+		fclose(file);
+	}
+
+	if (!header_data)
+	{
+		g_free(header_data);
+		record_error(_("#invalid_vtf_error"),GIMP_PDB_EXECUTION_ERROR);
+		return;
+	}
+
+	vtf_find_resource_value(header_data,&header,VTF_RESOURCE_TYPE_LOD,&lod);
+
+	for (i = 1; i < 14; i++)
+		vtf_ret_values[i].type = GIMP_PDB_INT32;
+
+	vtf_ret_values[1].data.d_int32	= header.version[0];
+	vtf_ret_values[2].data.d_int32	= header.version[1];
+	vtf_ret_values[3].data.d_int32	= header.width;
+	vtf_ret_values[4].data.d_int32	= header.height;
+	vtf_ret_values[5].data.d_int32	= MAX(1,header.depth);
+	vtf_ret_values[6].data.d_int32	= MAX(1,header.frames);
+	vtf_ret_values[7].data.d_int32	= vtf_face_count(&header);
+	vtf_ret_values[8].data.d_int32	= header.mip_count;
+	vtf_ret_values[9].data.d_int32	= header.format;
+	vtf_ret_values[10].type			= GIMP_PDB_STRING;
+	vtf_ret_values[10].data.d_string = (gchar*)vlImageGetImageFormatInfo((VTFImageFormat)header.format)->lpName;
+	vtf_ret_values[11].data.d_int32	= header.flags;
+	vtf_ret_values[12].data.d_int32	= lod & 0xFF;
+	vtf_ret_values[13].data.d_int32	= (lod >> 8) & 0xFF;
+
+	vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+	*nreturn_vals = 14;
+
+	g_free(header_data);
+}
+
+// Block compressed formats which can be exported, and so can have their blocks copied back out unchanged
+static gboolean load_reusable_format(VTFImageFormat format)
+{
+	return format == IMAGE_FORMAT_DXT1 || format == IMAGE_FORMAT_DXT1_ONEBITALPHA || format == IMAGE_FORMAT_DXT3 || format == IMAGE_FORMAT_DXT5;
+}
+
+static void load_attach_original(const gchar* filename, const VtfOriginalSurface_t* surfaces, guint count)
+{
+	VtfOriginal_t	original;
+	GimpParasite*	parasite;
+	guint8*			data;
+	gsize			path_size = strlen(filename) + 1;
+	gsize			size = sizeof(VtfOriginal_t) + count * sizeof(VtfOriginalSurface_t) + path_size;
+
+	original.version = VTF_ORIGINAL_VERSION;
+	original.num_surfaces = count;
+	if ( !vtf_file_stat(filename,&original.file_size,&original.file_mtime) )
+		return;
+
+	data = g_try_new(guint8,size);
+	if (!data)
+		return; // only an optimisation
+
+	memcpy(data,&original,sizeof(VtfOriginal_t));
+	memcpy(data + sizeof(VtfOriginal_t),surfaces,count * sizeof(VtfOriginalSurface_t));
+	memcpy(data + size - path_size,filename,path_size);
+
+	parasite = gimp_parasite_new(VTF_ORIGINAL_PARASITE,GIMP_PARASITE_PERSISTENT,(guint32)size,data);
+	gimp_image_attach_parasite(image_ID,parasite);
+	gimp_parasite_free(parasite);
+	g_free(data);
+}
+
+// Which surfaces to import. Nothing else is read from the file.
+typedef struct VtfLoadOptions
+{
+	gint32		FirstLayer;	// frame or slice
+	gint32		LayerCount;	// 0 for all from FirstLayer on
+	guint32		Faces;		// bitmask of cube map faces, 0 for all of them
+	gint32		MipLevel;	// 0 for full size
+} VtfLoadOptions_t;
+
+static const VtfLoadOptions_t DefaultLoadOptions = { 0, 0, 0, 0 };
+
+// Only shown for VTFs with more than one frame, face or slice
+static gboolean show_load_options(const VtfFileHeader_t* header, guint num_faces, VtfLoadOptions_t* opt)
+{
+	GtkWidget*	dialog;
+	GtkWidget*	table;
+	GtkWidget*	hbox;
+	GtkWidget*	first = NULL;
+	GtkWidget*	last = NULL;
+	GtkWidget*	faces[7];
+	GtkWidget*	mip;
+	GtkObject*	adj;
+	guint		num_layers = MAX(header->frames,header->depth);
+	guint		row = 0, i;
+	gboolean	run;
+
+	gimp_ui_init(PLUG_IN_BINARY, FALSE);
+
+	dialog = gimp_dialog_new(_("#load_window_title"), PLUG_IN_BINARY, NULL, (GtkDialogFlags)0,
+								HELP_FUNC,			"file-vtf",
+								GTK_STOCK_CANCEL,	GTK_RESPONSE_CANCEL,
+								GTK_STOCK_OK,		GTK_RESPONSE_OK,
+								NULL);
+
+	gtk_window_set_resizable(GTK_WINDOW(dialog),FALSE);
+	gtk_window_set_position(GTK_WINDOW(dialog),GTK_WIN_POS_CENTER);
+
+	table = gtk_table_new(3,2,FALSE);
+	gtk_table_set_row_spacings(GTK_TABLE(table),6);
+	gtk_table_set_col_spacings(GTK_TABLE(table),6);
+	gtk_container_set_border_width(GTK_CONTAINER(table),12);
+	gtk_container_add(GTK_CONTAINER(GTK_DIALOG(dialog)->vbox),table);
+	gtk_widget_show(table);
+
+	// Frames or slices
+	if (num_layers > 1)
+	{
+		hbox = gtk_hbox_new(FALSE,6);
+
+		first = gimp_spin_button_new(&adj,opt->FirstLayer + 1,1,num_layers,1,10,0,1,0);
+		gtk_box_pack_start(GTK_BOX(hbox),first,FALSE,FALSE,0);
+		gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new(_("#load_range_to")),FALSE,FALSE,0);
+		last = gimp_spin_button_new(&adj,opt->LayerCount <= 0 ? num_layers : MIN(opt->FirstLayer + opt->LayerCount,(gint)num_layers),1,num_layers,1,10,0,1,0);
+		gtk_box_pack_start(GTK_BOX(hbox),last,FALSE,FALSE,0);
+
+		gtk_widget_show_all(hbox);
+		gimp_table_attach_aligned(GTK_TABLE(table),0,row++,header->frames > 1 ? _("#load_frames_label") : _("#load_slices_label"),0,0.5,hbox,1,TRUE);
+	}
+
+	// Cube map faces, numbered like the layers they become
+	if (num_faces > 1)
+	{
+		hbox = gtk_hbox_new(FALSE,3);
+
+		for (i = 0; i < num_faces; i++)
+		{
+			gchar label[4];
+			g_snprintf(label,sizeof(label),"%u",i + 1);
+			faces[i] = gtk_check_button_new_with_label(label);
+			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(faces[i]),!opt->Faces || opt->Faces & (1 << i));
+			gtk_box_pack_start(GTK_BOX(hbox),faces[i],FALSE,FALSE,0);
+		}
+
+		gtk_widget_show_all(hbox);
+		gimp_table_attach_aligned(GTK_TABLE(table),0,row++,_("#load_faces_label"),0,0.5,hbox,1,TRUE);
+	}
+
+	// Resolution
+	mip = gtk_combo_box_new_text();
+	for (i = 0; i < MAX(header->mip_count,1); i++)
+	{
+		vlUInt	w,h,d;
+		gchar*	label;
+
+		vlImageComputeMipmapDimensions(header->width,header->height,header->depth,i,&w,&h,&d);
+		label = g_strdup_printf("%ux%u",w,h);
+		gtk_combo_box_append_text(GTK_COMBO_BOX(mip),label);
+		g_free(label);
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(mip),opt->MipLevel);
+	gtk_widget_set_sensitive(mip,header->mip_count > 1);
+	gtk_widget_show(mip);
+	gimp_table_attach_aligned(GTK_TABLE(table),0,row++,_("#load_mip_label"),0,0.5,mip,1,TRUE);
+
+	gtk_widget_show(dialog);
+
+	run = gimp_dialog_run(GIMP_DIALOG(dialog)) == GTK_RESPONSE_OK;
+
+	if (run)
+	{
+		if (first)
+		{
+			opt->FirstLayer = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(first)) - 1;
+			opt->LayerCount = MAX(gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(last)) - opt->FirstLayer,1);
+		}
+		if (num_faces > 1)
+		{
+			opt->Faces = 0;
+			for (i = 0; i < num_faces; i++)
+				if ( gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(faces[i])) )
+					opt->Faces |= 1 << i;
+		}
+		opt->MipLevel = gtk_combo_box_get_active(GTK_COMBO_BOX(mip));
+	}
+
+	gtk_widget_destroy(dialog);
+
+	return run;
+}
+
+// The file is mapped rather than read, so only the pages holding the surfaces that are imported are ever
+// touched, and a file that was opened recently comes straight from the OS cache.
+static GMappedFile* load_map(const gchar* filename, VtfFileHeader_t* header, gsize* image_offset)
+{
+	GMappedFile*	file;
+	GError*			error = NULL;
+	const guint8*	data;
+	gsize			size, lowres_offset;
+
+	file = g_mapped_file_new(filename,FALSE,&error);
+	if (!file)
+	{
+		record_error(error->message,GIMP_PDB_EXECUTION_ERROR); // not freed: it is returned to GIMP
+		return NULL;
+	}
+
+	data = (const guint8*)g_mapped_file_get_contents(file);
+	size = g_mapped_file_get_length(file);
+
+	if ( data && vtf_read_header(data,size,header) && vtf_find_images(data,header,&lowres_offset,image_offset) )
+	{
+		// Every surface must be inside the mapping. 64-bit, so that a damaged header can't wrap around.
+		header->frames = MAX(1,header->frames);
+		header->depth = MAX(1,header->depth);
+		if ( (guint64)*image_offset + vtf_image_data_size(header) <= size )
+			return file;
+	}
+
+	record_error(_("#invalid_vtf_error"),GIMP_PDB_EXECUTION_ERROR);
+	g_mapped_file_unref(file);
+	return NULL;
+}
 
 void load(gint nparams, const GimpParam* param, gint* nreturn_vals, gboolean thumb)
 {
@@ -18,271 +580,335 @@ void load(gint nparams, const GimpParam* param, gint* nreturn_vals, gboolean thu
 	GimpPixelRgn	pixel_rgn;
 
 	gchar*			filename;
-	guint			width,height;
-
-	vlByte*			rgbaBuf;
+	vlUInt			width,height;
+	GMappedFile*	file;
+	VtfFileHeader_t	header;
+	gsize			image_offset;
+	VtfLoadOptions_t	load_opt = DefaultLoadOptions;
 
 	// ---------------
 	if (thumb)
-		filename = param[0].data.d_string;
-	else
-		filename = param[1].data.d_string;
+	{
+		load_thumbnail(param[0].data.d_string,param[1].data.d_int32,nreturn_vals);
+		return;
+	}
+
+	run_mode = (GimpRunMode)param[0].data.d_int32;
+	filename = param[1].data.d_string;
+
+	// The dialog starts from the defaults, since GIMP's own open dialog passes 0 for everything
+	if (nparams > 6 && run_mode != GIMP_RUN_INTERACTIVE)
+	{
+		load_opt.FirstLayer = param[3].data.d_int32;
+		load_opt.LayerCount = param[4].data.d_int32;
+		load_opt.Faces = (guint32)param[5].data.d_int32;
+		load_opt.MipLevel = param[6].data.d_int32;
+	}
 	
-	if ( vlImageLoad(filename,vlFalse) )
+	file = load_map(filename,&header,&image_offset);
+	if (file)
 	{
-		width = vlImageGetWidth();
-		height = vlImageGetHeight();
-			
-		if (thumb)
+		const guint8*	data = (const guint8*)g_mapped_file_get_contents(file);
+		guint			num_faces = vtf_face_count(&header);
+		guint			frame,face,slice,num_layers;
+		guint			mip, first_layer, last_layer, faces;
+		vlUInt			depth;
+		gboolean		single = FALSE;
+		gchar*			layer_label;
+		gchar			layer_name_buf[32];
+
+		VtfDecoder_t		decoder;
+		VtfDecodeBuffer_t*	buffers;
+		vlByte**			sources;
+		VtfOriginalSurface_t*	surfaces;	// where each layer comes from, then the hashes of those which were
+		guint					num_hashed = 0;	// decoded from blocks, in the same order
+		guint				num_buffers, i;
+		GThread*			decoder_ID = NULL;
+		GimpImageType		layer_type;
+		gboolean			has_alpha;
+
+		if ( run_mode == GIMP_RUN_INTERACTIVE && header.frames * num_faces * header.depth > 1 && !show_load_options(&header,num_faces,&load_opt) )
 		{
-			gint32	thumb_size;
-			guint	thumb_mip = 0;
-
-			gint32 mip_width = width;
-			gint32 mip_height = height;
-
-			vlByte*	mip_data;
-				
-			thumb_size = param[1].data.d_int32;
-				
-			while  (mip_width > thumb_size
-					&& thumb_mip < vlImageGetMipmapCount() - 1 )
-			{
-				thumb_mip++;
-				mip_width /= 2;
-				mip_height /= 2;
-			}
+			vtf_ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+			g_mapped_file_unref(file);
+			return;
+		}
 
-			rgbaBuf = g_new(vlByte, mip_height*mip_width*4 );
-			if (!rgbaBuf)
-			{
-				record_error_mem();
-				return;
-			}
-				
-			mip_data = vlImageGetData( (vlUInt)floor(vlImageGetFrameCount()/2.0f), (vlUInt)floor(vlImageGetFaceCount()/2.0f), (vlUInt)floor(vlImageGetDepth()/2.0f), thumb_mip );
-				
-			if ( vlImageConvertToRGBA8888( mip_data,rgbaBuf,mip_width,mip_height,vlImageGetFormat() ) )
-			{
-				image_ID = gimp_image_new(mip_width,mip_height,GIMP_RGB);
-					
-				layer_ID = gimp_layer_new(image_ID,"VTF Thumb",mip_width,mip_height,GIMP_RGB_IMAGE,100,GIMP_NORMAL_MODE);
-				gimp_layer_add_alpha(layer_ID);
-				drawable = gimp_drawable_get(layer_ID);
-
-				gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, mip_width, mip_height, TRUE, FALSE);
-				gimp_pixel_rgn_set_rect(&pixel_rgn, rgbaBuf, 0,0, mip_width,mip_height);
-					
-				gimp_drawable_update(layer_ID, 0, 0, mip_width, mip_height);
-				gimp_image_insert_layer(image_ID,layer_ID,0,0);
-				gimp_drawable_detach(drawable);
-					
-				// Alpha doesn't always represent transparency in game engine textures, so eliminate it from thumbs.
-				// This causes problems if the image is solid-colour RGB and only makes sense when viewed with alpha,
-				// but that's comparatively rare.
-				gimp_layer_add_mask(layer_ID, gimp_layer_create_mask(layer_ID,GIMP_ADD_ALPHA_TRANSFER_MASK) );
-				gimp_layer_remove_mask( layer_ID, GIMP_MASK_DISCARD );
-
-				*nreturn_vals = 2;
-				vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
-					
-				// value 1 (the image) is set at the end of the function
-					
-				vtf_ret_values[2].type = GIMP_PDB_INT32;
-				vtf_ret_values[2].data.d_int32 = width;
-
-				vtf_ret_values[3].type = GIMP_PDB_INT32;
-				vtf_ret_values[3].data.d_int32 = height;
-			}
+		mip = MIN((guint)MAX(load_opt.MipLevel,0),MAX(header.mip_count,1) - 1u);
+		vlImageComputeMipmapDimensions(header.width,header.height,header.depth,mip,&width,&height,&depth);
+
+		// Frames or slices, whichever there are
+		num_layers = header.frames > 1 ? header.frames : depth;
+		first_layer = MIN((guint)MAX(load_opt.FirstLayer,0),num_layers - 1);
+		last_layer = load_opt.LayerCount <= 0 ? num_layers - 1 : MIN(first_layer + (guint)load_opt.LayerCount,num_layers) - 1;
+		faces = load_opt.Faces & ((1u << num_faces) - 1);
+		if (!faces)
+			faces = (1u << num_faces) - 1;
+
+		memset(&decoder,0,sizeof(VtfDecoder_t));
+		decoder.format = (VTFImageFormat)header.format;
+		layer_type = load_layer_type(decoder.format,&decoder.bpp,&decoder.native);
+		has_alpha = layer_type == GIMP_RGBA_IMAGE || layer_type == GIMP_GRAYA_IMAGE;
+
+		sources = g_try_new(vlByte*,(gsize)header.frames * num_faces * depth);
+		surfaces = g_try_new(VtfOriginalSurface_t,(gsize)header.frames * num_faces * depth);
+		if (!sources || !surfaces)
+		{
+			record_error_mem();
+			g_free(sources);
+			g_free(surfaces);
+			g_mapped_file_unref(file);
+			return;
 		}
-		else // regular image load
+
+		// Only the surfaces that were asked for
+		i = 0;
+		for (frame=0;frame<header.frames;frame++)
+			for (face=0;face<num_faces;face++)
+				for (slice=0;slice<depth;slice++)
+				{
+					guint layer = header.frames > 1 ? frame : slice;
+					if ( layer < first_layer || layer > last_layer || !(faces & (1 << face)) )
+						continue;
+					surfaces[i].frame = frame;
+					surfaces[i].face = face;
+					surfaces[i].slice = slice;
+					sources[i++] = (vlByte*)data + image_offset + vtf_surface_offset(&header,mip,frame,face,slice);
+				}
+		num_layers = i;
+
+		image_ID = gimp_image_new(width,height,decoder.bpp < 3 ? GIMP_GRAY : GIMP_RGB);
+		gimp_image_set_filename(image_ID,filename);
+
+		if ( header.frames > 1)
+			layer_label = _("#anim_frame_word");
+		else if ( num_faces > 1 )
+			layer_label = _("#face_word");
+		else if ( depth > 1 )
+			layer_label = _("#slice_word");
+		else
+			single = TRUE;
+
+		if (single)
+			gimp_progress_init(_("#load_message_single"));
+		else
+			gimp_progress_init_printf(_("#load_message_multi"),num_layers,layer_label);
+
+		// Two batches in the ring, so that one is decoded while GIMP takes the other
+		decoder.sources = sources;
+		decoder.width = width;
+		decoder.height = height;
+		decoder.bands = (height + LOAD_BAND_ROWS - 1) / LOAD_BAND_ROWS;
+		decoder.num_images = num_layers;
+		decoder.hash = mip == 0 && load_reusable_format(decoder.format);
+		num_buffers = MIN(vtf_get_num_threads() * 2,num_layers);
+		decoder.batch_size = MAX(num_buffers / 2,1);
+		decoder.batch = g_try_new(VtfDecodeBuffer_t*,decoder.batch_size);
+		decoder.full = g_async_queue_new();
+		decoder.empty = g_async_queue_new();
+
+		buffers = g_try_new0(VtfDecodeBuffer_t,num_buffers);
+		for (i = 0; buffers && i < num_buffers; i++)
 		{
-			guint			frame,face,slice,num_layers;
-			gboolean		single = FALSE;
-			gchar*			layer_label;
-			gchar			layer_name_buf[32];
+			buffers[i].pixels = g_try_new(vlByte,width * height * decoder.bpp);
+			if (has_alpha)
+				buffers[i].alpha = g_try_new(vlByte,width * height);
+			if (decoder.hash)
+				buffers[i].band_hashes = g_try_new(guint64,decoder.bands);
+			if (!buffers[i].pixels || (has_alpha && !buffers[i].alpha) || (decoder.hash && !buffers[i].band_hashes))
+				break;
+			g_async_queue_push(decoder.empty,&buffers[i]);
+		}
 
-			image_ID = gimp_image_new(width,height,GIMP_RGB);
-			gimp_image_set_filename(image_ID,filename);
-		
-			rgbaBuf = g_new(vlByte, vlImageGetWidth()*vlImageGetHeight()*4 );
-			if (!rgbaBuf)
-			{
-				record_error_mem();
-				return;
-			}
+		if (decoder.batch && buffers && i == num_buffers)
+		{
+			if (num_buffers > decoder.batch_size)
+				decoder_ID = vtf_thread_new(decoder_thread,&decoder);
 
-			if ( vlImageGetFrameCount() > 1)
-				layer_label = _("#anim_frame_word");
-			else if ( vlImageGetFaceCount() > 1 )
-				layer_label = _("#face_word");
-			else if ( vlImageGetDepth() > 1 )
-				layer_label = _("#slice_word");
-			else
-				single = TRUE;
+			for (i = 0; i < num_layers; i++)
+			{
+				VtfDecodeBuffer_t* buffer;
 
-			num_layers = vlImageGetFrameCount() + vlImageGetFaceCount() + vlImageGetDepth() -2; // only one will be valid
+				if (!decoder_ID && i % decoder.batch_size == 0)
+					decode_batch(&decoder,i);
 
-			if (single)
-				gimp_progress_init(_("#load_message_single"));
-			else
-				gimp_progress_init_printf(_("#load_message_multi"),num_layers,layer_label);
-
-			// only one of these loops will actually run more than once
-			for (frame=0;frame<vlImageGetFrameCount();frame++)
-				for (face=0;face<vlImageGetFaceCount();face++)
-					for (slice=0;slice<vlImageGetDepth();slice++)
-						if ( vlImageConvertToRGBA8888( vlImageGetData(frame,face,slice,0),rgbaBuf,width,height,vlImageGetFormat() ) )
-						{
-							if ( single )
-							{
-								textdomain(""); // reset to GIMP default to get the localised name
+				buffer = (VtfDecodeBuffer_t*)g_async_queue_pop(decoder.full);
+				if (buffer->decoded)
+				{
+					if ( single )
+					{
+						textdomain(""); // reset to GIMP default to get the localised name
 #if _MSC_VER
-								strcpy_s(layer_name_buf, _countof(layer_name_buf), _("Background"));
+						strcpy_s(layer_name_buf, _countof(layer_name_buf), _("Background"));
 #else
-								strncpy(layer_name_buf, _("Background"), sizeof(layer_name_buf));
-								layer_name_buf[31] = 0;
+						strncpy(layer_name_buf, _("Background"), sizeof(layer_name_buf));
+						layer_name_buf[31] = 0;
 #endif
-								textdomain(TEXT_DOMAIN);
-							}
-							else
-								snprintf(layer_name_buf,sizeof(layer_name_buf),"%s #%i",layer_label,frame+face+slice + 1);
-
-							layer_ID = gimp_layer_new(image_ID,layer_name_buf,width,height,GIMP_RGB_IMAGE,100,GIMP_NORMAL_MODE);
-							gimp_layer_add_alpha(layer_ID);
-							drawable = gimp_drawable_get(layer_ID);
-
-							gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, width, height, TRUE, FALSE);
-							gimp_pixel_rgn_set_rect(&pixel_rgn, rgbaBuf, 0,0, width,height);
-
-							if ( vtflib_format_has_alpha(vlImageGetFormat()) )
-							{
-								// Alpha doesn't always represent transparency, so separate it out. When it *is* transparency,
-								// separation is still good because it reveals the colour of invisible pixels (which can bleed
-								// onto visible ones when the texture is being resized in realtime on the GPU, creating ugly outlines).
-								gimp_layer_add_mask(layer_ID, gimp_layer_create_mask(layer_ID,GIMP_ADD_ALPHA_TRANSFER_MASK) );
-								gimp_layer_set_edit_mask(layer_ID,FALSE);
-							}
-							else
-								gimp_layer_flatten(layer_ID);
-
-							gimp_drawable_update(layer_ID, 0, 0, width, height);
-							gimp_image_insert_layer(image_ID,layer_ID,0,0);
-							gimp_drawable_detach(drawable);
-											
-							vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
-							*nreturn_vals = 2;
-
-							gimp_progress_update( (gdouble) (frame+face+slice) / (gdouble) num_layers );
-						}
-			{
-				// Generate image settings
-				VtfSaveOptions_t	gimpVtfOpt;
-				VTFImageFormat	format;
-				guint i;
+						textdomain(TEXT_DOMAIN);
+					}
+					else
+						snprintf(layer_name_buf,sizeof(layer_name_buf),"%s #%i",layer_label,surfaces[i].frame + surfaces[i].face + surfaces[i].slice + 1); // only one will be valid
 
-				gimpVtfOpt = DefaultSaveOptions;
-			
-				// Version
-				gimpVtfOpt.Version = vlImageGetMinorVersion();
-
-				// Format
-				format = vlImageGetFormat();
-
-				switch(format)
-				{			
-				case IMAGE_FORMAT_RGBA8888:
-				case IMAGE_FORMAT_BGRA8888:
-				case IMAGE_FORMAT_ABGR8888:
-				case IMAGE_FORMAT_ARGB8888:
-					gimpVtfOpt.WithAlpha = TRUE;
-				case IMAGE_FORMAT_RGB888:
-				case IMAGE_FORMAT_BGR888:
-					gimpVtfOpt.Compress = FALSE;
-					break;
-				case IMAGE_FORMAT_DXT5:
-					gimpVtfOpt.WithAlpha = TRUE;
-				case IMAGE_FORMAT_DXT1:
-					gimpVtfOpt.Compress = TRUE;
-					break;
-				case IMAGE_FORMAT_IA88:
-					gimpVtfOpt.WithAlpha = TRUE;
-				case IMAGE_FORMAT_I8:
-					gimpVtfOpt.Compress = FALSE;
-					gimp_image_convert_grayscale(image_ID);
-					break;
-				default:
-					gimpVtfOpt.AdvancedSetup = TRUE;
-					for (i=0; i < num_vtf_formats; i++)
+					layer_ID = gimp_layer_new(image_ID,layer_name_buf,width,height,layer_type,100,GIMP_NORMAL_MODE);
+					drawable = gimp_drawable_get(layer_ID);
+
+					gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, width, height, TRUE, FALSE);
+					gimp_pixel_rgn_set_rect(&pixel_rgn, buffer->pixels, 0,0, width,height);
+
+					if ( has_alpha )
 					{
-						if (vtf_formats[i].vlFormat == format)
-						{
-							gimpVtfOpt.PixelFormat = i;
-							gimpVtfOpt.WithAlpha = vtf_format_has_alpha(i);
-							gimpVtfOpt.Compress = vtf_format_is_compressed(i);
-							break;
-						}
+						// Alpha doesn't always represent transparency, so separate it out. When it *is* transparency,
+						// separation is still good because it reveals the colour of invisible pixels (which can bleed
+						// onto visible ones when the texture is being resized in realtime on the GPU, creating ugly outlines).
+						// The decoder has already split it from the colour, so it goes straight into the mask.
+						gint32			mask_ID = gimp_layer_create_mask(layer_ID,GIMP_ADD_WHITE_MASK);
+						GimpDrawable*	mask = gimp_drawable_get(mask_ID);
+
+						gimp_layer_add_mask(layer_ID,mask_ID);
+						gimp_pixel_rgn_init(&pixel_rgn, mask, 0, 0, width, height, TRUE, FALSE);
+						gimp_pixel_rgn_set_rect(&pixel_rgn, buffer->alpha, 0,0, width,height);
+						gimp_drawable_detach(mask);
+						gimp_layer_set_edit_mask(layer_ID,FALSE);
 					}
-				}
 
-				if (gimpVtfOpt.Compress)
-				{
-					// Passing to the console is crap because it is not visible by default, but until there is a
-					// way to specify that you want a GUI message to appear without requiring user interaction
-					// is the only sensible choice.
-					gimp_message_set_handler(GIMP_CONSOLE);
-					gimp_message(_("#opening_dxt_warning"));
-					gimp_message_set_handler(GIMP_MESSAGE_BOX);
+					gimp_drawable_update(layer_ID, 0, 0, width, height);
+					gimp_image_insert_layer(image_ID,layer_ID,0,0);
+					gimp_drawable_detach(drawable);
+									
+					vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+					*nreturn_vals = 2;
+
+					gimp_progress_update( (gdouble) i / (gdouble) num_layers );
+
+					if (decoder.hash)
+					{
+						surfaces[num_hashed] = surfaces[i];
+						surfaces[num_hashed++].hash = vtf_hash_bands(buffer->band_hashes,decoder.bands);
+					}
 				}
+				g_async_queue_push(decoder.empty,buffer);
+			}
 
-				// Flags
-				gimpVtfOpt.GeneralFlags = vlImageGetFlags();
+			if (decoder_ID)
+				g_thread_join(decoder_ID);
 
-				gimpVtfOpt.Clamp = gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_CLAMPS && gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_CLAMPT;
-				gimpVtfOpt.NoLOD = gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NOLOD;
-				gimpVtfOpt.WithMips = !(gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NOMIP);
+			if (num_hashed)
+				load_attach_original(filename,surfaces,num_hashed);
+		}
+		else
+			record_error_mem();
 
-				if ( vlImageGetFrameCount() > 1 )
-					gimpVtfOpt.LayerUse = VTF_ANIMATION;
-				else if ( vlImageGetFaceCount() == 6 )
-					gimpVtfOpt.LayerUse = VTF_ENVMAP;
-				else if ( vlImageGetDepth() > 1 )
-					gimpVtfOpt.LayerUse = VTF_VOLUME;
-				else
-					gimpVtfOpt.LayerUse = VTF_MERGE_VISIBLE;
+		for (i = 0; buffers && i < num_buffers; i++)
+		{
+			g_free(buffers[i].pixels);
+			g_free(buffers[i].alpha);
+			g_free(buffers[i].band_hashes);
+		}
+		g_free(buffers);
+		g_free(decoder.batch);
+		g_free(sources);
+		g_free(surfaces);
+		g_async_queue_unref(decoder.full);
+		g_async_queue_unref(decoder.empty);
 
-				if (gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NORMAL)
-					gimpVtfOpt.BumpType = BUMP;
-				else if (gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_SSBUMP)
-					gimpVtfOpt.BumpType = SSBUMP;
+		{
+			// Generate image settings
+			VtfSaveOptions_t	gimpVtfOpt;
+			VTFImageFormat	format;
+			guint i;
 
-				if ( vlImageGetSupportsResources() )
+			gimpVtfOpt = DefaultSaveOptions;
+		
+			// Version
+			gimpVtfOpt.Version = header.version[1];
+
+			// Format
+			format = (VTFImageFormat)header.format;
+
+			switch(format)
+			{			
+			case IMAGE_FORMAT_RGBA8888:
+			case IMAGE_FORMAT_BGRA8888:
+			case IMAGE_FORMAT_ABGR8888:
+			case IMAGE_FORMAT_ARGB8888:
+				gimpVtfOpt.WithAlpha = TRUE;
+			case IMAGE_FORMAT_RGB888:
+			case IMAGE_FORMAT_BGR888:
+				gimpVtfOpt.Compress = FALSE;
+				break;
+			case IMAGE_FORMAT_DXT5:
+				gimpVtfOpt.WithAlpha = TRUE;
+			case IMAGE_FORMAT_DXT1:
+				gimpVtfOpt.Compress = TRUE;
+				break;
+			case IMAGE_FORMAT_IA88:
+				gimpVtfOpt.WithAlpha = TRUE;
+			case IMAGE_FORMAT_I8:
+				gimpVtfOpt.Compress = FALSE;
+				break;
+			default:
+				gimpVtfOpt.AdvancedSetup = TRUE;
+				for (i=0; i < num_vtf_formats; i++)
 				{
-					if ( vlImageGetHasResource(VTF_RSRC_TEXTURE_LOD_SETTINGS) )
+					if (vtf_formats[i].vlFormat == format)
 					{
-						vlUInt size;
-						vlVoid* data = vlImageGetResourceData(VTF_RSRC_TEXTURE_LOD_SETTINGS,&size);
-						if (size > 2)
-						{
-							gimpVtfOpt.LodControlU = *(gchar*)data;
-							gimpVtfOpt.LodControlV = *((gchar*)data + 1);
-						}
+						gimpVtfOpt.PixelFormat = i;
+						gimpVtfOpt.WithAlpha = vtf_format_has_alpha(i);
+						gimpVtfOpt.Compress = vtf_format_is_compressed(i);
+						break;
 					}
 				}
+			}
 
-				// Store
-				gimp_set_data (vtf_get_data_id(FALSE), &gimpVtfOpt, sizeof (VtfSaveOptions_t));
+			if (gimpVtfOpt.Compress)
+			{
+				// Passing to the console is crap because it is not visible by default, but until there is a
+				// way to specify that you want a GUI message to appear without requiring user interaction
+				// is the only sensible choice.
+				gimp_message_set_handler(GIMP_CONSOLE);
+				gimp_message(_("#opening_dxt_warning"));
+				gimp_message_set_handler(GIMP_MESSAGE_BOX);
 			}
+
+			// Flags
+			gimpVtfOpt.GeneralFlags = header.flags;
+
+			gimpVtfOpt.Clamp = gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_CLAMPS && gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_CLAMPT;
+			gimpVtfOpt.NoLOD = gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NOLOD;
+			gimpVtfOpt.WithMips = !(gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NOMIP);
+
+			if ( header.frames > 1 )
+				gimpVtfOpt.LayerUse = VTF_ANIMATION;
+			else if ( num_faces == 6 )
+				gimpVtfOpt.LayerUse = VTF_ENVMAP;
+			else if ( header.depth > 1 )
+				gimpVtfOpt.LayerUse = VTF_VOLUME;
+			else
+				gimpVtfOpt.LayerUse = VTF_MERGE_VISIBLE;
+
+			if (gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_NORMAL)
+				gimpVtfOpt.BumpType = BUMP;
+			else if (gimpVtfOpt.GeneralFlags & TEXTUREFLAGS_SSBUMP)
+				gimpVtfOpt.BumpType = SSBUMP;
+
+			{
+				guint32 lod;
+				if ( vtf_find_resource_value(data,&header,VTF_RESOURCE_TYPE_LOD,&lod) )
+				{
+					gimpVtfOpt.LodControlU = (gchar)(lod & 0xFF);
+					gimpVtfOpt.LodControlV = (gchar)((lod >> 8) & 0xFF);
+				}
+			}
+
+			// Store
+			gimp_set_data (vtf_get_data_id(FALSE), &gimpVtfOpt, sizeof (VtfSaveOptions_t));
 		}
 
-		g_free(rgbaBuf);		
+		g_mapped_file_unref(file);
 	}
 	
 	if (vtf_ret_values[0].data.d_status == GIMP_PDB_EXECUTION_ERROR)
-	{
-		vtf_ret_values[1].type          = GIMP_PDB_STRING;
-		vtf_ret_values[1].data.d_string = (gchar*)vlGetLastError();
-	}
+		record_error((gchar*)vlGetLastError(),GIMP_PDB_EXECUTION_ERROR); // if nothing more specific was
 	else
 	{
 		vtf_ret_values[1].type			= GIMP_PDB_IMAGE;
@@ -0,0 +1,468 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-mip.h"
+#include "file-vtf-pool.h"
+#include "file-vtf-simd.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MIP_PI			3.14159265358979f
+#define MIP_MAX_TAPS	12
+#define MIP_RING_SIZE	16	// horizontally filtered source rows kept around for the vertical pass
+#define MIP_BAND_ROWS	64
+#define MIP_TOKSVIG_POWER	16.0f	// specular exponent assumed when fading normal map alpha
+
+/*
+ * Tables
+ */
+
+static float	srgb_to_linear[256];
+static float	unorm_to_float[256];
+static float	snorm_to_float[256];
+static guint8	linear_to_srgb[4096];
+static volatile gsize	tables_ready = 0;
+
+// Encoders on several threads at once can get here first
+static void mip_init_tables()
+{
+	guint i;
+
+	if ( !g_once_init_enter(&tables_ready) )
+		return;
+
+	for (i = 0; i < 256; i++)
+	{
+		float v = i / 255.0f;
+		unorm_to_float[i] = v;
+		snorm_to_float[i] = v * 2 - 1;
+		srgb_to_linear[i] = v <= 0.04045f ? v / 12.92f : (float)pow((v + 0.055f) / 1.055f, 2.4f);
+	}
+	for (i = 0; i < 4096; i++)
+	{
+		float v = i / 4095.0f;
+		v = v <= 0.0031308f ? v * 12.92f : 1.055f * (float)pow(v, 1 / 2.4f) - 0.055f;
+		linear_to_srgb[i] = (guint8)(v * 255 + 0.5f);
+	}
+	g_once_init_leave(&tables_ready,1);
+}
+
+/*
+ * Filters
+ */
+
+// Weights for one output pixel, which sits between source pixels 2x and 2x+1
+typedef struct MipKernel
+{
+	gint	first;	// offset of the first tap from 2x
+	guint	taps;
+	float	weights[MIP_MAX_TAPS];
+} MipKernel_t;
+
+// For dimensions which have already reached 1
+static const MipKernel_t mip_identity_kernel = { 0, 1, { 1 } };
+
+static float mip_sinc(float x)
+{
+	if (x == 0)
+		return 1;
+	x *= MIP_PI;
+	return (float)sin(x) / x;
+}
+
+static float mip_bessel_i0(float x)
+{
+	float sum = 1, term = 1;
+	guint k;
+
+	for (k = 1; k < 20; k++)
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static float mip_filter_kaiser(float x)
+{
+	const float width = 3, alpha = 4;
+	float t = x / width;
+
+	if (t <= -1 || t >= 1)
+		return 0;
+	return mip_sinc(x) * mip_bessel_i0(alpha * (float)sqrt(1 - t * t)) / mip_bessel_i0(alpha);
+}
+
+static float mip_filter_lanczos(float x)
+{
+	if (x <= -3 || x >= 3)
+		return 0;
+	return mip_sinc(x) * mip_sinc(x / 3);
+}
+
+static float mip_filter_mitchell(float x)
+{
+	const float B = 1 / 3.0f, C = 1 / 3.0f;
+
+	x = (float)fabs(x);
+	if (x < 1)
+		return ((12 - 9*B - 6*C) * x*x*x + (-18 + 12*B + 6*C) * x*x + (6 - 2*B)) / 6;
+	if (x < 2)
+		return ((-B - 6*C) * x*x*x + (6*B + 30*C) * x*x + (-12*B - 48*C) * x + (8*B + 24*C)) / 6;
+	return 0;
+}
+
+static void mip_make_kernel(MipKernel_t* kernel, VtfMipFilter_t filter)
+{
+	float	(*func)(float) = NULL;
+	float	sum = 0;
+	gint	support;
+	guint	i;
+
+	switch (filter)
+	{
+	case MIP_FILTER_KAISER:
+		func = mip_filter_kaiser;
+		support = 3;
+		break;
+	case MIP_FILTER_LANCZOS:
+		func = mip_filter_lanczos;
+		support = 3;
+		break;
+	case MIP_FILTER_MITCHELL:
+		func = mip_filter_mitchell;
+		support = 2;
+		break;
+	default:
+		kernel->first = 0;
+		kernel->taps = 2;
+		kernel->weights[0] = kernel->weights[1] = 0.5f;
+		return;
+	}
+
+	// The kernel is stretched across two source pixels per output pixel
+	kernel->first = 1 - support * 2;
+	kernel->taps = support * 4;
+	for (i = 0; i < kernel->taps; i++)
+	{
+		kernel->weights[i] = func((kernel->first + (gint)i - 0.5f) / 2);
+		sum += kernel->weights[i];
+	}
+	for (i = 0; i < kernel->taps; i++)
+		kernel->weights[i] /= sum;
+}
+
+static guint mip_edge(gint i, guint n, gboolean clamp)
+{
+	if (clamp)
+		return CLAMP(i,0,(gint)n - 1);
+	i %= (gint)n;
+	return i < 0 ? i + n : i;
+}
+
+/*
+ * Levels
+ */
+
+guint mip_level_count(guint width, guint height, guint depth)
+{
+	guint count = 1, size = MAX(width,MAX(height,depth));
+
+	while (size > 1 && count < MIP_MAX_LEVELS)
+	{
+		size >>= 1;
+		count++;
+	}
+	return count;
+}
+
+void mip_level_size(const VtfMipChain_t* chain, guint level, guint* width, guint* height, guint* depth)
+{
+	*width = MAX(1,chain->width >> level);
+	*height = MAX(1,chain->height >> level);
+	*depth = MAX(1,chain->depth >> level);
+}
+
+typedef struct MipJob
+{
+	const VtfMipChain_t*	chain;
+	guint					level; // being written
+	guint					slice;
+	guint					first_row, num_rows;
+} MipJob_t;
+
+typedef struct MipJobList
+{
+	MipJob_t*				jobs;
+	const VtfMipOptions_t*	options;
+	MipKernel_t				kernel;
+	volatile gint			failed;
+} MipJobList_t;
+
+static void mip_decode_row(const guint8* src, guint width, const VtfMipOptions_t* options, float* out)
+{
+	const float*	colour = options->normal_map ? snorm_to_float : options->gamma_correct ? srgb_to_linear : unorm_to_float;
+	guint			x;
+
+	for (x = 0; x < width; x++, src += 4, out += 4)
+		v4_store(out, v4_set(colour[src[0]], colour[src[1]], colour[src[2]], unorm_to_float[src[3]]));
+}
+
+static void mip_encode_row(const float* row, guint width, gboolean gamma_correct, guint8* out)
+{
+	const vtf_v4	scale = gamma_correct ? v4_set(4095,4095,4095,255) : v4_splat(255);
+	const vtf_v4	one = v4_splat(1);
+	const vtf_v4	half = v4_splat(0.5f);
+	float			v[4];
+	guint			x, c;
+
+	for (x = 0; x < width; x++, row += 4, out += 4)
+	{
+		vtf_v4 p = v4_min(v4_max(v4_load(row),v4_zero()),one);
+		v4_store(v, v4_floor_pos(v4_madd(p,scale,half)));
+
+		for (c = 0; c < 3; c++)
+			out[c] = gamma_correct ? linear_to_srgb[(guint)v[c]] : (guint8)v[c];
+		out[3] = (guint8)v[3];
+	}
+}
+
+// Filtering shortens vectors that point in different directions. The direction is put back to unit length,
+// and with Toksvig the shortening fades alpha (i.e. the specular mask) to stop distant bumps sparkling.
+static void mip_encode_normal_row(const float* row, guint width, gboolean toksvig, guint8* out)
+{
+	const vtf_v4	xyz = v4_set(1,1,1,0);
+	const vtf_v4	scale = v4_set(127.5f,127.5f,127.5f,255);
+	const vtf_v4	bias = v4_set(127.5f,127.5f,127.5f,0);
+	const vtf_v4	half = v4_splat(0.5f);
+	float			v[4];
+	guint			x;
+
+	for (x = 0; x < width; x++, row += 4, out += 4)
+	{
+		vtf_v4	p = v4_load(row);
+		vtf_v4	n = v4_mul(p,xyz);
+		float	length = (float)sqrt(v4_hsum(v4_mul(n,n)));
+		float	alpha;
+
+		v4_store(v,p);
+		alpha = CLAMP(v[3],0,1);
+
+		if (length < 1e-6f)
+		{
+			n = v4_set(0,0,1,0); // cancelled out entirely; face the surface
+			length = 0;
+		}
+		else
+		{
+			n = v4_mul(n,v4_splat(1 / length));
+			length = MIN(length,1);
+		}
+
+		if (toksvig)
+			alpha *= length / (length + MIP_TOKSVIG_POWER * (1 - length));
+
+		n = v4_add(n,v4_set(0,0,0,alpha));
+		n = v4_min(v4_max(v4_madd(n,scale,v4_add(bias,half)),v4_zero()),v4_splat(255));
+		v4_store(v,v4_floor_pos(n));
+
+		out[0] = (guint8)v[0];
+		out[1] = (guint8)v[1];
+		out[2] = (guint8)v[2];
+		out[3] = (guint8)v[3];
+	}
+}
+
+static void mip_filter_row(const float* src, guint src_width, guint width, const MipKernel_t* kernel, guint step, gboolean clamp, float* out)
+{
+	guint x, t;
+
+	for (x = 0; x < width; x++, out += 4)
+	{
+		vtf_v4 sum = v4_zero();
+		for (t = 0; t < kernel->taps; t++)
+		{
+			guint sx = mip_edge(x * step + kernel->first + t, src_width, clamp);
+			sum = v4_madd(v4_splat(kernel->weights[t]), v4_load(src + sx * 4), sum);
+		}
+		v4_store(out,sum);
+	}
+}
+
+static void mip_run_job(guint index, gpointer user_data)
+{
+	MipJobList_t*				list = (MipJobList_t*)user_data;
+	const MipJob_t*				job = &list->jobs[index];
+	const MipKernel_t*			hkernel;
+	const MipKernel_t*			vkernel;
+	const guint8*				src[2];
+	const VtfMipOptions_t*		options = list->options;
+	gboolean					clamp = options->clamp;
+	guint						sw, sh, sd, dw, dh, dd;
+	guint						hstep, vstep, num_sources, n, y, x, t;
+	gint						ring_rows[2][MIP_RING_SIZE];
+	float*						ring;
+	float*						decoded;
+	float*						acc;
+	float						source_weight;
+	guint8*						dest;
+
+	mip_level_size(job->chain,job->level - 1,&sw,&sh,&sd);
+	mip_level_size(job->chain,job->level,&dw,&dh,&dd);
+
+	hkernel = sw > 1 ? &list->kernel : &mip_identity_kernel;
+	vkernel = sh > 1 ? &list->kernel : &mip_identity_kernel;
+	hstep = sw > 1 ? 2 : 1;
+	vstep = sh > 1 ? 2 : 1;
+
+	// Volumes: each slice is the average of two source slices
+	num_sources = sd > 1 ? 2 : 1;
+	source_weight = 1.0f / num_sources;
+	src[0] = job->chain->levels[job->level - 1] + job->slice * num_sources * sw * sh * 4;
+	src[1] = src[0] + sw * sh * 4;
+
+	ring = g_try_new(float,num_sources * MIP_RING_SIZE * dw * 4);
+	decoded = g_try_new(float,sw * 4);
+	acc = g_try_new(float,dw * 4);
+	if (!ring || !decoded || !acc)
+	{
+		g_atomic_int_set(&list->failed,TRUE);
+		g_free(ring);
+		g_free(decoded);
+		g_free(acc);
+		return;
+	}
+	memset(ring_rows,-1,sizeof(ring_rows));
+
+	for (y = job->first_row; y < job->first_row + job->num_rows; y++)
+	{
+		memset(acc,0,dw * 4 * sizeof(float));
+
+		for (n = 0; n < num_sources; n++)
+		{
+			for (t = 0; t < vkernel->taps; t++)
+			{
+				guint	sy = mip_edge(y * vstep + vkernel->first + t, sh, clamp);
+				guint	slot = sy % MIP_RING_SIZE;
+				float*	row = ring + (n * MIP_RING_SIZE + slot) * dw * 4;
+				vtf_v4	weight = v4_splat(vkernel->weights[t] * source_weight);
+
+				if (ring_rows[n][slot] != (gint)sy)
+				{
+					mip_decode_row(src[n] + sy * sw * 4,sw,options,decoded);
+					mip_filter_row(decoded,sw,dw,hkernel,hstep,clamp,row);
+					ring_rows[n][slot] = sy;
+				}
+
+				for (x = 0; x < dw; x++)
+					v4_store(acc + x * 4, v4_madd(weight, v4_load(row + x * 4), v4_load(acc + x * 4)));
+			}
+		}
+
+		dest = job->chain->levels[job->level] + (job->slice * dh + y) * dw * 4;
+		if (options->normal_map)
+			mip_encode_normal_row(acc,dw,options->toksvig,dest);
+		else
+			mip_encode_row(acc,dw,options->gamma_correct,dest);
+	}
+
+	g_free(ring);
+	g_free(decoded);
+	g_free(acc);
+}
+
+gboolean mip_build_chains(VtfMipChain_t* chains, guint count, const VtfMipOptions_t* options)
+{
+	MipJobList_t	list;
+	guint			i, level, max_levels = 0;
+
+	mip_init_tables();
+	mip_make_kernel(&list.kernel,options->filter);
+	list.options = options;
+	list.failed = FALSE;
+
+	for (i = 0; i < count; i++)
+		for (level = 1; level < MIP_MAX_LEVELS; level++)
+			chains[i].levels[level] = NULL;
+
+	for (i = 0; i < count; i++)
+	{
+		for (level = 1; level < chains[i].num_levels; level++)
+		{
+			guint w, h, d;
+			mip_level_size(&chains[i],level,&w,&h,&d);
+			chains[i].levels[level] = g_try_new(guint8,w * h * d * 4);
+			if (!chains[i].levels[level])
+				return FALSE;
+		}
+		max_levels = MAX(max_levels,chains[i].num_levels);
+	}
+
+	// Each level is made from the one before it, but all chains, slices and row bands of a level can be done at once
+	for (level = 1; level < max_levels && !list.failed; level++)
+	{
+		guint num_jobs = 0, pass;
+
+		list.jobs = NULL;
+		for (pass = 0; pass < 2; pass++)
+		{
+			num_jobs = 0;
+			for (i = 0; i < count; i++)
+			{
+				guint w, h, d, slice, row;
+
+				if (level >= chains[i].num_levels)
+					continue;
+
+				mip_level_size(&chains[i],level,&w,&h,&d);
+				for (slice = 0; slice < d; slice++)
+					for (row = 0; row < h; row += MIP_BAND_ROWS)
+					{
+						if (list.jobs)
+						{
+							MipJob_t* job = &list.jobs[num_jobs];
+							job->chain = &chains[i];
+							job->level = level;
+							job->slice = slice;
+							job->first_row = row;
+							job->num_rows = MIN(MIP_BAND_ROWS,h - row);
+						}
+						num_jobs++;
+					}
+			}
+
+			if (!list.jobs)
+			{
+				list.jobs = g_try_new(MipJob_t,num_jobs);
+				if (!list.jobs)
+					return FALSE;
+			}
+		}
+
+		vtf_parallel_for(num_jobs,mip_run_job,&list);
+		g_free(list.jobs);
+	}
+
+	return !list.failed;
+}
+
+void mip_free_chains(VtfMipChain_t* chains, guint count)
+{
+	guint i, level;
+
+	for (i = 0; i < count; i++)
+		for (level = 1; level < chains[i].num_levels; level++)
+		{
+			g_free(chains[i].levels[level]);
+			chains[i].levels[level] = NULL;
+		}
+}
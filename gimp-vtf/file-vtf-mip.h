@@ -0,0 +1,57 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_MIP_H
+#define FILE_VTF_MIP_H
+
+#include <glib.h>
+
+// Mipmap generation. Like block compression, this is GIMP-free and runs on the worker pool.
+
+typedef enum VtfMipFilter
+{
+	MIP_FILTER_BOX = 0,
+	MIP_FILTER_KAISER,
+	MIP_FILTER_LANCZOS,
+	MIP_FILTER_MITCHELL
+} VtfMipFilter_t;
+
+#define MIP_FILTER_COUNT 4
+#define MIP_MAX_LEVELS 16
+
+typedef struct VtfMipOptions
+{
+	VtfMipFilter_t	filter;
+	gboolean		gamma_correct;	// filter RGB in linear space
+	gboolean		clamp;			// repeat edge pixels instead of wrapping around
+	gboolean		normal_map;		// RGB is a unit vector, which is renormalized after filtering
+	gboolean		toksvig;		// normal maps only: fade alpha where the filtered normals disagree
+} VtfMipOptions_t;
+
+// One frame or face. Each level is RGBA8888 with its slices one after another.
+typedef struct VtfMipChain
+{
+	guint		width, height, depth; // of level 0
+	guint		num_levels;
+	guint8*		levels[MIP_MAX_LEVELS];
+} VtfMipChain_t;
+
+guint mip_level_count(guint width, guint height, guint depth);
+void mip_level_size(const VtfMipChain_t* chain, guint level, guint* width, guint* height, guint* depth);
+
+// Fills in levels 1 to num_levels - 1 of every chain, which are allocated here. levels[0] is provided by the caller.
+// Returns FALSE if out of memory.
+gboolean mip_build_chains(VtfMipChain_t* chains, guint count, const VtfMipOptions_t* options);
+
+// Frees levels 1 and up
+void mip_free_chains(VtfMipChain_t* chains, guint count);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-pool.h"
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <unistd.h>
+#endif
+
+// g_atomic_int_add only returns the old value from 2.30
+#if GLIB_CHECK_VERSION(2,30,0)
+	#define vtf_atomic_fetch_add g_atomic_int_add
+#else
+	#define vtf_atomic_fetch_add g_atomic_int_exchange_and_add
+#endif
+
+typedef struct VtfParallelTask
+{
+	VtfParallelFunc	func;
+	gpointer		user_data;
+	guint			count;
+
+	volatile gint	next;
+	GAsyncQueue*	done;
+} VtfParallelTask_t;
+
+static GThreadPool*	pool = NULL;
+static guint		requested_threads = 0;
+static guint		num_threads = 0;
+
+static guint vtf_num_processors()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (guint)n : 1;
+#endif
+}
+
+void vtf_set_num_threads(guint threads)
+{
+	if (threads == requested_threads)
+		return;
+
+	vtf_pool_shutdown();
+	requested_threads = threads;
+}
+
+guint vtf_get_num_threads()
+{
+	guint threads = requested_threads;
+
+	if (threads == 0)
+	{
+		const gchar* env = g_getenv(VTF_THREADS_ENV);
+		if (env)
+		{
+			gchar*	end;
+			gint64	value = g_ascii_strtoll(env,&end,10);
+
+			// Anything that isn't a positive number means "automatic"
+			if (end != env && *end == 0 && value > 0)
+				threads = (guint)MIN(value,64);
+		}
+	}
+	if (threads == 0)
+		threads = vtf_num_processors();
+
+	return MIN(threads,64);
+}
+
+static void vtf_run_task(VtfParallelTask_t* task)
+{
+	guint index;
+
+	while ( (index = (guint)vtf_atomic_fetch_add(&task->next,1)) < task->count )
+		task->func(index,task->user_data);
+}
+
+static void vtf_pool_worker(gpointer data, gpointer user_data)
+{
+	VtfParallelTask_t* task = (VtfParallelTask_t*)data;
+
+	vtf_run_task(task);
+	g_async_queue_push(task->done,task);
+}
+
+static void vtf_thread_init()
+{
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+}
+
+static void vtf_pool_start()
+{
+	num_threads = vtf_get_num_threads();
+
+	if (num_threads < 2)
+		return;
+
+	vtf_thread_init();
+
+	// The calling thread is a worker too
+	pool = g_thread_pool_new(vtf_pool_worker,NULL,num_threads - 1,TRUE,NULL);
+	if (!pool)
+		num_threads = 1;
+}
+
+void vtf_parallel_for(guint count, VtfParallelFunc func, gpointer user_data)
+{
+	VtfParallelTask_t	task;
+	guint				helpers, i;
+
+	if (!pool && num_threads == 0)
+		vtf_pool_start();
+
+	helpers = pool ? MIN(num_threads - 1, count ? count - 1 : 0) : 0;
+
+	if (helpers == 0)
+	{
+		for (i = 0; i < count; i++)
+			func(i,user_data);
+		return;
+	}
+
+	task.func = func;
+	task.user_data = user_data;
+	task.count = count;
+	task.next = 0;
+	task.done = g_async_queue_new();
+
+	for (i = 0; i < helpers; i++)
+		g_thread_pool_push(pool,&task,NULL);
+
+	vtf_run_task(&task);
+
+	for (i = 0; i < helpers; i++)
+		g_async_queue_pop(task.done);
+
+	g_async_queue_unref(task.done);
+}
+
+GThread* vtf_thread_new(GThreadFunc func, gpointer data)
+{
+	// The pool is started lazily, which mustn't happen on two threads at once
+	if (!pool && num_threads == 0)
+		vtf_pool_start();
+
+	vtf_thread_init();
+
+#if GLIB_CHECK_VERSION(2,32,0)
+	return g_thread_try_new("file-vtf",func,data,NULL);
+#else
+	return g_thread_create(func,data,TRUE,NULL);
+#endif
+}
+
+void vtf_pool_shutdown()
+{
+	if (pool)
+		g_thread_pool_free(pool,FALSE,TRUE);
+	pool = NULL;
+	num_threads = 0;
+}
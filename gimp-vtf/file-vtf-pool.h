@@ -0,0 +1,38 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_POOL_H
+#define FILE_VTF_POOL_H
+
+#include <glib.h>
+
+// Worker threads for the slow, GIMP-free parts of loading and saving.
+
+#define VTF_THREADS_ENV	"GIMP_VTF_THREADS"
+
+typedef void (*VtfParallelFunc)(guint index, gpointer user_data);
+
+// 0 = GIMP_VTF_THREADS if set, otherwise one per processor. Takes effect when the pool is next started.
+void	vtf_set_num_threads(guint num_threads);
+guint	vtf_get_num_threads();
+
+// Calls func for every index in [0,count) and returns once they have all finished. The calling thread
+// joins in. The order of calls is undefined, so each index must only write to its own memory.
+// Several threads can share the pool, but don't call this from inside func.
+void	vtf_parallel_for(guint count, VtfParallelFunc func, gpointer user_data);
+
+// Starts a thread of its own (e.g. one stage of a pipeline), which can use vtf_parallel_for() too.
+// Returns NULL if it couldn't be started.
+GThread*	vtf_thread_new(GThreadFunc func, gpointer data);
+
+void	vtf_pool_shutdown();
+
+#endif
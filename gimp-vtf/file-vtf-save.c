@@ -13,11 +13,20 @@
 #include <libgimp/gimpui.h>
 
 #include "file-vtf.h"
+#include "file-vtf-composite.h"
+#include "file-vtf-encode.h"
+#include "file-vtf-hash.h"
+#include "file-vtf-io.h"
+#include "file-vtf-mip.h"
+#include "file-vtf-pool.h"
+#include "file-vtf-settings.h"
 
 #define LAYERGROUPS_ITERATE layergroups.cur = layergroups.head; layergroups.cur < layergroups.head + layergroups.count; layergroups.cur++
 
 gboolean vtf_set_data();
 gboolean vtf_get_data();
+void vtf_set_export_hashes();
+gint32 vtf_get_data_tattoo(gboolean settings_file);
 
 /*
  * Logic
@@ -29,6 +38,8 @@ guint		exponentU;
 guint		exponentV;
 
 gint32		dummy_lg = -1;
+gboolean	root_visibility_changed = FALSE;
+guint		frames_in_flight = 0;	// images held in memory while saving; 0 = two per thread
 
 typedef struct TabControls
 {
@@ -52,12 +63,18 @@ typedef struct TabControls
 	GtkWidget*	BumpType;
 	GSList*		BumpRadioGroup;
 
+	GtkWidget*	MipFilterHBox;
+	GtkWidget*	MipFilter;
+	GtkWidget*	MipGamma;
+	GtkWidget*	MipToksvig;
+
 	GtkWidget*	LODControlHBox;
 	GtkWidget*	LODControlSlider;
 
 	GtkWidget*	ClearOtherFlags;
 
 	GtkWidget*	VtfVersion;
+	GtkWidget*	DxtQuality;
 
 	GtkWidget*	LayerUseCombo;
 	GtkWidget*	LayerUseLabel;
@@ -68,6 +85,18 @@ typedef struct TabControls
 	GtkWidget* AlphaLayerLabel;
 } TabControls_t;
 
+// Recorded after each export, so that the next one can skip groups which would come out the same. Stored with
+// the group's other settings.
+#define VTF_EXPORT_HASH_VERSION	1 // change whenever the same pixels and options would make a different VTF
+
+typedef struct VtfExportHash
+{
+	guint32	num_images;	// 0 if the group has never been exported
+	guint64	options;	// see vtf_export_options_hash()
+	gint64	file_size;
+	gint64	file_mtime;
+} VtfExportHash_t;
+
 typedef struct LayerGroup
 {
 	VtfSaveOptions_t VtfOpt;
@@ -85,6 +114,11 @@ typedef struct LayerGroup
 
 	gboolean	is_main; // output file does not have a suffix
 
+	VtfExportHash_t	export_hash;
+	guint64*		image_hashes;	// export_hash.num_images of them, in VTF order
+	gboolean		unchanged; // so wasn't exported again
+	guint			num_duplicates; // images which were copied from an identical one
+
 	TabControls_t	UI;
 } LayerGroup_t;
 
@@ -100,31 +134,7 @@ guint initial_lg = 0;
 
 gint select_vtf_format_index(const VtfSaveOptions_t* opt)
 {
-	if (opt->AdvancedSetup)
-		return layergroups.cur->VtfOpt.PixelFormat;
-
-	if (opt->Compress)
-	{
-		if (opt->WithAlpha)
-			return 3;
-		else
-			return 0;
-	}
-	else
-	{
-		gboolean gray = gimp_image_base_type(image_ID) == GIMP_GRAY;
-
-		if (opt->WithAlpha)
-		{
-			if (gray) return 10;
-			else return 5;
-		}
-		else
-		{
-			if (gray) return 8;
-			else return 4;
-		}
-	}
+	return vtf_select_format(opt,gimp_image_base_type(image_ID) == GIMP_GRAY);
 }
 
 gboolean fix_alpha_layer(VtfSaveOptions_t* opt, gint32 image_id)
@@ -137,11 +147,6 @@ gboolean fix_alpha_layer(VtfSaveOptions_t* opt, gint32 image_id)
 	return FALSE;
 }
 
-gboolean is_drawable_full_size(gint32 drawable_ID)
-{
-	return gimp_drawable_width(drawable_ID) == layergroups.cur->width && gimp_drawable_height(drawable_ID) == layergroups.cur->height;
-}
-
 void vtf_size_error(gchar* dimension,gint value)
 {
 	static gchar buf[256];
@@ -151,6 +156,15 @@ void vtf_size_error(gchar* dimension,gint value)
 	return;
 }
 
+// Hides every root layer except the current group, so that GIMP's projection shows only that
+void isolate_layer_group()
+{
+	guint i;
+	for (i=0; i < num_layers_root; i++)
+		gimp_item_set_visible(layer_IDs_root[i],layer_IDs_root[i] == layergroups.cur->ID);
+	root_visibility_changed = TRUE;
+}
+
 void remove_dummy_lg()
 {
 	if (dummy_lg != -1)
@@ -171,7 +185,7 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 {
 	gboolean*	root_layer_visibility;
 	gboolean	filename_cropped = FALSE;
-	guint		i,num_to_export=0, num_exported=0;
+	guint		i,num_to_export=0, num_exported=0, num_unchanged=0, num_duplicates=0;
 	
 	run_mode	= (GimpRunMode)param[0].data.d_int32;
 	image_ID	= param[1].data.d_int32;
@@ -367,10 +381,29 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 	case GIMP_RUN_NONINTERACTIVE:
 		switch(nparams)
 		{
+		case 22:
+		case 21:
+		case 20:
+		case 19:
+		case 18:
+		case 17:
 		case 16:
 			for (LAYERGROUPS_ITERATE)
-				layergroups.cur->VtfOpt.Enabled = layergroups.cur->ID == param[16].data.d_layer; // FIXME: add a special error message for the param'ed ID being wrong
+				layergroups.cur->VtfOpt.Enabled = FALSE;
 
+			// Find the target group, or the main group if there are no layer groups
+			for (LAYERGROUPS_ITERATE)
+			{
+				if ( dummy_lg != -1 || param[15].data.d_layer == -1 ? layergroups.cur->is_main : layergroups.cur->ID == param[15].data.d_layer )
+					break;
+			}
+			if (layergroups.cur == layergroups.head + layergroups.count)
+			{
+				record_error(_("#invalid_target_lg_error"),GIMP_PDB_CALLING_ERROR);
+				return;
+			}
+
+			layergroups.cur->VtfOpt.Enabled = TRUE;
 			layergroups.cur->VtfOpt.PixelFormat = param[5].data.d_int8;
 			layergroups.cur->VtfOpt.AlphaLayerTattoo = param[6].data.d_int32;
 			if (fix_alpha_layer(&layergroups.cur->VtfOpt,image_ID))
@@ -379,13 +412,25 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 				return;
 			}
 			layergroups.cur->VtfOpt.LayerUse = (VtfLayerUse_t)param[7].data.d_int8;
-			layergroups.cur->VtfOpt.Version = param[8].data.d_int8;
+			layergroups.cur->VtfOpt.Version = CLAMP(param[8].data.d_int8,2,5); // only 7.2 to 7.5 are written
 			layergroups.cur->VtfOpt.WithMips = param[9].data.d_int8;
 			layergroups.cur->VtfOpt.NoLOD = param[10].data.d_int8;
 			layergroups.cur->VtfOpt.Clamp = param[11].data.d_int8;
 			layergroups.cur->VtfOpt.BumpType = (VtfBumpType_t)param[12].data.d_int8;
 			layergroups.cur->VtfOpt.LodControlU = param[13].data.d_int8;
 			layergroups.cur->VtfOpt.LodControlV = param[14].data.d_int8;
+			if (nparams > 16)
+				layergroups.cur->VtfOpt.DxtQuality = MIN(param[16].data.d_int8,DXT_QUALITY_COUNT - 1);
+			if (nparams > 17)
+				vtf_set_num_threads(MAX(param[17].data.d_int32,0));
+			if (nparams > 18)
+				layergroups.cur->VtfOpt.MipFilter = MIN(param[18].data.d_int8,MIP_FILTER_COUNT - 1);
+			if (nparams > 19)
+				layergroups.cur->VtfOpt.MipGamma = param[19].data.d_int8;
+			if (nparams > 20)
+				layergroups.cur->VtfOpt.MipToksvig = param[20].data.d_int8;
+			if (nparams > 21)
+				frames_in_flight = MAX(param[21].data.d_int32,0);
 			break;
 		default:
 			record_error("Incorrect number of arguments",GIMP_PDB_CALLING_ERROR);
@@ -422,8 +467,6 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 
 	for (i=0; i < layergroups.count; i++)
 	{
-		guint j;
-		
 		layergroups.cur = layergroups.head + i;
 
 		if (!layergroups.cur->VtfOpt.Enabled)
@@ -434,21 +477,16 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 		else
 			gimp_progress_update( (gdouble)(1.0f/num_to_export) * (num_exported+1) );
 		
-		for (j=0; j < num_layers_root; j++)
-		{
-			if (layergroups.head[i].ID == layer_IDs_root[j])
-				gimp_item_set_visible(layer_IDs_root[j],TRUE);
-			else
-				gimp_item_set_visible(layer_IDs_root[j],FALSE);
-		}
-		
 		vtf_ret_values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
 
 		create_vtf(layergroups.cur->ID, layergroups.cur->is_main);
 
 		if ( vtf_ret_values[0].data.d_status == GIMP_PDB_SUCCESS)
 		{
-			num_exported++;			
+			num_exported++;
+			if (layergroups.cur->unchanged)
+				num_unchanged++;
+			num_duplicates += layergroups.cur->num_duplicates;
 		}
 		else
 		{
@@ -473,117 +511,204 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals)
 
 create_loop_exit:
 
+	if (num_exported > num_unchanged)
+		vtf_set_export_hashes();
+
+	if (num_unchanged || num_duplicates)
+	{
+		GString* message = g_string_new(NULL);
+
+		if (num_unchanged)
+			g_string_append_printf(message,_("#export_summary"),num_unchanged,num_exported);
+		if (num_unchanged && num_duplicates)
+			g_string_append_c(message,'\n');
+		if (num_duplicates)
+			g_string_append_printf(message,_("#export_duplicates_summary"),num_duplicates);
+
+		gimp_message_set_handler(GIMP_CONSOLE);
+		gimp_message(message->str);
+		gimp_message_set_handler(GIMP_MESSAGE_BOX);
+		g_string_free(message,TRUE);
+	}
 	
-	for (i=0; i < num_layers_root; i++)
-		gimp_item_set_visible(layer_IDs_root[i],root_layer_visibility[i]);
+	// Each change makes GIMP re-project the image, so only touch visibility if a group had to be merged by GIMP
+	if (root_visibility_changed)
+		for (i=0; i < num_layers_root; i++)
+			gimp_item_set_visible(layer_IDs_root[i],root_layer_visibility[i]);
 	g_free(root_layer_visibility);
 	root_layer_visibility = 0;
 }
 
-void create_vtf(gint32 layer_group, gboolean is_main_group)
+// Reads image 'index' in VTF order, which is the reverse of GIMP's. Returns FALSE if out of memory.
+static gboolean vtf_read_image(guint index, guint num_images, vlByte* rgba, gpointer alpha_plane)
 {
-	SVTFCreateOptions	vlVTFOpt;
-	vlByte**			rbgaImages;
-			
-	gint32		alpha_layer_ID_original = -1;
-	gint32		alpha_layer_ID = -1;
-	gint32		alpha_layer_parent = -1;
-	gint		alpha_layer_position;
+	gint32		drawable_ID;
+	gboolean	read;
+
+	// Pixels of any type, size and position are converted to image-sized RGBA as they are read
+	if ( layergroups.cur->VtfOpt.LayerUse != VTF_MERGE_VISIBLE )
+		read = vtf_read_drawable(layergroups.cur->children[(num_images - 1) - index],layergroups.cur->width,layergroups.cur->height,rgba);
+	else if ( vtf_can_composite_group(layergroups.cur->ID) )
+		read = vtf_composite_group(layergroups.cur->ID,layergroups.cur->width,layergroups.cur->height,rgba);
+	else
+	{
+		isolate_layer_group();
+		drawable_ID = gimp_layer_new_from_visible(image_ID,image_ID,_("#combined_layer_title"));
+		gimp_image_insert_layer(image_ID,drawable_ID,0,0);
 
-	guint		frame=1,face=1,slice=1,dummy=0;
-	guint*		layer_iterator;
+		read = vtf_read_drawable(drawable_ID,layergroups.cur->width,layergroups.cur->height,rgba);
 
-	gchar*		progress_frame_label;
+		gimp_image_remove_layer(image_ID,drawable_ID);
+	}
 
-	GimpImageBaseType	img_type;
-	gint				colourmap_size;
+	if (read && alpha_plane)
+		vtf_apply_alpha_plane(rgba,(const guint8*)alpha_plane,layergroups.cur->width,layergroups.cur->height);
+	return read;
+}
 
-	gint32		drawable_ID = -1;
+static void vtf_stream_progress(guint read, guint written, guint num_images, gpointer user_data)
+{
+	if (num_images > 1)
+		gimp_progress_set_text_printf(_("#save_message_stages"),layergroups.cur->filename,read,num_images,written);
+}
 
-	guint		i;
+// Everything except pixels which decides what the current group's VTF will contain, including where it goes.
+// Field by field, as the padding between them is undefined. Simple and advanced setups which choose the same
+// format are the same thing.
+static guint64 vtf_export_options_hash(guint format_index)
+{
+	const VtfSaveOptions_t*	opt = &layergroups.cur->VtfOpt;
+	gint32					fields[16];
+	guint					n = 0;
+
+	fields[n++] = VTF_EXPORT_HASH_VERSION;
+	fields[n++] = format_index;
+	fields[n++] = opt->Version;
+	fields[n++] = opt->Clamp;
+	fields[n++] = opt->NoLOD;
+	fields[n++] = opt->WithMips;
+	fields[n++] = opt->BumpType;
+	fields[n++] = opt->LayerUse;
+	fields[n++] = opt->AlphaLayerTattoo;
+	fields[n++] = opt->GeneralFlags;
+	fields[n++] = opt->LodControlU;
+	fields[n++] = opt->LodControlV;
+	fields[n++] = opt->DxtQuality;
+	fields[n++] = opt->MipFilter;
+	fields[n++] = opt->MipGamma;
+	fields[n++] = opt->MipToksvig;
+	g_assert(n == G_N_ELEMENTS(fields));
+
+	return vtf_hash(fields,sizeof(fields),vtf_hash(layergroups.cur->path,strlen(layergroups.cur->path),0));
+}
+
+// TRUE if the current group's last export is still on disk and would come out the same. Images are read and
+// compared one at a time (with the alpha layer applied, as it will be when exporting), stopping at the first
+// which has changed.
+static gboolean vtf_export_unchanged(guint num_images, guint64 options, const guint8* alpha_plane)
+{
+	const VtfExportHash_t*	last = &layergroups.cur->export_hash;
+	gint64					file_size, file_mtime;
+	vlByte*					rgba;
+	guint					i;
+	gboolean				unchanged;
+
+	if ( last->num_images != num_images || last->options != options
+		|| !vtf_file_stat(layergroups.cur->path,&file_size,&file_mtime) || file_size != last->file_size || file_mtime != last->file_mtime )
+		return FALSE;
+
+	rgba = g_try_new(vlByte,layergroups.cur->num_bytes);
+	unchanged = rgba != NULL;
+	for (i = 0; i < num_images && unchanged; i++)
+		unchanged = vtf_read_image(i,num_images,rgba,(gpointer)alpha_plane)
+			&& vtf_hash_image(rgba,layergroups.cur->width,layergroups.cur->height) == layergroups.cur->image_hashes[i];
+
+	g_free(rgba);
+	return unchanged;
+}
+
+// Takes ownership of the image hashes
+static void vtf_export_remember(guint num_images, guint64 options, guint64* image_hashes)
+{
+	VtfExportHash_t* hash = &layergroups.cur->export_hash;
+
+	g_free(layergroups.cur->image_hashes);
+	layergroups.cur->image_hashes = image_hashes;
+
+	hash->num_images = num_images;
+	hash->options = options;
+	if ( !vtf_file_stat(layergroups.cur->path,&hash->file_size,&hash->file_mtime) )
+		hash->num_images = 0;
+}
+
+void create_vtf(gint32 layer_group, gboolean is_main_group)
+{
+	VtfStream_t			stream;
+	GimpParasite*		original;
+			
+	guint8*		alpha_plane = NULL;
+
+	gchar*		progress_frame_label;
+
+	guint		num_images;
+	guint		format_index;
+	guint64		options_hash;
 		
 	// Set up creation options
-	vlImageCreateDefaultCreateStructure(&vlVTFOpt);
-	vlVTFOpt.ImageFormat = vtf_formats[select_vtf_format_index(&layergroups.cur->VtfOpt)].vlFormat;
-
-	vlVTFOpt.uiFlags = layergroups.cur->VtfOpt.GeneralFlags; // Import unhandled flags from a loaded VTF
-
-	vlVTFOpt.uiVersion[1] = layergroups.cur->VtfOpt.Version;
-	vlVTFOpt.bMipmaps = layergroups.cur->VtfOpt.WithMips;
-	if (layergroups.cur->VtfOpt.Clamp)
-		vlVTFOpt.uiFlags |= TEXTUREFLAGS_CLAMPS | TEXTUREFLAGS_CLAMPT;
-	if (layergroups.cur->VtfOpt.NoLOD)
-		vlVTFOpt.uiFlags |= TEXTUREFLAGS_NOLOD;
-	switch (layergroups.cur->VtfOpt.BumpType)
+	format_index = select_vtf_format_index(&layergroups.cur->VtfOpt);
+
+	// VTFs only know about cube maps of six faces. Any other number would be read back as a single face.
+	if ( layergroups.cur->VtfOpt.LayerUse == VTF_ENVMAP && layergroups.cur->children_count != 6 )
 	{
-	case BUMP:
-		vlVTFOpt.uiFlags |= TEXTUREFLAGS_NORMAL;
-		vlVTFOpt.uiFlags &= ~TEXTUREFLAGS_SSBUMP;
-		break;
-	case SSBUMP:
-		vlVTFOpt.uiFlags |= TEXTUREFLAGS_SSBUMP;
-		vlVTFOpt.uiFlags &= ~TEXTUREFLAGS_NORMAL;
-		break;
-	case NOT_BUMP:
-		vlVTFOpt.uiFlags &= ~TEXTUREFLAGS_SSBUMP;
-		vlVTFOpt.uiFlags &= ~TEXTUREFLAGS_NORMAL;
-		break;
+		record_error(_("#envmap_faces_error"),GIMP_PDB_EXECUTION_ERROR);
+		return;
 	}
 
-	// Handle alpha layers
-	if ( layergroups.cur->VtfOpt.AlphaLayerTattoo && vtf_format_has_alpha(select_vtf_format_index(&layergroups.cur->VtfOpt)) )
+	// Handle alpha layers. Only top-level layers can be chosen, so it isn't one of the group's children.
+	if ( layergroups.cur->VtfOpt.AlphaLayerTattoo && vtf_format_has_alpha(format_index) )
 	{
-		alpha_layer_ID = gimp_image_get_layer_by_tattoo(image_ID,layergroups.cur->VtfOpt.AlphaLayerTattoo);
-		alpha_layer_position = gimp_image_get_item_position(image_ID,alpha_layer_ID);
-		alpha_layer_parent = gimp_item_get_parent(alpha_layer_ID);
-		
-		// Move it outside the layer group...not currently necessary as only top-level layers can be chosen
-		// from gimp_layer_combo, but the GIMP team might change their minds about that before 2.8.
-		gimp_image_reorder_item(image_ID,alpha_layer_ID,-1,0);
-		
-		// Resize if needed
-		if (!is_drawable_full_size(alpha_layer_ID))
+		alpha_plane = g_try_new(guint8,layergroups.cur->width * layergroups.cur->height);
+		if ( !alpha_plane || !vtf_read_alpha_layer(gimp_image_get_layer_by_tattoo(image_ID,layergroups.cur->VtfOpt.AlphaLayerTattoo),
+			layergroups.cur->width,layergroups.cur->height,alpha_plane) )
 		{
-			alpha_layer_ID_original = alpha_layer_ID;
-			alpha_layer_ID = gimp_layer_new_from_drawable(alpha_layer_ID,image_ID);
-			gimp_image_insert_layer(image_ID,alpha_layer_ID,0,0);
-			gimp_layer_resize_to_image_size(alpha_layer_ID);
+			g_free(alpha_plane);
+			record_error_mem();
+			return;
 		}
-
-		layergroups.cur->children = gimp_item_get_children(layergroups.cur->ID,(gint*)&layergroups.cur->children_count);
 	}
 
-	// convert image to RGB. It would be nice if this could happen per-drawable!
-	img_type = gimp_image_base_type(image_ID);
-	switch( img_type )
-	{
-	case GIMP_RGB:
-		break;
-	case GIMP_INDEXED:
-		gimp_image_get_colormap(image_ID,&colourmap_size);
-	case GIMP_GRAY:
-		gimp_image_convert_rgb(image_ID);
-		break;
-	}
+	g_assert(layergroups.cur->children_count);
+
+	// Merging only needs the visible image once, however many children the group has
+	num_images = layergroups.cur->VtfOpt.LayerUse == VTF_MERGE_VISIBLE ? 1 : layergroups.cur->children_count;
+
+	vtf_stream_init(&stream,&layergroups.cur->VtfOpt,format_index,layergroups.cur->width,layergroups.cur->height,num_images);
+	stream.in_flight = frames_in_flight;
 
 	switch(layergroups.cur->VtfOpt.LayerUse)
 	{
 	case VTF_MERGE_VISIBLE:
-		layer_iterator = &dummy;
 		break;
 	case VTF_ANIMATION:
-		layer_iterator = &frame;
 		progress_frame_label = _("#anim_frame_word");
 		break;
 	case VTF_ENVMAP:
-		layer_iterator = &face;
 		progress_frame_label = _("#envmap_face_word");
 		break;
 	case VTF_VOLUME:
-		layer_iterator = &slice;
 		progress_frame_label = _("#volume_slice_word");
 		break;
 	}
+
+	options_hash = vtf_export_options_hash(format_index);
+	if ( vtf_export_unchanged(num_images,options_hash,alpha_plane) )
+	{
+		gimp_progress_set_text_printf(_("#save_message_unchanged"),layergroups.cur->filename);
+		layergroups.cur->unchanged = TRUE;
+		vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+		g_free(alpha_plane);
+		return;
+	}
 	
 	// Progress meter...unfortunately, VTFLib won't tell us its internal progress
 	if (layergroups.cur->VtfOpt.LayerUse == VTF_MERGE_VISIBLE)
@@ -593,113 +718,34 @@ void create_vtf(gint32 layer_group, gboolean is_main_group)
 			gimp_progress_set_text_printf(_("#save_message_combined"),layergroups.cur->filename);
 	else
 		gimp_progress_set_text_printf(_("#save_message_multi"),layergroups.cur->filename,layergroups.cur->children_count,progress_frame_label);
-	
-	g_assert(layergroups.cur->children_count);
-
-	rbgaImages = g_new(vlByte*,layergroups.cur->children_count);
-	if (!rbgaImages)
-	{
-		record_error_mem();
-		return;
-	}	
 
-	// the layer iterator pointer increments either the frame, face or slice value (or a dummy in the case of VTF_MERGE_VISIBLE)
-	for ( *layer_iterator = 0; *layer_iterator < layergroups.cur->children_count; (*layer_iterator)++)
-	{
-		rbgaImages[*layer_iterator] = g_new(vlByte,layergroups.cur->num_bytes);
-		if (!rbgaImages[*layer_iterator])
-		{
-			record_error_mem();
-			return;
-		}
-	}
-	for ( *layer_iterator = 0; *layer_iterator < layergroups.cur->children_count; (*layer_iterator)++)
+	original = gimp_image_get_parasite(image_ID,VTF_ORIGINAL_PARASITE);
+	if (original)
 	{
-		GimpPixelRgn	pixel_rgn;
-		GimpDrawable*	drawable;
-		gboolean		dupe_layer;
-		
-		drawable_ID = layergroups.cur->children[*layer_iterator];
-
-		dupe_layer = layergroups.cur->VtfOpt.LayerUse == VTF_MERGE_VISIBLE || alpha_layer_ID != -1 || !is_drawable_full_size(drawable_ID);
-
-		if (dupe_layer)
-		{
-			if ( layergroups.cur->VtfOpt.LayerUse == VTF_MERGE_VISIBLE )
-				drawable_ID = gimp_layer_new_from_visible(image_ID,image_ID,_("#combined_layer_title"));
-			else
-				drawable_ID = gimp_layer_copy(drawable_ID);
-
-			gimp_image_insert_layer(image_ID,drawable_ID,0,0);
-			gimp_layer_resize_to_image_size(drawable_ID);
-		}
-		
-		if (alpha_layer_ID != -1)
-		{
-			// have to create a new mask every time, unfortunately
-			gimp_layer_add_mask( drawable_ID, gimp_layer_create_mask(alpha_layer_ID,GIMP_ADD_COPY_MASK) );
-			gimp_layer_remove_mask( drawable_ID, GIMP_MASK_APPLY );
-		}
-
-		gimp_layer_add_alpha(drawable_ID); // always want to send VTFLib an alpha channel
-	
-		// Get drawable info
-		drawable = gimp_drawable_get(drawable_ID);
-
-		if (drawable->bpp != 4)
-		{
-			record_error(_("#internal_4bpp_error"),GIMP_PDB_EXECUTION_ERROR);
-			return;
-		}
-
-		// Put pixels into array, from last layer to first thanks to GIMP
-		gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, layergroups.cur->width, layergroups.cur->height, FALSE, FALSE);
-		gimp_pixel_rgn_get_rect(&pixel_rgn, rbgaImages[(layergroups.cur->children_count - 1) - *layer_iterator], 0,0, layergroups.cur->width,layergroups.cur->height);
-
-		// Cleanup
-		if (dupe_layer)
-			gimp_image_remove_layer(image_ID,drawable_ID);
+		stream.original_data = (const guint8*)gimp_parasite_data(original);
+		stream.original_size = gimp_parasite_data_size(original);
 	}
 
-	if (alpha_layer_ID_original != -1)
+	// Write!
+	if ( vtf_stream_images(&stream,layergroups.cur->path,vtf_read_image,vtf_stream_progress,alpha_plane) )
 	{
-		gimp_image_remove_layer(image_ID,alpha_layer_ID);
-		alpha_layer_ID = alpha_layer_ID_original;
+		vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+		layergroups.cur->num_duplicates = stream.num_duplicates;
+		vtf_export_remember(num_images,options_hash,stream.hashes);
+		stream.hashes = NULL;
 	}
-	if (alpha_layer_ID != -1)
-	{
-		gimp_image_reorder_item(image_ID, alpha_layer_ID, alpha_layer_parent, alpha_layer_position);
-		gimp_displays_flush();
-	}
-
-	// Hand off to VTFLib
-	if ( vlImageCreateMultiple(layergroups.cur->width,layergroups.cur->height, frame,face,slice, rbgaImages, &vlVTFOpt) )
-	{
+	else if (stream.error[0])
+		record_error(g_strdup(_(stream.error)),GIMP_PDB_EXECUTION_ERROR);
 
-		if ( vlImageGetSupportsResources() )
-		{
-			if (layergroups.cur->VtfOpt.WithMips && layergroups.cur->VtfOpt.LodControlU != 0 && layergroups.cur->VtfOpt.LodControlV != 0 )
-			{
-				gchar buf[4]; // must be 4, not 2
-				memset(buf,0,4);
-				buf[0] = layergroups.cur->VtfOpt.LodControlU;
-				buf[1] = layergroups.cur->VtfOpt.LodControlV;
-				vlImageSetResourceData(VTF_RSRC_TEXTURE_LOD_SETTINGS,4,buf);
-			}
-		}
-
-		// Write!
-		if ( vlImageSave(layergroups.cur->path) )
-			vtf_ret_values[0].data.d_status = GIMP_PDB_SUCCESS;		
-	}
+	if (original)
+		gimp_parasite_free(original);
+	g_free(stream.hashes);
+	g_free(alpha_plane);
 	
 	// Failed!
 	if ( vtf_ret_values[0].data.d_status != GIMP_PDB_SUCCESS )
-	{
-      vtf_ret_values[1].type          = GIMP_PDB_STRING;
-      vtf_ret_values[1].data.d_string = (gchar*)vlGetLastError();
-	}
-	else if ( vtf_format_is_compressed(layergroups.cur->VtfOpt.PixelFormat) && layergroups.cur->VtfOpt.BumpType != NOT_BUMP)
+		record_error(_("#unknown_error"),GIMP_PDB_EXECUTION_ERROR); // if nothing more specific was
+	else if ( vtf_format_is_compressed(format_index) && layergroups.cur->VtfOpt.BumpType != NOT_BUMP)
 	{
 		// Passing to the console is crap because it is not visible by default, but until there is a
 		// way to specify that you want a GUI message to appear without requiring user interaction
@@ -708,24 +754,6 @@ void create_vtf(gint32 layer_group, gboolean is_main_group)
 		gimp_message(_("#compressed_bump_warning"));
 		gimp_message_set_handler(GIMP_MESSAGE_BOX);
 	}
-	
-	// Free memory
-	for(i=0; i < layergroups.cur->children_count; i++)
-		g_free(rbgaImages[i]);
-	g_free(rbgaImages);
-
-	// restore image colour type	
-	switch( img_type )
-	{
-	case GIMP_RGB:
-		break;
-	case GIMP_INDEXED:
-		gimp_image_convert_indexed(image_ID,GIMP_NO_DITHER,GIMP_MAKE_PALETTE,colourmap_size,FALSE,FALSE,"null");
-		break;
-	case GIMP_GRAY:
-		gimp_image_convert_grayscale(image_ID);
-		break;
-	}
 }
 
 /*
@@ -746,6 +774,8 @@ GtkWidget*	use_layer_groups_button;
 
 const gchar*	BumpRadioLabels[] = { "#not_bump", "#bump_flag", "#ssbump_flag" };
 const gchar*	VtfVersions[] = { "7.2", "7.3", "7.4", "7.5" };
+const gchar*	DxtQualityLabels[] = { "#dxt_quality_fast", "#dxt_quality_normal", "#dxt_quality_high" };
+const gchar*	MipFilterLabels[] = { "#mip_filter_box", "#mip_filter_kaiser", "#mip_filter_lanczos", "#mip_filter_mitchell" };
 
 static void update_lod_availability()
 {
@@ -753,6 +783,18 @@ static void update_lod_availability()
 	gtk_widget_set_sensitive(layergroups.cur->UI.LODControlHBox,layergroups.cur->VtfOpt.Version >= 3 && layergroups.cur->VtfOpt.WithMips && !layergroups.cur->VtfOpt.NoLOD);
 }
 
+static void update_mip_availability()
+{
+	gtk_widget_set_sensitive(layergroups.cur->UI.MipFilterHBox,layergroups.cur->VtfOpt.WithMips);
+	gtk_widget_set_sensitive(layergroups.cur->UI.MipGamma,layergroups.cur->VtfOpt.WithMips && layergroups.cur->VtfOpt.BumpType == NOT_BUMP);
+	gtk_widget_set_sensitive(layergroups.cur->UI.MipToksvig,layergroups.cur->VtfOpt.WithMips && layergroups.cur->VtfOpt.BumpType == BUMP);
+}
+
+static void update_dxt_quality_availability()
+{
+	gtk_widget_set_sensitive(layergroups.cur->UI.DxtQuality,vtf_format_is_compressed(select_vtf_format_index(&layergroups.cur->VtfOpt)));
+}
+
 static void set_layer_alpha_active(gboolean active)
 {
 	gtk_widget_set_sensitive(layergroups.cur->UI.AlphaLayerLabel, active );
@@ -779,6 +821,7 @@ void select_compression(GtkTreeSelection* selection, gpointer user_data)
 		{
 			layergroups.cur->VtfOpt.PixelFormat = gtk_tree_path_get_indices( gtk_tree_model_get_path(model,&iter) )[0];
 			update_alpha_layer_availability();
+			update_dxt_quality_availability();
 
 			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(layergroups.cur->UI.Compress),vtf_format_is_compressed(layergroups.cur->VtfOpt.PixelFormat));
 			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(layergroups.cur->UI.WithAlpha),vtf_format_has_alpha(layergroups.cur->VtfOpt.PixelFormat));
@@ -830,6 +873,17 @@ static void choose_simple_alpha(GtkCheckButton* chbx, gpointer user_data)
 	update_alpha_layer_availability();
 }
 
+static void choose_simple_compression(GtkCheckButton* chbx, gpointer user_data)
+{
+	layergroups.cur->VtfOpt.Compress = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chbx));
+	update_dxt_quality_availability();
+}
+
+static void choose_dxt_quality(GtkComboBox* combo, gpointer user_data)
+{
+	layergroups.cur->VtfOpt.DxtQuality = gtk_combo_box_get_active(combo);
+}
+
 static void choose_vtf_version(GtkComboBox* combo, gpointer user_data)
 {
 	layergroups.cur->VtfOpt.Version = gtk_combo_box_get_active(GTK_COMBO_BOX(combo)) + 2;
@@ -839,6 +893,12 @@ static void choose_vtf_version(GtkComboBox* combo, gpointer user_data)
 static void choose_bump_type(GtkComboBox* combo, gpointer user_data)
 {
 	layergroups.cur->VtfOpt.BumpType = (VtfBumpType_t)gtk_combo_box_get_active(combo);
+	update_mip_availability();
+}
+
+static void choose_mip_filter(GtkComboBox* combo, gpointer user_data)
+{
+	layergroups.cur->VtfOpt.MipFilter = gtk_combo_box_get_active(combo);
 }
 
 static void change_format_select_mode(GtkToggleButton* toggle, gpointer user_data)
@@ -893,6 +953,7 @@ static void change_format_select_mode(GtkToggleButton* toggle, gpointer user_dat
 	layergroups.cur = _cur;
 
 	update_alpha_layer_availability();
+	update_dxt_quality_availability();
 }
 
 static void change_frame_use(GtkWidget* combo, gpointer user_data)
@@ -904,6 +965,7 @@ static void change_withmips(GtkToggleButton* toggle, gpointer user_data)
 {
 	layergroups.cur->VtfOpt.WithMips = gtk_toggle_button_get_active(toggle);
 	update_lod_availability();
+	update_mip_availability();
 }
 
 static void change_nolod(GtkToggleButton* toggle, gpointer user_data)
@@ -943,14 +1005,6 @@ static void toggle_export(GtkToggleButton *togglebutton, gpointer user_data )
 	gtk_widget_set_sensitive(LG->UI.Icon, LG->VtfOpt.Enabled);
 }
 
-#ifdef _WIN32
-	#define HELP_FUNC vtf_help
-	void vtf_help(const gchar* help_id, gpointer help_data);
-#else
-	#define HELP_FUNC gimp_standard_help_func // no good way of opening an arbitrary URL outside Windows
-#endif
-
-
 // GTK is horrid
 static gboolean show_options(const gint32 image_ID)
 {
@@ -1206,6 +1260,15 @@ static gboolean show_options(const gint32 image_ID)
 		gtk_combo_box_set_active(GTK_COMBO_BOX(Tab->VtfVersion),(layergroups.cur->VtfOpt.Version) - 2); // bit of a hack really!
 		gtk_widget_show(Tab->VtfVersion);
 		gtk_container_add (GTK_CONTAINER (cur_hbox), Tab->VtfVersion);
+
+		// DXT quality
+		Tab->DxtQuality = gtk_combo_box_new_text();
+		gtk_widget_set_tooltip_markup(Tab->DxtQuality,_("#dxt_quality_tip"));
+		for (i=0; i < DXT_QUALITY_COUNT; i++)
+			gtk_combo_box_append_text(GTK_COMBO_BOX(Tab->DxtQuality),_(DxtQualityLabels[i]));
+		gtk_combo_box_set_active(GTK_COMBO_BOX(Tab->DxtQuality),layergroups.cur->VtfOpt.DxtQuality);
+		gtk_widget_show(Tab->DxtQuality);
+		gtk_container_add (GTK_CONTAINER (cur_hbox), Tab->DxtQuality);
 			
 		// Advanced format selection			
 			
@@ -1319,6 +1382,39 @@ static gboolean show_options(const gint32 image_ID)
 			
 		gtk_container_add (GTK_CONTAINER (Tab->LODControlHBox), Tab->LODControlSlider);
 		gtk_widget_show(Tab->LODControlSlider);
+
+		cur_hbox = gtk_hbox_new(FALSE,3);
+		gtk_container_add (GTK_CONTAINER (column_vbox), cur_hbox);
+		gtk_widget_show(cur_hbox);
+
+		// Mip filter
+		Tab->MipFilterHBox = gtk_hbox_new(FALSE,3);
+		gtk_container_add (GTK_CONTAINER (cur_hbox), Tab->MipFilterHBox);
+		gtk_widget_set_tooltip_markup(Tab->MipFilterHBox,_("#mip_filter_tip"));
+		gtk_widget_show(Tab->MipFilterHBox);
+
+		cur_label = gtk_label_new(_("#mip_filter_label"));
+		gtk_box_pack_start(GTK_BOX(Tab->MipFilterHBox),cur_label,FALSE,TRUE,2);
+		gtk_widget_show(cur_label);
+
+		Tab->MipFilter = gtk_combo_box_new_text();
+		for (i=0; i < MIP_FILTER_COUNT; i++)
+			gtk_combo_box_append_text(GTK_COMBO_BOX(Tab->MipFilter),_(MipFilterLabels[i]));
+		gtk_combo_box_set_active(GTK_COMBO_BOX(Tab->MipFilter),layergroups.cur->VtfOpt.MipFilter);
+		gtk_widget_show(Tab->MipFilter);
+		gtk_container_add (GTK_CONTAINER (Tab->MipFilterHBox), Tab->MipFilter);
+
+		Tab->MipGamma = gtk_check_button_new_with_mnemonic(_("#mip_gamma_label"));
+		gtk_widget_set_tooltip_markup(Tab->MipGamma,_("#mip_gamma_tip"));
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (Tab->MipGamma), layergroups.cur->VtfOpt.MipGamma);
+		gtk_widget_show(Tab->MipGamma);
+		gtk_container_add (GTK_CONTAINER (Tab->MipFilterHBox), Tab->MipGamma);
+
+		Tab->MipToksvig = gtk_check_button_new_with_mnemonic(_("#mip_toksvig_label"));
+		gtk_widget_set_tooltip_markup(Tab->MipToksvig,_("#mip_toksvig_tip"));
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (Tab->MipToksvig), layergroups.cur->VtfOpt.MipToksvig);
+		gtk_widget_show(Tab->MipToksvig);
+		gtk_container_add (GTK_CONTAINER (Tab->MipFilterHBox), Tab->MipToksvig);
 	
 		cur_separator = gtk_hseparator_new();
 		gtk_widget_show(cur_separator);
@@ -1364,14 +1460,18 @@ static gboolean show_options(const gint32 image_ID)
 
 		g_signal_connect(Tab->ExportCheckbox,		"toggled",		G_CALLBACK(toggle_export),				layergroups.cur);
 		g_signal_connect(Tab->LayerUseCombo,		"changed",		G_CALLBACK(change_frame_use),			NULL);
-		g_signal_connect(Tab->Compress,				"toggled",		G_CALLBACK(gimp_toggle_button_update),	&layergroups.cur->VtfOpt.Compress);
+		g_signal_connect(Tab->Compress,				"toggled",		G_CALLBACK(choose_simple_compression),	NULL);
 		g_signal_connect(Tab->WithAlpha,			"toggled",		G_CALLBACK(choose_simple_alpha),		NULL);
 		g_signal_connect(Tab->AdvancedToggle,		"toggled",		G_CALLBACK(change_format_select_mode),	NULL);
 		g_signal_connect(Tab->VtfVersion,			"changed",		G_CALLBACK(choose_vtf_version),			NULL);
+		g_signal_connect(Tab->DxtQuality,			"changed",		G_CALLBACK(choose_dxt_quality),			NULL);
 		g_signal_connect(Tab->DoMips,				"toggled",		G_CALLBACK(change_withmips),			NULL);		
 		g_signal_connect(Tab->NoLOD,				"toggled",		G_CALLBACK(change_nolod),				NULL);
 		g_signal_connect(Tab->Clamp,				"toggled",		G_CALLBACK(gimp_toggle_button_update),	&layergroups.cur->VtfOpt.Clamp);
 		g_signal_connect(Tab->BumpType,				"changed",		G_CALLBACK(choose_bump_type),			NULL);
+		g_signal_connect(Tab->MipFilter,			"changed",		G_CALLBACK(choose_mip_filter),			NULL);
+		g_signal_connect(Tab->MipGamma,				"toggled",		G_CALLBACK(gimp_toggle_button_update),	&layergroups.cur->VtfOpt.MipGamma);
+		g_signal_connect(Tab->MipToksvig,			"toggled",		G_CALLBACK(gimp_toggle_button_update),	&layergroups.cur->VtfOpt.MipToksvig);
 		g_signal_connect(Tab->LODControlSlider,		"format-value",	G_CALLBACK(change_lod_control),			layergroups.cur);
 		g_signal_connect(Tab->AlphaLayerEnable,		"toggled",		G_CALLBACK(toggle_alpha_layer),			NULL);
 		g_signal_connect(Tab->AlphaLayerCombo,		"changed",		G_CALLBACK(choose_alpha_layer),			NULL);
@@ -1384,6 +1484,7 @@ static gboolean show_options(const gint32 image_ID)
 		
 		// Configure feature availability
 		update_lod_availability();
+		update_mip_availability();
 		update_alpha_layer_availability();
 		change_format_select_mode(GTK_TOGGLE_BUTTON(Tab->AdvancedToggle),NULL);
 		toggle_export(GTK_TOGGLE_BUTTON(Tab->ExportCheckbox),layergroups.cur);
@@ -1440,23 +1541,262 @@ gchar* vtf_get_settings_path()
 	return settings_path;
 }
 
+// .vtf-settings field IDs, which must never be reused or renumbered
+enum
+{
+	VTF_FIELD_ENABLED = 1,
+	VTF_FIELD_VERSION,
+	VTF_FIELD_ADVANCED_SETUP,
+	VTF_FIELD_WITH_ALPHA,
+	VTF_FIELD_COMPRESS,
+	VTF_FIELD_PIXEL_FORMAT,
+	VTF_FIELD_CLAMP,
+	VTF_FIELD_NO_LOD,
+	VTF_FIELD_WITH_MIPS,
+	VTF_FIELD_BUMP_TYPE,
+	VTF_FIELD_LAYER_USE,
+	VTF_FIELD_ALPHA_LAYER_TATTOO,
+	VTF_FIELD_GENERAL_FLAGS,
+	VTF_FIELD_LOD_CONTROL_U,
+	VTF_FIELD_LOD_CONTROL_V,
+	VTF_FIELD_DXT_QUALITY,
+	VTF_FIELD_MIP_FILTER,
+	VTF_FIELD_MIP_GAMMA,
+	VTF_FIELD_MIP_TOKSVIG,
+
+	VTF_FIELD_EXPORT_HASH = 0x100	// options hash, file size, file time, then image hashes; all 64-bit
+};
+
+typedef struct VtfOptionField
+{
+	guint16	id;
+	glong	offset;
+	guint	size;
+} VtfOptionField_t;
+
+#define VTF_OPTION_FIELD(id,member) { id, G_STRUCT_OFFSET(VtfSaveOptions_t,member), sizeof(((VtfSaveOptions_t*)0)->member) }
+
+// New options need a new field here too
+static const VtfOptionField_t vtf_option_fields[] = {
+	VTF_OPTION_FIELD(VTF_FIELD_ENABLED,				Enabled),
+	VTF_OPTION_FIELD(VTF_FIELD_VERSION,				Version),
+	VTF_OPTION_FIELD(VTF_FIELD_ADVANCED_SETUP,		AdvancedSetup),
+	VTF_OPTION_FIELD(VTF_FIELD_WITH_ALPHA,			WithAlpha),
+	VTF_OPTION_FIELD(VTF_FIELD_COMPRESS,			Compress),
+	VTF_OPTION_FIELD(VTF_FIELD_PIXEL_FORMAT,		PixelFormat),
+	VTF_OPTION_FIELD(VTF_FIELD_CLAMP,				Clamp),
+	VTF_OPTION_FIELD(VTF_FIELD_NO_LOD,				NoLOD),
+	VTF_OPTION_FIELD(VTF_FIELD_WITH_MIPS,			WithMips),
+	VTF_OPTION_FIELD(VTF_FIELD_BUMP_TYPE,			BumpType),
+	VTF_OPTION_FIELD(VTF_FIELD_LAYER_USE,			LayerUse),
+	VTF_OPTION_FIELD(VTF_FIELD_ALPHA_LAYER_TATTOO,	AlphaLayerTattoo),
+	VTF_OPTION_FIELD(VTF_FIELD_GENERAL_FLAGS,		GeneralFlags),
+	VTF_OPTION_FIELD(VTF_FIELD_LOD_CONTROL_U,		LodControlU),
+	VTF_OPTION_FIELD(VTF_FIELD_LOD_CONTROL_V,		LodControlV),
+	VTF_OPTION_FIELD(VTF_FIELD_DXT_QUALITY,			DxtQuality),
+	VTF_OPTION_FIELD(VTF_FIELD_MIP_FILTER,			MipFilter),
+	VTF_OPTION_FIELD(VTF_FIELD_MIP_GAMMA,			MipGamma),
+	VTF_OPTION_FIELD(VTF_FIELD_MIP_TOKSVIG,			MipToksvig),
+};
+
+static gint64 vtf_option_get(const VtfSaveOptions_t* opt, const VtfOptionField_t* field)
+{
+	const guint8* member = (const guint8*)opt + field->offset;
+
+	switch (field->size)
+	{
+	case 1:		return *(const gint8*)member;
+	case 2:		return *(const gint16*)member;
+	default:	return *(const gint32*)member;
+	}
+}
+
+static void vtf_option_set(VtfSaveOptions_t* opt, const VtfOptionField_t* field, gint64 value)
+{
+	guint8* member = (guint8*)opt + field->offset;
+
+	switch (field->size)
+	{
+	case 1:		*(guint8*)member = (guint8)value; break;
+	case 2:		*(guint16*)member = (guint16)value; break;
+	default:	*(guint32*)member = (guint32)value; break;
+	}
+}
+
+static gboolean vtf_option_field_known(guint16 id)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_option_fields); i++)
+		if (vtf_option_fields[i].id == id)
+			return TRUE;
+	return FALSE;
+}
+
+// Over the existing options, so that anything missing keeps its current value
+static void vtf_read_options(const VtfSettings_t* settings, const VtfSettingsBlock_t* block, VtfSaveOptions_t* opt)
+{
+	gint64	value;
+	guint	i;
+
+	if (settings->version == 1)
+	{
+		memcpy(opt,block->data,MIN(block->size,sizeof(VtfSaveOptions_t)));
+		return;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_option_fields); i++)
+		if ( vtf_settings_get_int(block,vtf_option_fields[i].id,&value) )
+			vtf_option_set(opt,&vtf_option_fields[i],value);
+}
+
+static void vtf_write_options(VtfSettingsWriter_t* writer, const VtfSaveOptions_t* opt)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_option_fields); i++)
+		vtf_settings_add_int(writer,vtf_option_fields[i].id,vtf_option_get(opt,&vtf_option_fields[i]),vtf_option_fields[i].size);
+}
+
+static void vtf_read_export_hash(const VtfSettingsBlock_t* block)
+{
+	VtfExportHash_t*	hash = &layergroups.cur->export_hash;
+	gsize				pos = 0;
+	guint16				id;
+	const guint8*		value;
+	guint32				size, i;
+
+	while ( vtf_settings_next_field(block,&pos,&id,&value,&size) )
+	{
+		if ( id != VTF_FIELD_EXPORT_HASH || size <= 24 || (size - 24) % sizeof(guint64) != 0 )
+			continue;
+
+		layergroups.cur->image_hashes = g_try_new(guint64,(size - 24) / sizeof(guint64));
+		if (!layergroups.cur->image_hashes)
+			return;
+
+		hash->num_images = (size - 24) / sizeof(guint64);
+		hash->options = vtf_settings_read_u64(value);
+		hash->file_size = (gint64)vtf_settings_read_u64(value + 8);
+		hash->file_mtime = (gint64)vtf_settings_read_u64(value + 16);
+		for (i = 0; i < hash->num_images; i++)
+			layergroups.cur->image_hashes[i] = vtf_settings_read_u64(value + 24 + i * sizeof(guint64));
+		return;
+	}
+}
+
+static void vtf_write_export_hash(VtfSettingsWriter_t* writer)
+{
+	const VtfExportHash_t*	hash = &layergroups.cur->export_hash;
+	guint32					size = 24 + hash->num_images * sizeof(guint64);
+	guint8*					value;
+	guint32					i;
+
+	if (!hash->num_images)
+		return;
+
+	value = g_try_new(guint8,size);
+	if (!value)
+		return; // only an optimisation
+
+	vtf_settings_write_u64(value,hash->options);
+	vtf_settings_write_u64(value + 8,(guint64)hash->file_size);
+	vtf_settings_write_u64(value + 16,(guint64)hash->file_mtime);
+	for (i = 0; i < hash->num_images; i++)
+		vtf_settings_write_u64(value + 24 + i * sizeof(guint64),layergroups.cur->image_hashes[i]);
+	vtf_settings_add_field(writer,VTF_FIELD_EXPORT_HASH,value,size);
+	g_free(value);
+}
+
+// Writes every group's options and export hash. Scripts don't change the saved options, so unless 'options'
+// is TRUE they are copied from the old file instead. Fields from newer versions of the plug-in are kept.
+static void vtf_write_settings(gboolean options)
+{
+	gchar*						settings_path = vtf_get_settings_path();
+	VtfSettings_t				old;
+	VtfSettingsStatus_t			status;
+	gboolean					have_old;
+	gchar*						backup_path;
+	const VtfSettingsBlock_t*	block;
+	VtfSettingsWriter_t			writer;
+	VtfSaveOptions_t			opt;
+	gsize						pos;
+	guint16						id;
+	const guint8*				value;
+	guint32						size;
+
+	if (!settings_path)
+		return;
+
+	status = vtf_settings_read(&old,settings_path);
+	have_old = status == VTF_SETTINGS_READ;
+
+	// A newer plug-in's file would lose everything this one doesn't understand, so it is left alone. A damaged
+	// one is moved aside, in case it can be rescued.
+	if (status == VTF_SETTINGS_NEWER)
+	{
+		g_free(settings_path);
+		return;
+	}
+	if (status == VTF_SETTINGS_DAMAGED)
+	{
+		backup_path = g_strconcat(settings_path,".bak",NULL);
+		g_remove(backup_path);
+		if ( g_rename(settings_path,backup_path) != 0 )
+		{
+			g_free(backup_path);
+			g_free(settings_path);
+			return;
+		}
+		g_free(backup_path);
+	}
+
+	vtf_settings_writer_init(&writer);
+	for (LAYERGROUPS_ITERATE)
+	{
+		block = have_old ? vtf_settings_find(&old,vtf_get_data_tattoo(TRUE)) : NULL;
+
+		vtf_settings_begin_block(&writer,vtf_get_data_tattoo(TRUE));
+
+		if (options)
+			vtf_write_options(&writer,&layergroups.cur->VtfOpt);
+		else if (block && old.version == 1)
+		{
+			memcpy(&opt,&DefaultSaveOptions,sizeof(VtfSaveOptions_t));
+			vtf_read_options(&old,block,&opt);
+			vtf_write_options(&writer,&opt);
+		}
+
+		for (pos = 0; block && old.version > 1 && vtf_settings_next_field(block,&pos,&id,&value,&size); )
+			if ( id != VTF_FIELD_EXPORT_HASH && !(options && vtf_option_field_known(id)) )
+				vtf_settings_add_field(&writer,id,value,size);
+
+		vtf_write_export_hash(&writer);
+	}
+
+	vtf_settings_write(&writer,settings_path);
+
+	if (have_old)
+		vtf_settings_free(&old);
+	g_free(settings_path);
+}
+
 gboolean vtf_get_data()
 {
-	FILE* settings = 0;
-	gchar* settings_path = vtf_get_settings_path();
+	VtfSettings_t	settings;
+	gboolean		have_settings = FALSE;
+	gchar*			settings_path = vtf_get_settings_path();
 
+	// Read in one go, with each group's settings then found by its tattoo
 	if (settings_path)
 	{
-#ifdef _WIN32
-		fopen_s(&settings,settings_path,"rb");
-#else
-		settings = fopen(settings_path,"rb");
-#endif
+		have_settings = vtf_settings_read(&settings,settings_path) == VTF_SETTINGS_READ;
 		g_free(settings_path);
 	}
 
 	for(LAYERGROUPS_ITERATE)
 	{
+		const VtfSettingsBlock_t* block = have_settings ? vtf_settings_find(&settings,vtf_get_data_tattoo(TRUE)) : NULL;
 		gchar* identifier;
 		gboolean result;
 
@@ -1464,36 +1804,12 @@ gboolean vtf_get_data()
 		result = gimp_get_data(identifier,&layergroups.cur->VtfOpt);
 		g_free(identifier);
 
-		if (!result)
+		if (block)
 		{
-			if (settings)
-			{
-				fseek(settings,0,SEEK_SET);
-				while( !feof(settings) && !ferror(settings) )
-				{
-					gint32	candidate_tattoo;
-					guint	data_size;
-					
-					fread(&candidate_tattoo,sizeof(gint32),1,settings);
-					fread(&data_size,sizeof(guint),1,settings);
-					
-					if ( candidate_tattoo == vtf_get_data_tattoo(TRUE) )
-					{
-						result = (gboolean)fread(&layergroups.cur->VtfOpt,MIN(data_size,sizeof(VtfSaveOptions_t)),1,settings);
-						break;
-					}
-					else
-					{
-						if (data_size)
-						{
-							fseek(settings,data_size-1,SEEK_CUR);
-							fgetc(settings); // generate eof/error flag...surely this isn't right
-						}
-						else
-							break;
-					}
-				}
-			}
+			if (!result)
+				vtf_read_options(&settings,block,&layergroups.cur->VtfOpt);
+			if (settings.version > 1)
+				vtf_read_export_hash(block);
 		}
 
 		if ( fix_alpha_layer(&layergroups.cur->VtfOpt,image_ID) )
@@ -1503,50 +1819,26 @@ gboolean vtf_get_data()
 		}
 	}
 
-	if (settings)
-		fclose(settings);
+	if (have_settings)
+		vtf_settings_free(&settings);
 	return TRUE;
 }
 
 gboolean vtf_set_data()
 {
-	FILE* settings = 0;
-	gchar* settings_path = vtf_get_settings_path();
-
-	if (settings_path)
-	{		
-#ifdef _WIN32
-		fopen_s(&settings,settings_path,"wb");
-#else
-		settings = fopen(settings_path,"wb");
-#endif
-		g_free(settings_path);
-	}
-
 	for(LAYERGROUPS_ITERATE)
 	{
-		gchar* identifier;
-		gboolean result;
-
-		identifier = vtf_get_data_id(FALSE);
-		result = gimp_set_data(identifier, &layergroups.cur->VtfOpt, sizeof(VtfSaveOptions_t));
-
+		gchar* identifier = vtf_get_data_id(FALSE);
+		gimp_set_data(identifier, &layergroups.cur->VtfOpt, sizeof(VtfSaveOptions_t));
 		g_free(identifier);
-
-		if (settings)
-		{
-			gint32	tattoo;
-			guint	data_size = sizeof(VtfSaveOptions_t);
-			
-			tattoo = vtf_get_data_tattoo(TRUE);
-
-			fwrite(&tattoo,sizeof(gint32),1,settings);
-			fwrite(&data_size,sizeof(guint),1,settings);
-			fwrite(&layergroups.cur->VtfOpt,data_size,1,settings);
-		}
 	}
-	
-	if (settings)
-		fclose(settings);
+
+	vtf_write_settings(TRUE);
 	return TRUE;
 }
+
+// Updates the export hashes in the settings file, leaving the saved options as they were
+void vtf_set_export_hashes()
+{
+	vtf_write_settings(FALSE);
+}
@@ -0,0 +1,275 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#include "file-vtf-settings.h"
+
+#include <string.h>
+
+#define SETTINGS_HEADER_SIZE		12
+#define SETTINGS_INDEX_ENTRY_SIZE	12
+#define SETTINGS_FIELD_HEADER_SIZE	6
+
+static guint16 read_u16(const guint8* p)
+{
+	return (guint16)(p[0] | (p[1] << 8));
+}
+
+static guint32 read_u32(const guint8* p)
+{
+	return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static void write_u32(guint8* p, guint32 value)
+{
+	p[0] = value & 0xFF;
+	p[1] = (value >> 8) & 0xFF;
+	p[2] = (value >> 16) & 0xFF;
+	p[3] = value >> 24;
+}
+
+static void add_block(VtfSettings_t* settings, gint32 tattoo, const gchar* data, gsize size)
+{
+	VtfSettingsBlock_t* block = g_new(VtfSettingsBlock_t,1);
+
+	block->data = (const guint8*)data;
+	block->size = size;
+
+	// The first block for a tattoo wins, as it did when the file was searched from the start
+	if ( g_hash_table_lookup(settings->blocks,GINT_TO_POINTER(tattoo)) )
+		g_free(block);
+	else
+		g_hash_table_insert(settings->blocks,GINT_TO_POINTER(tattoo),block);
+}
+
+// Records of a gint32 tattoo, a guint size, then that many bytes, in native byte order
+static gboolean read_version_1(VtfSettings_t* settings, gsize length)
+{
+	gsize	pos = 0;
+	gint32	tattoo;
+	guint	size;
+
+	while ( length - pos >= sizeof(gint32) + sizeof(guint) )
+	{
+		memcpy(&tattoo,settings->data + pos,sizeof(gint32));
+		memcpy(&size,settings->data + pos + sizeof(gint32),sizeof(guint));
+		pos += sizeof(gint32) + sizeof(guint);
+
+		if (size > length - pos)
+			break;
+
+		add_block(settings,tattoo,settings->data + pos,size);
+		pos += size;
+	}
+	return TRUE;
+}
+
+static gboolean read_version_2(VtfSettings_t* settings, gsize length)
+{
+	const guint8*	data = (const guint8*)settings->data;
+	guint32			count = read_u32(data + 8);
+	guint32			i, offset, size;
+
+	if ( count > (length - SETTINGS_HEADER_SIZE) / SETTINGS_INDEX_ENTRY_SIZE )
+		return FALSE;
+
+	for (i = 0; i < count; i++)
+	{
+		const guint8* entry = data + SETTINGS_HEADER_SIZE + i * SETTINGS_INDEX_ENTRY_SIZE;
+
+		offset = read_u32(entry + 4);
+		size = read_u32(entry + 8);
+		if ( offset > length || size > length - offset )
+			return FALSE;
+
+		add_block(settings,(gint32)read_u32(entry),settings->data + offset,size);
+	}
+	return TRUE;
+}
+
+VtfSettingsStatus_t vtf_settings_read(VtfSettings_t* settings, const gchar* path)
+{
+	gsize				length;
+	VtfSettingsStatus_t	result;
+
+	memset(settings,0,sizeof(VtfSettings_t));
+
+	if ( !g_file_get_contents(path,&settings->data,&length,NULL) )
+		return g_file_test(path,G_FILE_TEST_EXISTS) ? VTF_SETTINGS_DAMAGED : VTF_SETTINGS_MISSING;
+
+	settings->blocks = g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,g_free);
+
+	if ( length >= SETTINGS_HEADER_SIZE && memcmp(settings->data,VTF_SETTINGS_MAGIC,4) == 0 )
+	{
+		// Newer versions would have changed the layout, not just added fields
+		settings->version = read_u32((const guint8*)settings->data + 4);
+		if (settings->version > VTF_SETTINGS_VERSION)
+			result = VTF_SETTINGS_NEWER;
+		else
+			result = settings->version == VTF_SETTINGS_VERSION && read_version_2(settings,length) ? VTF_SETTINGS_READ : VTF_SETTINGS_DAMAGED;
+	}
+	else
+	{
+		settings->version = 1;
+		result = read_version_1(settings,length) ? VTF_SETTINGS_READ : VTF_SETTINGS_DAMAGED;
+	}
+
+	if (result != VTF_SETTINGS_READ)
+		vtf_settings_free(settings);
+	return result;
+}
+
+void vtf_settings_free(VtfSettings_t* settings)
+{
+	if (settings->blocks)
+		g_hash_table_destroy(settings->blocks);
+	g_free(settings->data);
+	memset(settings,0,sizeof(VtfSettings_t));
+}
+
+const VtfSettingsBlock_t* vtf_settings_find(const VtfSettings_t* settings, gint32 tattoo)
+{
+	return (const VtfSettingsBlock_t*)g_hash_table_lookup(settings->blocks,GINT_TO_POINTER(tattoo));
+}
+
+gboolean vtf_settings_next_field(const VtfSettingsBlock_t* block, gsize* pos, guint16* id, const guint8** value, guint32* size)
+{
+	if ( *pos > block->size || block->size - *pos < SETTINGS_FIELD_HEADER_SIZE )
+		return FALSE;
+
+	*id = read_u16(block->data + *pos);
+	*size = read_u32(block->data + *pos + 2);
+	if ( *size > block->size - *pos - SETTINGS_FIELD_HEADER_SIZE )
+		return FALSE;
+
+	*value = block->data + *pos + SETTINGS_FIELD_HEADER_SIZE;
+	*pos += SETTINGS_FIELD_HEADER_SIZE + *size;
+	return TRUE;
+}
+
+gboolean vtf_settings_get_int(const VtfSettingsBlock_t* block, guint16 id, gint64* value)
+{
+	gsize			pos = 0;
+	guint16			field_id;
+	const guint8*	field;
+	guint32			size, i;
+	guint64			v = 0;
+
+	while ( vtf_settings_next_field(block,&pos,&field_id,&field,&size) )
+	{
+		if (field_id != id)
+			continue;
+
+		if (size != 1 && size != 2 && size != 4 && size != 8)
+			return FALSE;
+
+		for (i = size; i-- > 0; )
+			v = (v << 8) | field[i];
+
+		// Sign-extend, so that negative values survive a change of size
+		if (size < 8 && (field[size - 1] & 0x80))
+			v |= ~(guint64)0 << (size * 8);
+
+		*value = (gint64)v;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+guint64 vtf_settings_read_u64(const guint8* p)
+{
+	return read_u32(p) | ((guint64)read_u32(p + 4) << 32);
+}
+
+void vtf_settings_write_u64(guint8* p, guint64 value)
+{
+	write_u32(p,(guint32)(value & 0xFFFFFFFF));
+	write_u32(p + 4,(guint32)(value >> 32));
+}
+
+void vtf_settings_writer_init(VtfSettingsWriter_t* writer)
+{
+	writer->index = g_byte_array_new();
+	writer->blocks = g_byte_array_new();
+	writer->count = 0;
+}
+
+// Offsets are from the start of the blocks until the file is written
+void vtf_settings_begin_block(VtfSettingsWriter_t* writer, gint32 tattoo)
+{
+	guint8 entry[SETTINGS_INDEX_ENTRY_SIZE];
+
+	write_u32(entry,(guint32)tattoo);
+	write_u32(entry + 4,writer->blocks->len);
+	write_u32(entry + 8,0);
+	g_byte_array_append(writer->index,entry,SETTINGS_INDEX_ENTRY_SIZE);
+	writer->count++;
+}
+
+void vtf_settings_add_field(VtfSettingsWriter_t* writer, guint16 id, const void* value, guint32 size)
+{
+	guint8*	entry;
+	guint8	header[SETTINGS_FIELD_HEADER_SIZE];
+
+	g_assert(writer->count);
+
+	header[0] = id & 0xFF;
+	header[1] = id >> 8;
+	write_u32(header + 2,size);
+	g_byte_array_append(writer->blocks,header,SETTINGS_FIELD_HEADER_SIZE);
+	g_byte_array_append(writer->blocks,(const guint8*)value,size);
+
+	entry = writer->index->data + (writer->count - 1) * SETTINGS_INDEX_ENTRY_SIZE;
+	write_u32(entry + 8,writer->blocks->len - read_u32(entry + 4));
+}
+
+void vtf_settings_add_int(VtfSettingsWriter_t* writer, guint16 id, gint64 value, guint size)
+{
+	guint8	bytes[8];
+	guint	i;
+
+	g_assert(size == 1 || size == 2 || size == 4 || size == 8);
+
+	for (i = 0; i < size; i++)
+		bytes[i] = (guint8)(((guint64)value >> (i * 8)) & 0xFF);
+	vtf_settings_add_field(writer,id,bytes,size);
+}
+
+gboolean vtf_settings_write(VtfSettingsWriter_t* writer, const gchar* path)
+{
+	GByteArray*	file = g_byte_array_new();
+	guint8		header[SETTINGS_HEADER_SIZE];
+	guint32		data_offset = SETTINGS_HEADER_SIZE + writer->index->len;
+	guint32		i;
+	gboolean	result;
+
+	memcpy(header,VTF_SETTINGS_MAGIC,4);
+	write_u32(header + 4,VTF_SETTINGS_VERSION);
+	write_u32(header + 8,writer->count);
+
+	for (i = 0; i < writer->count; i++)
+	{
+		guint8* entry = writer->index->data + i * SETTINGS_INDEX_ENTRY_SIZE;
+		write_u32(entry + 4,read_u32(entry + 4) + data_offset);
+	}
+
+	g_byte_array_append(file,header,SETTINGS_HEADER_SIZE);
+	g_byte_array_append(file,writer->index->data,writer->index->len);
+	g_byte_array_append(file,writer->blocks->data,writer->blocks->len);
+
+	// Written to a temporary file and renamed over the old one
+	result = g_file_set_contents(path,(const gchar*)file->data,file->len,NULL);
+
+	g_byte_array_free(file,TRUE);
+	g_byte_array_free(writer->index,TRUE);
+	g_byte_array_free(writer->blocks,TRUE);
+	writer->index = writer->blocks = NULL;
+	return result;
+}
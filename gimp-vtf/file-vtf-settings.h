@@ -0,0 +1,85 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_SETTINGS_H
+#define FILE_VTF_SETTINGS_H
+
+#include <glib.h>
+
+// The .vtf-settings file kept next to an XCF, which holds a block of fields for each layer group. The file is
+// read in one go and its index put in a hash table, so each group's block is found in constant time.
+//
+// Layout, all little-endian:
+//   "VTFS", guint32 version, guint32 block count
+//   index: gint32 tattoo, guint32 offset from the start of the file, guint32 size; for each block
+//   blocks: a series of fields, each a guint16 ID, a guint32 size, then the value
+//
+// Fields which aren't recognised are skipped, so fields can be added without changing the version. Integer
+// fields can change size too, as long as their values still fit.
+
+#define VTF_SETTINGS_MAGIC		"VTFS"
+#define VTF_SETTINGS_VERSION	2 // 1 was a raw VtfSaveOptions_t for each group, with no header
+
+typedef struct VtfSettings
+{
+	guint32		version;	// 1 for files from older versions of the plug-in
+	gchar*		data;
+	GHashTable*	blocks;		// tattoo -> VtfSettingsBlock_t
+} VtfSettings_t;
+
+typedef struct VtfSettingsBlock
+{
+	const guint8*	data;
+	gsize			size;
+} VtfSettingsBlock_t;
+
+typedef enum VtfSettingsStatus
+{
+	VTF_SETTINGS_READ = 0,
+	VTF_SETTINGS_MISSING,
+	VTF_SETTINGS_NEWER,		// written by a newer plug-in with a layout this one doesn't know
+	VTF_SETTINGS_DAMAGED
+} VtfSettingsStatus_t;
+
+// 'settings' is only filled in if the file was read
+VtfSettingsStatus_t vtf_settings_read(VtfSettings_t* settings, const gchar* path);
+void vtf_settings_free(VtfSettings_t* settings);
+
+// NULL if the group has no settings. Version 1 blocks are the raw options struct, not fields.
+const VtfSettingsBlock_t* vtf_settings_find(const VtfSettings_t* settings, gint32 tattoo);
+
+// Steps through a block's fields. *pos starts at 0. FALSE at the end of the block, or if it is damaged.
+gboolean vtf_settings_next_field(const VtfSettingsBlock_t* block, gsize* pos, guint16* id, const guint8** value, guint32* size);
+
+// Integer fields of 1, 2, 4 or 8 bytes. FALSE if the block doesn't have the field, or it isn't an integer.
+gboolean vtf_settings_get_int(const VtfSettingsBlock_t* block, guint16 id, gint64* value);
+
+// For numbers inside fields with a layout of their own, which are little-endian too
+guint64 vtf_settings_read_u64(const guint8* p);
+void vtf_settings_write_u64(guint8* p, guint64 value);
+
+// Builds a settings file in memory, one block after another
+typedef struct VtfSettingsWriter
+{
+	GByteArray*	index;
+	GByteArray*	blocks;
+	guint32		count;
+} VtfSettingsWriter_t;
+
+void vtf_settings_writer_init(VtfSettingsWriter_t* writer);
+void vtf_settings_begin_block(VtfSettingsWriter_t* writer, gint32 tattoo);
+void vtf_settings_add_field(VtfSettingsWriter_t* writer, guint16 id, const void* value, guint32 size);
+void vtf_settings_add_int(VtfSettingsWriter_t* writer, guint16 id, gint64 value, guint size);
+
+// Replaces the file in one step, then frees the writer. FALSE if the file couldn't be written.
+gboolean vtf_settings_write(VtfSettingsWriter_t* writer, const gchar* path);
+
+#endif
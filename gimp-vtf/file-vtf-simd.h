@@ -0,0 +1,79 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+#ifndef FILE_VTF_SIMD_H
+#define FILE_VTF_SIMD_H
+
+#include <glib.h>
+
+// SSE2 is part of x64 and is the default instruction set of the v120 toolset for x86 too.
+// Everything else gets the plain C fallback, which must produce identical output.
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define VTF_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+#include <math.h>
+
+#ifdef _MSC_VER
+	#define VTF_INLINE static __inline
+#else
+	#define VTF_INLINE static inline
+#endif
+
+// A four-float vector: one RGBA pixel, or one XYZ + W point
+#ifdef VTF_SSE2
+
+typedef __m128 vtf_v4;
+
+#define v4_set(x,y,z,w)	_mm_setr_ps(x,y,z,w)
+#define v4_splat(x)		_mm_set1_ps(x)
+#define v4_zero()		_mm_setzero_ps()
+#define v4_load(p)		_mm_loadu_ps(p)
+#define v4_store(p,v)	_mm_storeu_ps(p,v)
+#define v4_add(a,b)		_mm_add_ps(a,b)
+#define v4_sub(a,b)		_mm_sub_ps(a,b)
+#define v4_mul(a,b)		_mm_mul_ps(a,b)
+#define v4_min(a,b)		_mm_min_ps(a,b)
+#define v4_max(a,b)		_mm_max_ps(a,b)
+#define v4_madd(a,b,c)	_mm_add_ps(_mm_mul_ps(a,b),c)
+#define v4_floor_pos(a)	_mm_cvtepi32_ps(_mm_cvttps_epi32(a))	// positive values only
+#define v4_sqrt(a)		_mm_sqrt_ps(a)
+
+VTF_INLINE float v4_hsum(vtf_v4 a)
+{
+	a = _mm_add_ps(a, _mm_movehl_ps(a,a));
+	a = _mm_add_ss(a, _mm_shuffle_ps(a,a,1));
+	return _mm_cvtss_f32(a);
+}
+
+#else
+
+typedef struct { float v[4]; } vtf_v4;
+
+VTF_INLINE vtf_v4 v4_set(float x, float y, float z, float w)	{ vtf_v4 r; r.v[0] = x; r.v[1] = y; r.v[2] = z; r.v[3] = w; return r; }
+VTF_INLINE vtf_v4 v4_splat(float x)								{ return v4_set(x,x,x,x); }
+VTF_INLINE vtf_v4 v4_zero()										{ return v4_set(0,0,0,0); }
+VTF_INLINE vtf_v4 v4_load(const float* p)						{ return v4_set(p[0],p[1],p[2],p[3]); }
+VTF_INLINE void   v4_store(float* p, vtf_v4 a)					{ p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+VTF_INLINE vtf_v4 v4_add(vtf_v4 a, vtf_v4 b)					{ return v4_set(a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2], a.v[3]+b.v[3]); }
+VTF_INLINE vtf_v4 v4_sub(vtf_v4 a, vtf_v4 b)					{ return v4_set(a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2], a.v[3]-b.v[3]); }
+VTF_INLINE vtf_v4 v4_mul(vtf_v4 a, vtf_v4 b)					{ return v4_set(a.v[0]*b.v[0], a.v[1]*b.v[1], a.v[2]*b.v[2], a.v[3]*b.v[3]); }
+VTF_INLINE vtf_v4 v4_min(vtf_v4 a, vtf_v4 b)					{ return v4_set(a.v[0] < b.v[0] ? a.v[0] : b.v[0], a.v[1] < b.v[1] ? a.v[1] : b.v[1], a.v[2] < b.v[2] ? a.v[2] : b.v[2], a.v[3] < b.v[3] ? a.v[3] : b.v[3]); }
+VTF_INLINE vtf_v4 v4_max(vtf_v4 a, vtf_v4 b)					{ return v4_set(a.v[0] > b.v[0] ? a.v[0] : b.v[0], a.v[1] > b.v[1] ? a.v[1] : b.v[1], a.v[2] > b.v[2] ? a.v[2] : b.v[2], a.v[3] > b.v[3] ? a.v[3] : b.v[3]); }
+VTF_INLINE vtf_v4 v4_madd(vtf_v4 a, vtf_v4 b, vtf_v4 c)			{ return v4_add(v4_mul(a,b),c); }
+VTF_INLINE vtf_v4 v4_floor_pos(vtf_v4 a)						{ return v4_set((float)(gint)a.v[0], (float)(gint)a.v[1], (float)(gint)a.v[2], (float)(gint)a.v[3]); }
+VTF_INLINE vtf_v4 v4_sqrt(vtf_v4 a)								{ return v4_set((float)sqrt(a.v[0]), (float)sqrt(a.v[1]), (float)sqrt(a.v[2]), (float)sqrt(a.v[3])); }
+VTF_INLINE float  v4_hsum(vtf_v4 a)								{ return (a.v[0] + a.v[2]) + (a.v[1] + a.v[3]); }
+
+#endif
+
+#endif
@@ -10,6 +10,7 @@
  */
 
 #include "file-vtf.h"
+#include "file-vtf-pool.h"
 
 #ifdef _DEBUG
 #include <libgimp/gimpui.h>
@@ -41,7 +42,12 @@ static void query()
 	{
 		{ GIMP_PDB_INT32,	"run-mode",		"Interactive, non-interactive" },
 		{ GIMP_PDB_STRING,	"filename",		"The name of the file to load" },
-		{ GIMP_PDB_STRING,	"raw-filename",	"The name of the file to load" }
+		{ GIMP_PDB_STRING,	"raw-filename",	"The name of the file to load" },
+		// new in 1.3. GIMP passes 0 for arguments its caller didn't give, so 0 always means everything.
+		{ GIMP_PDB_INT32,	"first-layer",	"First frame or slice to load, from 0" },
+		{ GIMP_PDB_INT32,	"layer-count",	"Number of frames or slices to load (0 = all from first-layer on)" },
+		{ GIMP_PDB_INT32,	"faces",		"Cube map faces to load, as a bitmask (0 = all)" },
+		{ GIMP_PDB_INT32,	"mip-level",	"Mipmap to load (0 = full size)" },
 	};
 	static const GimpParamDef load_return_vals[] =
 	{
@@ -60,6 +66,27 @@ static void query()
 		{ GIMP_PDB_INT32,  "image-height", "Height of full-sized image"    }
 	};
 
+	static const GimpParamDef info_args[] =
+	{
+		{ GIMP_PDB_STRING, "filename",     "The name of the file to examine" }
+	};
+	static const GimpParamDef info_return_vals[] =
+	{
+		{ GIMP_PDB_INT32,  "version-major", "VTF major version (always 7)" },
+		{ GIMP_PDB_INT32,  "version-minor", "VTF minor version (7.n)" },
+		{ GIMP_PDB_INT32,  "width",        "Width of the largest mipmap" },
+		{ GIMP_PDB_INT32,  "height",       "Height of the largest mipmap" },
+		{ GIMP_PDB_INT32,  "depth",        "Number of slices" },
+		{ GIMP_PDB_INT32,  "frames",       "Number of animation frames" },
+		{ GIMP_PDB_INT32,  "faces",        "Number of cube map faces (1 if not a cube map)" },
+		{ GIMP_PDB_INT32,  "mip-count",    "Number of mipmaps, including the full-size image" },
+		{ GIMP_PDB_INT32,  "format",       "Pixel format (VTFImageFormat)" },
+		{ GIMP_PDB_STRING, "format-name",  "Name of the pixel format" },
+		{ GIMP_PDB_INT32,  "flags",        "Texture flags" },
+		{ GIMP_PDB_INT32,  "lod-control-u", "Power of 2 which describes the width of the standard mipmap (0 = undefined)" },
+		{ GIMP_PDB_INT32,  "lod-control-v", "Power of 2 which describes the height of the standard mipmap (0 = undefined)" }
+	};
+
 	static const GimpParamDef save_args[] =
 	{
 		{ GIMP_PDB_INT32,	"run-mode",		"Interactive, non-interactive" },
@@ -80,6 +107,13 @@ static void query()
 		{ GIMP_PDB_INT8,	"lod-control-v",	"Power of 2 which describes the height of the standard mipmap (0 = undefined)" },
 		// new in 1.2
 		{ GIMP_PDB_LAYER,	"target-lg",	"The layer group being saved. (-1 = ignore layer groups)" },
+		// new in 1.3
+		{ GIMP_PDB_INT8,	"dxt-quality",	"DXT compression quality: 0 = fast, 1 = normal, 2 = high" },
+		{ GIMP_PDB_INT32,	"threads",		"Number of compression threads (0 = " VTF_THREADS_ENV " or one per processor)" },
+		{ GIMP_PDB_INT8,	"mip-filter",	"Mipmap filter: 0 = box, 1 = Kaiser, 2 = Lanczos, 3 = Mitchell" },
+		{ GIMP_PDB_INT8,	"mip-gamma",	"Filter mipmaps in linear colour space? (ignored for bump maps)" },
+		{ GIMP_PDB_INT8,	"mip-toksvig",	"Fade bump map alpha where mipmapped normals disagree? (bump maps only)" },
+		{ GIMP_PDB_INT32,	"frames-in-flight",	"Number of frames, faces or slices held in memory while saving (0 = two per thread)" },
 	} ;
 
 	// no effect
@@ -116,6 +150,19 @@ static void query()
 
   gimp_register_thumbnail_loader (LOAD_PROC, THUMB_PROC);
 
+	gimp_install_procedure (INFO_PROC,
+		"Reads the properties of a Valve Texture Format file",
+		"Reads a VTF's version, size, format, flags and LOD settings from its header, without loading any image data.",
+		COPYRIGHT,
+		COPYRIGHT,
+		RELEASE_DATE,
+		NULL,
+		NULL,
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (info_args),
+		G_N_ELEMENTS (info_return_vals),
+		info_args, info_return_vals);
+
 	gimp_install_procedure (SAVE_PROC,
 	"Export to Valve Texture Format",
 	"Writes out Valve Texture Format files with any compression method. Uses VTFLib, by Nem and Wunderboy.",
@@ -136,6 +183,7 @@ G_END_DECLS
 
 void save(gint nparams, const GimpParam* param, gint* nreturn_vals);
 void load(gint nparams, const GimpParam* param, gint* nreturn_vals, gboolean thumb);
+void get_info(gint nparams, const GimpParam* param, gint* nreturn_vals);
 void remove_dummy_lg();
 
 #ifdef _WIN32
@@ -200,6 +248,8 @@ static void run(const gchar* name, gint nparams, const GimpParam* param, gint* n
 			load(nparams,param,nreturn_vals,FALSE);
 		else if (strcmp (name, THUMB_PROC) == 0)
 			load(nparams,param,nreturn_vals,TRUE);
+		else if (strcmp (name, INFO_PROC) == 0)
+			get_info(nparams,param,nreturn_vals);
 	}		
 	else
 		record_error((gchar*)vlGetLastError(),GIMP_PDB_EXECUTION_ERROR);
@@ -207,6 +257,8 @@ static void run(const gchar* name, gint nparams, const GimpParam* param, gint* n
 	vlDeleteImage(vtf_bindcode);
 	vlShutdown();
 
+	vtf_pool_shutdown();
+
 	remove_dummy_lg();
 
 	if (image_ID != -1)
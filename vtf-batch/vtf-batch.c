@@ -0,0 +1,627 @@
+/*
+ * GIMP VTF
+ * Copyright (C) 2010 Tom Edwards
+
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later
+ * version.
+ */
+
+// vtf-batch: converts a directory tree of images to VTFs without GIMP, using the plug-in's formats, options
+// and encoder. Several files are converted at once, sharing one pool of compression threads.
+//
+//   vtf-batch [OPTION...] SOURCE-DIR [OUTPUT-DIR]
+//
+// Images are read with gdk-pixbuf. Each one becomes a VTF at the same relative path in OUTPUT-DIR (or beside
+// it), with its file name in lower case, unless that VTF is already newer than both the image and the manifest.
+
+#include "file-vtf-encode.h"
+#include "file-vtf-io.h"
+#include "file-vtf-pool.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <locale.h>
+#include <string.h>
+
+typedef enum VtfBatchResult
+{
+	BATCH_CONVERTED = 0,
+	BATCH_UP_TO_DATE,
+	BATCH_SKIPPED,
+	BATCH_FAILED
+} VtfBatchResult_t;
+
+#define BATCH_RESULT_COUNT 4
+
+typedef struct VtfBatchJob
+{
+	gchar*				source;
+	gchar*				relative;	// to SOURCE-DIR, with '/' separators and in lower case. What the manifest matches.
+	gchar*				dest;
+	VtfSaveOptions_t	opt;
+	struct VtfBatchJob*	clash;		// another image which would become the same VTF
+} VtfBatchJob_t;
+
+typedef struct VtfBatch
+{
+	GPtrArray*		jobs;
+	volatile gint	next;
+	volatile gint	results[BATCH_RESULT_COUNT];
+} VtfBatch_t;
+
+/*
+ * Manifest
+ */
+
+// A GKeyFile whose group names are patterns (see g_pattern_match_simple()), matched against each image's
+// relative path. The keys of every group which matches are applied in order, over the plug-in's defaults.
+typedef struct VtfBatchKey
+{
+	const gchar*		name;	// the VtfSaveOptions_t member
+	glong				offset;
+	guint				size;
+	const gchar* const*	values;	// names for 0, 1, 2... or NULL if only numbers will do
+	gint64				min, max;
+} VtfBatchKey_t;
+
+#define VTF_BATCH_KEY(member,values,min,max) { #member, G_STRUCT_OFFSET(VtfSaveOptions_t,member), sizeof(((VtfSaveOptions_t*)0)->member), values, min, max }
+
+static const gchar* const	bool_values[] = { "false", "true", NULL };
+static const gchar* const	bump_values[] = { "none", "bump", "ssbump", NULL };
+static const gchar* const	dxt_quality_values[] = { "fast", "normal", "high", NULL };
+static const gchar* const	mip_filter_values[] = { "box", "kaiser", "lanczos", "mitchell", NULL };
+
+// Layer use and alpha layers need layers, so they aren't here. PixelFormat is a label from vtf_formats[],
+// and Version is 7.n or just n.
+static const VtfBatchKey_t vtf_batch_keys[] = {
+	VTF_BATCH_KEY(Enabled,		bool_values,		0, 1),
+	VTF_BATCH_KEY(Version,		NULL,				2, 5),
+	VTF_BATCH_KEY(WithAlpha,	bool_values,		0, 1),
+	VTF_BATCH_KEY(Compress,		bool_values,		0, 1),
+	VTF_BATCH_KEY(PixelFormat,	NULL,				0, G_N_ELEMENTS(vtf_formats) - 1),
+	VTF_BATCH_KEY(Clamp,		bool_values,		0, 1),
+	VTF_BATCH_KEY(NoLOD,		bool_values,		0, 1),
+	VTF_BATCH_KEY(WithMips,		bool_values,		0, 1),
+	VTF_BATCH_KEY(BumpType,		bump_values,		NOT_BUMP, SSBUMP),
+	VTF_BATCH_KEY(GeneralFlags,	NULL,				0, G_MAXUINT32),
+	VTF_BATCH_KEY(LodControlU,	NULL,				0, 15),
+	VTF_BATCH_KEY(LodControlV,	NULL,				0, 15),
+	VTF_BATCH_KEY(DxtQuality,	dxt_quality_values,	0, DXT_QUALITY_COUNT - 1),
+	VTF_BATCH_KEY(MipFilter,	mip_filter_values,	0, MIP_FILTER_COUNT - 1),
+	VTF_BATCH_KEY(MipGamma,		bool_values,		0, 1),
+	VTF_BATCH_KEY(MipToksvig,	bool_values,		0, 1),
+};
+
+typedef struct VtfBatchSetting
+{
+	const VtfBatchKey_t*	key;
+	gint64					value;
+} VtfBatchSetting_t;
+
+typedef struct VtfBatchRule
+{
+	GPatternSpec*		pattern;
+	guint				num_settings;
+	VtfBatchSetting_t*	settings;
+} VtfBatchRule_t;
+
+static VtfBatchRule_t*	rules = NULL;
+static guint			num_rules = 0;
+static gint64			manifest_mtime = 0;
+
+static gchar*	manifest_path = NULL;
+static gint		num_jobs = 0;
+static gint		num_threads = 0;
+static gboolean	force = FALSE;
+static gboolean	quiet = FALSE;
+
+static GOptionEntry vtf_batch_entries[] = {
+	{ "manifest",	'm', 0, G_OPTION_ARG_FILENAME,	&manifest_path,	"Options for the images whose paths match each group of FILE", "FILE" },
+	{ "jobs",		'j', 0, G_OPTION_ARG_INT,		&num_jobs,		"Images converted at once (default: one per processor)", "N" },
+	{ "threads",	't', 0, G_OPTION_ARG_INT,		&num_threads,	"Compression threads shared by every job (default: " VTF_THREADS_ENV " or one per processor)", "N" },
+	{ "force",		'f', 0, G_OPTION_ARG_NONE,		&force,			"Convert images even if their VTF is up to date", NULL },
+	{ "quiet",		'q', 0, G_OPTION_ARG_NONE,		&quiet,			"Only report errors", NULL },
+	{ NULL }
+};
+
+static const gchar* vtf_batch_description =
+	"Manifest groups are patterns such as [*] or [materials/*_normal.*], where * and ? match any characters\n"
+	"including '/'. Their keys are the plug-in's export options:\n"
+	"\n"
+	"  Enabled=false              don't convert these images\n"
+	"  Compress, WithAlpha        the simple format choice (default: DXT1)\n"
+	"  PixelFormat=DXT5           any format from the plug-in's list, by name\n"
+	"  Version=7.4                VTF version, 7.2 to 7.5\n"
+	"  WithMips, NoLOD, Clamp     true or false\n"
+	"  BumpType=bump              none, bump or ssbump\n"
+	"  DxtQuality=high            fast, normal or high\n"
+	"  MipFilter=lanczos          box, kaiser, lanczos or mitchell\n"
+	"  MipGamma, MipToksvig       true or false\n"
+	"  LodControlU, LodControlV   standard mipmap size, as a power of two\n"
+	"  GeneralFlags=0x800         other TEXTUREFLAGS_ to set\n";
+
+static void vtf_batch_option_set(VtfSaveOptions_t* opt, const VtfBatchKey_t* key, gint64 value)
+{
+	guint8* member = (guint8*)opt + key->offset;
+
+	switch (key->size)
+	{
+	case 1:		*(guint8*)member = (guint8)value; break;
+	case 2:		*(guint16*)member = (guint16)value; break;
+	default:	*(guint32*)member = (guint32)value; break;
+	}
+
+	// Naming a format is what the plug-in's advanced setup does
+	if (key->offset == G_STRUCT_OFFSET(VtfSaveOptions_t,PixelFormat))
+		opt->AdvancedSetup = TRUE;
+}
+
+static gboolean vtf_batch_parse_value(const VtfBatchKey_t* key, const gchar* text, gint64* value)
+{
+	gchar*	end;
+	guint	i;
+
+	for (i = 0; key->values && key->values[i]; i++)
+		if ( g_ascii_strcasecmp(text,key->values[i]) == 0 )
+		{
+			*value = i;
+			return TRUE;
+		}
+
+	if (key->offset == G_STRUCT_OFFSET(VtfSaveOptions_t,PixelFormat))
+		for (i = 0; i < num_vtf_formats; i++)
+			if ( g_ascii_strcasecmp(text,vtf_formats[i].label) == 0 )
+			{
+				*value = i;
+				return TRUE;
+			}
+
+	if (key->offset == G_STRUCT_OFFSET(VtfSaveOptions_t,Version) && g_str_has_prefix(text,"7."))
+		text += 2;
+
+	*value = g_ascii_strtoll(text,&end,0);
+	return end != text && *end == 0 && *value >= key->min && *value <= key->max;
+}
+
+static const VtfBatchKey_t* vtf_batch_find_key(const gchar* name)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_batch_keys); i++)
+		if ( g_ascii_strcasecmp(name,vtf_batch_keys[i].name) == 0 )
+			return &vtf_batch_keys[i];
+	return NULL;
+}
+
+// Reads and checks the whole manifest up front, so that a mistake stops the build before anything is converted
+static gboolean vtf_batch_load_manifest(const gchar* path)
+{
+	GKeyFile*		file = g_key_file_new();
+	GError*			error = NULL;
+	gchar**			groups;
+	gchar**			keys;
+	gchar*			text;
+	gchar*			pattern;
+	gint64			size;
+	gsize			num_keys, i, k;
+	gboolean		result;
+
+	result = g_key_file_load_from_file(file,path,G_KEY_FILE_NONE,&error) && vtf_file_stat(path,&size,&manifest_mtime);
+	if (!result)
+	{
+		g_printerr("%s: %s\n",path,error ? error->message : g_strerror(errno));
+		g_clear_error(&error);
+		g_key_file_free(file);
+		return FALSE;
+	}
+
+	groups = g_key_file_get_groups(file,&i);
+	num_rules = (guint)i;
+	rules = g_new0(VtfBatchRule_t,num_rules);
+
+	for (i = 0; i < num_rules && result; i++)
+	{
+		pattern = g_ascii_strdown(groups[i],-1);
+		rules[i].pattern = g_pattern_spec_new(pattern);
+		g_free(pattern);
+
+		keys = g_key_file_get_keys(file,groups[i],&num_keys,NULL);
+		rules[i].settings = g_new(VtfBatchSetting_t,num_keys);
+
+		for (k = 0; k < num_keys && result; k++)
+		{
+			VtfBatchSetting_t* setting = &rules[i].settings[rules[i].num_settings];
+
+			text = g_strstrip(g_key_file_get_value(file,groups[i],keys[k],NULL));
+			setting->key = vtf_batch_find_key(keys[k]);
+
+			if (!setting->key)
+			{
+				g_printerr("%s: [%s] %s is not an export option\n",path,groups[i],keys[k]);
+				result = FALSE;
+			}
+			else if ( !vtf_batch_parse_value(setting->key,text,&setting->value) )
+			{
+				g_printerr("%s: [%s] %s can't be \"%s\"\n",path,groups[i],keys[k],text);
+				result = FALSE;
+			}
+			else
+				rules[i].num_settings++;
+
+			g_free(text);
+		}
+		g_strfreev(keys);
+	}
+
+	g_strfreev(groups);
+	g_key_file_free(file);
+	return result;
+}
+
+static void vtf_batch_options(const gchar* relative, VtfSaveOptions_t* opt)
+{
+	guint i, s;
+
+	memcpy(opt,&DefaultSaveOptions,sizeof(VtfSaveOptions_t));
+
+	for (i = 0; i < num_rules; i++)
+		if ( g_pattern_match_string(rules[i].pattern,relative) )
+			for (s = 0; s < rules[i].num_settings; s++)
+				vtf_batch_option_set(opt,rules[i].settings[s].key,rules[i].settings[s].value);
+}
+
+static void vtf_batch_free_manifest()
+{
+	guint i;
+
+	for (i = 0; i < num_rules; i++)
+	{
+		g_pattern_spec_free(rules[i].pattern);
+		g_free(rules[i].settings);
+	}
+	g_free(rules);
+	rules = NULL;
+	num_rules = 0;
+}
+
+/*
+ * Conversion
+ */
+
+// The encoder reports errors with IDs from the plug-in's file-vtf_en.po. Build machines tend to run in the
+// C locale, where gettext won't even fall back on English, so the few it can report are repeated here.
+static const gchar* const vtf_batch_messages[][2] = {
+	{ "#file_write_error",	"Could not write to the file." },
+	{ "#no_memory_error",	"Out of memory." },
+	{ "#unknown_error",		"Unknown error." },
+};
+
+static const gchar* vtf_batch_message(const gchar* id)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_batch_messages); i++)
+		if ( strcmp(id,vtf_batch_messages[i][0]) == 0 )
+			return vtf_batch_messages[i][1];
+	return id; // VTFLib's own
+}
+
+static const gchar* const vtf_batch_extensions[] = { ".png", ".tga", ".bmp", ".jpg", ".jpeg", ".tif", ".tiff" };
+
+static gboolean vtf_batch_is_image(const gchar* name)
+{
+	gchar*		lower = g_ascii_strdown(name,-1);
+	gboolean	result = FALSE;
+	guint		i;
+
+	for (i = 0; i < G_N_ELEMENTS(vtf_batch_extensions) && !result; i++)
+		result = g_str_has_suffix(lower,vtf_batch_extensions[i]);
+
+	g_free(lower);
+	return result;
+}
+
+static gboolean vtf_batch_read_image(guint index, guint num_images, vlByte* rgba, gpointer user_data)
+{
+	GdkPixbuf*		pixbuf = (GdkPixbuf*)user_data;
+	const guint8*	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	gint			width = gdk_pixbuf_get_width(pixbuf), height = gdk_pixbuf_get_height(pixbuf);
+	gint			stride = gdk_pixbuf_get_rowstride(pixbuf), channels = gdk_pixbuf_get_n_channels(pixbuf);
+	gint			x, y;
+
+	for (y = 0; y < height; y++)
+	{
+		const guint8* src = pixels + (gsize)y * stride;
+
+		for (x = 0; x < width; x++, src += channels, rgba += 4)
+		{
+			rgba[0] = src[0];
+			rgba[1] = src[1];
+			rgba[2] = src[2];
+			rgba[3] = channels == 4 ? src[3] : 255;
+		}
+	}
+	return TRUE;
+}
+
+// gdk-pixbuf loads everything as RGB, so greyscale images (which simple setups save as I8 or IA88) are found
+// by their pixels
+static gboolean vtf_batch_is_grey(GdkPixbuf* pixbuf)
+{
+	const guint8*	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	gint			width = gdk_pixbuf_get_width(pixbuf), height = gdk_pixbuf_get_height(pixbuf);
+	gint			stride = gdk_pixbuf_get_rowstride(pixbuf), channels = gdk_pixbuf_get_n_channels(pixbuf);
+	gint			x, y;
+
+	for (y = 0; y < height; y++)
+	{
+		const guint8* src = pixels + (gsize)y * stride;
+
+		for (x = 0; x < width; x++, src += channels)
+			if (src[0] != src[1] || src[0] != src[2])
+				return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean vtf_batch_up_to_date(const VtfBatchJob_t* job)
+{
+	gint64 source_size, source_mtime, dest_size, dest_mtime;
+
+	return vtf_file_stat(job->dest,&dest_size,&dest_mtime) && vtf_file_stat(job->source,&source_size,&source_mtime)
+		&& dest_mtime >= source_mtime && dest_mtime >= manifest_mtime;
+}
+
+static VtfBatchResult_t vtf_batch_convert(const VtfBatchJob_t* job)
+{
+	GdkPixbuf*		pixbuf;
+	GError*			error = NULL;
+	VtfStream_t		stream;
+	gchar*			dir;
+	guint			width, height, format_index;
+	gboolean		grey, result;
+
+	if (!job->opt.Enabled)
+		return BATCH_SKIPPED;
+	if (job->clash)
+	{
+		g_printerr("%s: %s would also be made from %s\n",job->source,job->dest,job->clash->source);
+		return BATCH_FAILED;
+	}
+	if ( !force && vtf_batch_up_to_date(job) )
+		return BATCH_UP_TO_DATE;
+
+	pixbuf = gdk_pixbuf_new_from_file(job->source,&error);
+	if (!pixbuf)
+	{
+		g_printerr("%s: %s\n",job->source,error->message);
+		g_error_free(error);
+		return BATCH_FAILED;
+	}
+
+	width = gdk_pixbuf_get_width(pixbuf);
+	height = gdk_pixbuf_get_height(pixbuf);
+	if ( (width & (width - 1)) || (height & (height - 1)) )
+	{
+		g_printerr("%s: %ux%u is not a power of two in both directions\n",job->source,width,height);
+		g_object_unref(pixbuf);
+		return BATCH_FAILED;
+	}
+
+	grey = !job->opt.AdvancedSetup && !job->opt.Compress && vtf_batch_is_grey(pixbuf);
+	format_index = vtf_select_format(&job->opt,grey);
+
+	dir = g_path_get_dirname(job->dest);
+	g_mkdir_with_parents(dir,0755);
+	g_free(dir);
+
+	vtf_stream_init(&stream,&job->opt,format_index,width,height,1);
+	result = vtf_stream_images(&stream,job->dest,vtf_batch_read_image,NULL,pixbuf);
+
+	if (result)
+	{
+		if (!quiet)
+			g_print("%s\n",job->dest);
+	}
+	else
+		g_printerr("%s: %s\n",job->dest,vtf_batch_message(stream.error[0] ? stream.error : "#unknown_error"));
+
+	g_free(stream.hashes);
+	g_object_unref(pixbuf);
+	return result ? BATCH_CONVERTED : BATCH_FAILED;
+}
+
+// Each job takes the next image until there are none left
+static gpointer vtf_batch_worker(gpointer data)
+{
+	VtfBatch_t*	batch = (VtfBatch_t*)data;
+	guint		index;
+
+	while ( (index = (guint)g_atomic_int_add(&batch->next,1)) < batch->jobs->len )
+		g_atomic_int_inc(&batch->results[vtf_batch_convert((const VtfBatchJob_t*)g_ptr_array_index(batch->jobs,index))]);
+
+	return NULL;
+}
+
+static void vtf_batch_free_job(gpointer data)
+{
+	VtfBatchJob_t* job = (VtfBatchJob_t*)data;
+
+	g_free(job->source);
+	g_free(job->relative);
+	g_free(job->dest);
+	g_free(job);
+}
+
+static gint vtf_batch_compare_jobs(gconstpointer a, gconstpointer b)
+{
+	return strcmp((*(const VtfBatchJob_t**)a)->relative,(*(const VtfBatchJob_t**)b)->relative);
+}
+
+// Collects every image below 'dir'. Symbolic links to directories aren't followed, in case they loop.
+static void vtf_batch_find_images(VtfBatch_t* batch, const gchar* dir, const gchar* relative, const gchar* output_dir)
+{
+	GDir*			handle;
+	GError*			error = NULL;
+	const gchar*	name;
+	gchar*			path;
+	gchar*			child;
+	gchar*			dest_dir;
+	gchar*			dest_name;
+	VtfBatchJob_t*	job;
+
+	handle = g_dir_open(dir,0,&error);
+	if (!handle)
+	{
+		g_printerr("%s\n",error->message);
+		g_error_free(error);
+		batch->results[BATCH_FAILED]++;
+		return;
+	}
+
+	while ( (name = g_dir_read_name(handle)) != NULL )
+	{
+		path = g_build_filename(dir,name,NULL);
+		child = relative ? g_strconcat(relative,"/",name,NULL) : g_strdup(name);
+
+		if ( g_file_test(path,G_FILE_TEST_IS_DIR) )
+		{
+			if ( !g_file_test(path,G_FILE_TEST_IS_SYMLINK) )
+				vtf_batch_find_images(batch,path,child,output_dir);
+		}
+		else if ( vtf_batch_is_image(name) )
+		{
+			job = g_new0(VtfBatchJob_t,1);
+			job->source = path;
+			job->relative = g_ascii_strdown(child,-1);
+			path = NULL;
+
+			// Like the plug-in, VTFs are named in lower case for the benefit of case-sensitive file systems.
+			// Directories keep their names, so that without an OUTPUT-DIR each VTF really is beside its image.
+			dest_dir = relative ? g_build_filename(output_dir,relative,NULL) : g_strdup(output_dir);
+			dest_name = g_ascii_strdown(name,-1);
+			*strrchr(dest_name,'.') = 0;
+			job->dest = g_strconcat(dest_dir,G_DIR_SEPARATOR_S,dest_name,".vtf",NULL);
+			g_free(dest_dir);
+			g_free(dest_name);
+
+			vtf_batch_options(job->relative,&job->opt);
+			g_ptr_array_add(batch->jobs,job);
+		}
+
+		g_free(path);
+		g_free(child);
+	}
+
+	g_dir_close(handle);
+}
+
+// Images whose names differ only in case or extension would become the same VTF, and two jobs writing it at
+// once would make a mess. Since there is no telling which was meant, none of them is converted.
+static void vtf_batch_find_clashes(VtfBatch_t* batch)
+{
+	GHashTable*		dests = g_hash_table_new(g_str_hash,g_str_equal);
+	VtfBatchJob_t*	job;
+	VtfBatchJob_t*	first;
+	guint			i;
+
+	for (i = 0; i < batch->jobs->len; i++)
+	{
+		job = (VtfBatchJob_t*)g_ptr_array_index(batch->jobs,i);
+		if (!job->opt.Enabled)
+			continue;
+
+		first = (VtfBatchJob_t*)g_hash_table_lookup(dests,job->dest);
+		if (first)
+		{
+			job->clash = first;
+			if (!first->clash)
+				first->clash = job;
+		}
+		else
+			g_hash_table_insert(dests,job->dest,job);
+	}
+
+	g_hash_table_destroy(dests);
+}
+
+int main(int argc, char* argv[])
+{
+	GOptionContext*	context;
+	GError*			error = NULL;
+	VtfBatch_t		batch;
+	GThread**		workers;
+	guint			i, num_workers;
+
+	setlocale(LC_ALL,""); // for GLib's and gdk-pixbuf's own messages
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+
+	context = g_option_context_new("SOURCE-DIR [OUTPUT-DIR]");
+	g_option_context_set_summary(context,"Converts every image below SOURCE-DIR to a VTF at the same place in OUTPUT-DIR,\nor beside it if there isn't one.");
+	g_option_context_set_description(context,vtf_batch_description);
+	g_option_context_add_main_entries(context,vtf_batch_entries,NULL);
+
+	if ( !g_option_context_parse(context,&argc,&argv,&error) || argc < 2 || argc > 3 )
+	{
+		if (error)
+			g_printerr("%s\n",error->message);
+		else
+		{
+			gchar* help = g_option_context_get_help(context,TRUE,NULL);
+			g_printerr("%s",help);
+			g_free(help);
+		}
+		g_clear_error(&error);
+		g_option_context_free(context);
+		return 2;
+	}
+	g_option_context_free(context);
+
+	if ( manifest_path && !vtf_batch_load_manifest(manifest_path) )
+		return 2;
+
+	if ( !vlInitialize() )
+	{
+		g_printerr("%s\n",vlGetLastError());
+		return 1;
+	}
+
+	vtf_set_num_threads(MAX(num_threads,0));
+
+	memset(&batch,0,sizeof(VtfBatch_t));
+	batch.jobs = g_ptr_array_new_with_free_func(vtf_batch_free_job);
+	vtf_batch_find_images(&batch,argv[1],NULL,argc > 2 ? argv[2] : argv[1]);
+	g_ptr_array_sort(batch.jobs,vtf_batch_compare_jobs);
+	vtf_batch_find_clashes(&batch);
+
+	// This thread is a job too. Starting the others also starts the compression pool, before any job can.
+	num_workers = MIN(num_jobs > 0 ? (guint)num_jobs : vtf_get_num_threads(),MAX(batch.jobs->len,1));
+	workers = g_new0(GThread*,num_workers);
+	for (i = 1; i < num_workers; i++)
+		workers[i] = vtf_thread_new(vtf_batch_worker,&batch);
+
+	vtf_batch_worker(&batch);
+
+	for (i = 1; i < num_workers; i++)
+		if (workers[i])
+			g_thread_join(workers[i]);
+
+	if (!quiet)
+		g_print("%i converted, %i up to date, %i skipped, %i failed\n",
+			batch.results[BATCH_CONVERTED],batch.results[BATCH_UP_TO_DATE],batch.results[BATCH_SKIPPED],batch.results[BATCH_FAILED]);
+
+	g_free(workers);
+	g_ptr_array_free(batch.jobs,TRUE);
+	vtf_batch_free_manifest();
+	vtf_pool_shutdown();
+	vlShutdown();
+
+	return batch.results[BATCH_FAILED] ? 1 : 0;
+}